@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <math.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "headers.h"
+
+// One benchmarked command, spawned directly without going through the shell on every run
+struct Benchmark {
+    char label[MAX_INPUT_LENGTH];
+    char **argv;
+    struct Words words;         // Parsed once for commands given with -c
+    int parsed;
+    posix_spawn_file_actions_t actions;
+    long long *wall_ns;
+    long *user_us;
+    long *sys_us;
+    int runs;
+    int failures;
+
+    // Summary, wall times in nanoseconds and CPU times in microseconds
+    double mean;
+    double stddev;
+    long long min;
+    long long median;
+    long long p95;
+    long long p99;
+    long long max;
+    double user_mean;
+    double sys_mean;
+};
+
+
+static void print_bench_usage() {
+    printf("Usage: bench [-n <runs>] [-w <warmups>] [-c <command>]... [--show-output] [--export-csv <file>] [--export-json <file>] [-- <command> [<args>...]]\n");
+}
+
+static int compare_wall_times(const void *a, const void *b) {
+    long long wall_a = *(const long long *)a;
+    long long wall_b = *(const long long *)b;
+    return (wall_a > wall_b) - (wall_a < wall_b);
+}
+
+static long long sorted_percentile(const long long *sorted, int count, int p) {
+    // Nearest-rank percentile of wall times sorted in ascending order
+    int rank = (p * count + 99) / 100;
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[rank - 1];
+}
+
+static long timeval_to_us(const struct timeval *tv) {
+    return tv->tv_sec * 1000000L + tv->tv_usec;
+}
+
+// Translates the redirections of the command into spawn file actions, applied after the defaults
+static int add_redirection_actions(struct Benchmark *benchmark) {
+    posix_spawn_file_actions_t *actions = &benchmark->actions;
+
+    for (int i = 0; i < benchmark->words.num_redirections; i++) {
+        struct Redirection *redirection = &benchmark->words.redirections[i];
+        switch (redirection->type) {
+            case REDIRECT_INPUT:
+                posix_spawn_file_actions_addopen(actions, redirection->fd, redirection->target, O_RDONLY, 0);
+                break;
+            case REDIRECT_OUTPUT:
+                posix_spawn_file_actions_addopen(actions, redirection->fd, redirection->target, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+                break;
+            case REDIRECT_APPEND:
+                posix_spawn_file_actions_addopen(actions, redirection->fd, redirection->target, O_CREAT | O_WRONLY | O_APPEND, 0644);
+                break;
+            case REDIRECT_READ_WRITE:
+                posix_spawn_file_actions_addopen(actions, redirection->fd, redirection->target, O_CREAT | O_RDWR, 0644);
+                break;
+            case REDIRECT_DUPLICATE:
+                posix_spawn_file_actions_adddup2(actions, redirection->source_fd, redirection->fd);
+                break;
+            case REDIRECT_CLOSE:
+                posix_spawn_file_actions_addclose(actions, redirection->fd);
+                break;
+            default:
+                // Here-documents and here-strings are consumed by the first run
+                fprintf(stderr, "bench: here-documents and here-strings can't be benchmarked\n");
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static int prepare_benchmark(struct Benchmark *benchmark, int show_output) {
+    if (benchmark->argv[0] == NULL) {
+        fprintf(stderr, "bench: empty command\n");
+        return -1;
+    }
+    for (int i = 0; benchmark->argv[i] != NULL; i++) {
+        if (strcmp(benchmark->argv[i], "|") == 0) {
+            fprintf(stderr, "bench: pipelines can't be benchmarked, use -c \"sh -c '...'\"\n");
+            return -1;
+        }
+    }
+    if (benchmark->parsed && benchmark->words.num_assignments != 0) {
+        fprintf(stderr, "bench: variable assignments can't be benchmarked, export them first\n");
+        return -1;
+    }
+    const char *name = benchmark->argv[0];
+    if (find_gogi_command(name, strlen(name)) != NULL || strcmp(name, "cd") == 0 || strcmp(name, "exit") == 0) {
+        fprintf(stderr, "bench: %s is a GoGiShell command and can't be spawned\n", name);
+        return -1;
+    }
+    if (benchmark->parsed && benchmark->words.num_process_substitutions != 0) {
+        fprintf(stderr, "bench: process substitutions can't be benchmarked\n");
+        return -1;
+    }
+
+    // The terminal is kept out of the measurements: no input, output discarded unless asked for
+    posix_spawn_file_actions_init(&benchmark->actions);
+    posix_spawn_file_actions_addopen(&benchmark->actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (!show_output) {
+        posix_spawn_file_actions_addopen(&benchmark->actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+        posix_spawn_file_actions_adddup2(&benchmark->actions, STDOUT_FILENO, STDERR_FILENO);
+    }
+    if (benchmark->parsed && add_redirection_actions(benchmark) == -1) {
+        posix_spawn_file_actions_destroy(&benchmark->actions);
+        return -1;
+    }
+    return 0;
+}
+
+// Spawns the command once and returns its exit code, or -1 if it couldn't be started
+static int run_benchmark_once(struct Benchmark *benchmark, char **environment, long long *wall_ns, long *user_us, long *sys_us) {
+    struct timespec start, end;
+    struct rusage usage;
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int error = posix_spawnp(&pid, benchmark->argv[0], &benchmark->actions, NULL, benchmark->argv, environment);
+    if (error != 0) {
+        fprintf(stderr, "bench: %s: %s\n", benchmark->argv[0], strerror(error));
+        return -1;
+    }
+    count_spawn((long long)start.tv_sec * 1000000000LL + start.tv_nsec);
+    if (wait_for_child_usage(pid, &status, &usage) == -1) {
+        perror("Internal function waitpid failed");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *wall_ns = (long long)(end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    *user_us = timeval_to_us(&usage.ru_utime);
+    *sys_us = timeval_to_us(&usage.ru_stime);
+    return status_to_exit_code(status);
+}
+
+static void summarize_benchmark(struct Benchmark *benchmark) {
+    int count = benchmark->runs;
+    double total_wall = 0, total_user = 0, total_sys = 0;
+
+    for (int i = 0; i < count; i++) {
+        total_wall += benchmark->wall_ns[i];
+        total_user += benchmark->user_us[i];
+        total_sys += benchmark->sys_us[i];
+    }
+    benchmark->mean = total_wall / count;
+    benchmark->user_mean = total_user / count;
+    benchmark->sys_mean = total_sys / count;
+
+    double squares = 0;
+    for (int i = 0; i < count; i++) {
+        double difference = benchmark->wall_ns[i] - benchmark->mean;
+        squares += difference * difference;
+    }
+    benchmark->stddev = count > 1 ? sqrt(squares / (count - 1)) : 0;
+
+    // Sorted on a copy, the exported samples stay in the order they were measured
+    long long *sorted = malloc(count * sizeof(long long));
+    if (sorted == NULL) {
+        perror("Failed to allocate memory");
+        return;
+    }
+    memcpy(sorted, benchmark->wall_ns, count * sizeof(long long));
+    qsort(sorted, count, sizeof(long long), compare_wall_times);
+    benchmark->min = sorted[0];
+    benchmark->median = sorted_percentile(sorted, count, 50);
+    benchmark->p95 = sorted_percentile(sorted, count, 95);
+    benchmark->p99 = sorted_percentile(sorted, count, 99);
+    benchmark->max = sorted[count - 1];
+    free(sorted);
+}
+
+static void print_benchmark(int number, const struct Benchmark *benchmark, int warmups) {
+    printf("Benchmark %d: %s\n", number, benchmark->label);
+    printf("  runs\t%d (%d failed), %d warmups\n", benchmark->runs, benchmark->failures, warmups);
+    printf("  min\t%.3f ms\n", benchmark->min / 1e6);
+    printf("  mean\t%.3f ms ± %.3f ms\n", benchmark->mean / 1e6, benchmark->stddev / 1e6);
+    printf("  median\t%.3f ms\n", benchmark->median / 1e6);
+    printf("  p95\t%.3f ms\n", benchmark->p95 / 1e6);
+    printf("  p99\t%.3f ms\n", benchmark->p99 / 1e6);
+    printf("  max\t%.3f ms\n", benchmark->max / 1e6);
+    printf("  user\t%.3f ms mean\n", benchmark->user_mean / 1e3);
+    printf("  sys\t%.3f ms mean\n", benchmark->sys_mean / 1e3);
+}
+
+static void print_comparison(const struct Benchmark *benchmarks, int count) {
+    int fastest = 0;
+    for (int i = 1; i < count; i++) {
+        if (benchmarks[i].mean < benchmarks[fastest].mean) {
+            fastest = i;
+        }
+    }
+
+    printf("Summary\n");
+    printf("  %s ran fastest\n", benchmarks[fastest].label);
+    for (int i = 0; i < count; i++) {
+        if (i != fastest && benchmarks[fastest].mean > 0) {
+            printf("  %.2fx slower: %s\n", benchmarks[i].mean / benchmarks[fastest].mean, benchmarks[i].label);
+        }
+    }
+}
+
+static void write_csv_field(FILE *file, const char *text) {
+    fputc('"', file);
+    for (const char *p = text; *p != '\0'; p++) {
+        if (*p == '"') {
+            fputc('"', file);
+        }
+        fputc(*p, file);
+    }
+    fputc('"', file);
+}
+
+static void write_json_string(FILE *file, const char *text) {
+    fputc('"', file);
+    for (const unsigned char *p = (const unsigned char *)text; *p != '\0'; p++) {
+        if (*p == '"' || *p == '\\') {
+            fprintf(file, "\\%c", *p);
+        } else if (*p < 0x20) {
+            fprintf(file, "\\u%04x", *p);
+        } else {
+            fputc(*p, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static int export_csv(const char *path, const struct Benchmark *benchmarks, int count) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Failed to open file for CSV export");
+        return -1;
+    }
+
+    // Times in seconds, like the other benchmarking tools export them
+    fprintf(file, "command,runs,failed,mean,stddev,min,median,p95,p99,max,user,sys\n");
+    for (int i = 0; i < count; i++) {
+        const struct Benchmark *benchmark = &benchmarks[i];
+        write_csv_field(file, benchmark->label);
+        fprintf(file, ",%d,%d,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.9f,%.6f,%.6f\n",
+                benchmark->runs, benchmark->failures, benchmark->mean / 1e9, benchmark->stddev / 1e9,
+                benchmark->min / 1e9, benchmark->median / 1e9, benchmark->p95 / 1e9, benchmark->p99 / 1e9,
+                benchmark->max / 1e9, benchmark->user_mean / 1e6, benchmark->sys_mean / 1e6);
+    }
+    fclose(file);
+    return 0;
+}
+
+static int export_json(const char *path, const struct Benchmark *benchmarks, int count) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Failed to open file for JSON export");
+        return -1;
+    }
+
+    fprintf(file, "{\"results\": [");
+    for (int i = 0; i < count; i++) {
+        const struct Benchmark *benchmark = &benchmarks[i];
+        fprintf(file, "%s\n  {\"command\": ", i == 0 ? "" : ",");
+        write_json_string(file, benchmark->label);
+        fprintf(file, ", \"runs\": %d, \"failed\": %d, \"mean\": %.9f, \"stddev\": %.9f, \"min\": %.9f, "
+                      "\"median\": %.9f, \"p95\": %.9f, \"p99\": %.9f, \"max\": %.9f, \"user\": %.6f, \"sys\": %.6f, \"times\": [",
+                benchmark->runs, benchmark->failures, benchmark->mean / 1e9, benchmark->stddev / 1e9,
+                benchmark->min / 1e9, benchmark->median / 1e9, benchmark->p95 / 1e9, benchmark->p99 / 1e9,
+                benchmark->max / 1e9, benchmark->user_mean / 1e6, benchmark->sys_mean / 1e6);
+        for (int j = 0; j < benchmark->runs; j++) {
+            fprintf(file, "%s%.9f", j == 0 ? "" : ", ", benchmark->wall_ns[j] / 1e9);
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return 0;
+}
+
+static void free_benchmark(struct Benchmark *benchmark) {
+    free(benchmark->wall_ns);
+    free(benchmark->user_us);
+    free(benchmark->sys_us);
+    if (benchmark->parsed) {
+        free_words(&benchmark->words);
+    }
+}
+
+void bench(char *args[]) {
+    struct Benchmark benchmarks[MAX_BENCH_COMMANDS];
+    int num_benchmarks = 0;
+    long runs = 10, warmups = 0;
+    int show_output = 0;
+    const char *csv_path = NULL, *json_path = NULL;
+    char *end;
+
+    last_status = 1;
+    for (int i = 1; args[i] != NULL; i++) {
+        int is_command = strcmp(args[i], "-c") == 0 || strcmp(args[i], "--") == 0;
+        if (is_command && (num_benchmarks == MAX_BENCH_COMMANDS || args[i + 1] == NULL)) {
+            print_bench_usage();
+            goto cleanup;
+        }
+
+        if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL) {
+            runs = strtol(args[++i], &end, 10);
+            if (*end != '\0' || runs <= 0) {
+                print_bench_usage();
+                goto cleanup;
+            }
+        } else if (strcmp(args[i], "-w") == 0 && args[i + 1] != NULL) {
+            warmups = strtol(args[++i], &end, 10);
+            if (*end != '\0' || warmups < 0) {
+                print_bench_usage();
+                goto cleanup;
+            }
+        } else if (strcmp(args[i], "--export-csv") == 0 && args[i + 1] != NULL) {
+            csv_path = args[++i];
+        } else if (strcmp(args[i], "--export-json") == 0 && args[i + 1] != NULL) {
+            json_path = args[++i];
+        } else if (strcmp(args[i], "--show-output") == 0) {
+            show_output = 1;
+        } else if (strcmp(args[i], "-c") == 0) {
+            // A whole command line, parsed here once so the loop only spawns
+            struct Benchmark *benchmark = &benchmarks[num_benchmarks];
+            memset(benchmark, 0, sizeof(*benchmark));
+            snprintf(benchmark->label, sizeof(benchmark->label), "%s", args[++i]);
+            if (parse_input(benchmark->label, &benchmark->words) == -1) {
+                goto cleanup;
+            }
+            benchmark->parsed = 1;
+            benchmark->argv = benchmark->words.argv;
+            num_benchmarks++;
+        } else if (strcmp(args[i], "--") == 0) {
+            // The remaining words are already split, they are passed as they are
+            struct Benchmark *benchmark = &benchmarks[num_benchmarks++];
+            memset(benchmark, 0, sizeof(*benchmark));
+            benchmark->argv = &args[i + 1];
+            for (int j = i + 1; args[j] != NULL; j++) {
+                size_t length = strlen(benchmark->label);
+                snprintf(benchmark->label + length, sizeof(benchmark->label) - length, "%s%s", j == i + 1 ? "" : " ", args[j]);
+            }
+            break;
+        } else {
+            print_bench_usage();
+            goto cleanup;
+        }
+    }
+    if (num_benchmarks == 0) {
+        print_bench_usage();
+        goto cleanup;
+    }
+
+    int prepared = 0;
+    for (; prepared < num_benchmarks; prepared++) {
+        struct Benchmark *benchmark = &benchmarks[prepared];
+        if (prepare_benchmark(benchmark, show_output) == -1) {
+            break;
+        }
+        benchmark->wall_ns = malloc(runs * sizeof(long long));
+        benchmark->user_us = malloc(runs * sizeof(long));
+        benchmark->sys_us = malloc(runs * sizeof(long));
+        if (benchmark->wall_ns == NULL || benchmark->user_us == NULL || benchmark->sys_us == NULL) {
+            perror("Failed to allocate memory");
+            posix_spawn_file_actions_destroy(&benchmark->actions);
+            break;
+        }
+    }
+
+    char **environment = get_environment();
+    int failed = prepared < num_benchmarks;
+
+    for (int b = 0; b < prepared && !failed; b++) {
+        struct Benchmark *benchmark = &benchmarks[b];
+        long long wall_ns;
+        long user_us, sys_us;
+
+        for (int i = 0; i < warmups && !failed; i++) {
+            failed = run_benchmark_once(benchmark, environment, &wall_ns, &user_us, &sys_us) == -1;
+        }
+        for (int i = 0; i < runs && !failed; i++) {
+            int exit_code = run_benchmark_once(benchmark, environment, &benchmark->wall_ns[i], &benchmark->user_us[i], &benchmark->sys_us[i]);
+            if (exit_code == -1) {
+                failed = 1;
+            } else {
+                benchmark->runs++;
+                if (exit_code != 0) {
+                    benchmark->failures++;
+                }
+            }
+        }
+        if (!failed) {
+            summarize_benchmark(benchmark);
+            print_benchmark(b + 1, benchmark, warmups);
+        }
+    }
+
+    if (!failed) {
+        if (num_benchmarks > 1) {
+            print_comparison(benchmarks, num_benchmarks);
+        }
+        int exported = (csv_path == NULL || export_csv(csv_path, benchmarks, num_benchmarks) == 0) &&
+                       (json_path == NULL || export_json(json_path, benchmarks, num_benchmarks) == 0);
+
+        int failures = 0;
+        for (int b = 0; b < num_benchmarks; b++) {
+            failures += benchmarks[b].failures;
+        }
+        last_status = exported && failures == 0 ? 0 : 1;
+    }
+
+    for (int b = 0; b < prepared; b++) {
+        posix_spawn_file_actions_destroy(&benchmarks[b].actions);
+    }
+
+cleanup:
+    for (int b = 0; b < num_benchmarks; b++) {
+        free_benchmark(&benchmarks[b]);
+    }
+}
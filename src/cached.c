@@ -0,0 +1,472 @@
+#define _GNU_SOURCE // For O_TMPFILE and copy_file_range()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "headers.h"
+
+// Names of result files are the hash of their key, 16 hex digits
+#define CACHED_NAME_LENGTH 16
+#define CACHED_STATS_FILE "stats"
+
+// Variables most results depend on, -e adds more
+static const char *keyed_variables[] = {"PATH", "HOME", "LANG", "LC_ALL", "TZ", NULL};
+
+// One result file, as seen by the eviction
+struct CachedEntry {
+    char name[CACHED_NAME_LENGTH + 1];
+    off_t size;
+    struct timespec last_use; // mtime, touched on every hit
+};
+
+// Hits and misses over all shells sharing the cache directory, kept in .cached/stats
+struct CachedStats {
+    long long hits;
+    long long misses;
+    long long evictions;
+};
+
+static struct Buffer *walked_key = NULL; // Key the directories found by nftw() are added to
+
+
+static unsigned long long hash_key(const char *data, size_t length) {
+    // FNV-1a, 64 bits
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Fields are length-prefixed, so no value can be mistaken for the start of the next one
+static void add_key_field(struct Buffer *key, const char *name, const char *value) {
+    char prefix[64];
+    int length = snprintf(prefix, sizeof(prefix), "%s %zu:", name, strlen(value));
+    buffer_append(key, prefix, length);
+    buffer_append(key, value, strlen(value));
+    buffer_append_char(key, '\n');
+}
+
+static void add_key_stat(struct Buffer *key, const char *path, const struct stat *st) {
+    char value[160];
+    snprintf(value, sizeof(value), "%llu %llu %lld %lld.%09ld", (unsigned long long)st->st_dev, (unsigned long long)st->st_ino,
+             (long long)st->st_size, (long long)st->st_mtim.tv_sec, st->st_mtim.tv_nsec);
+    add_key_field(key, path, value);
+}
+
+static int add_walked_directory(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)ftw;
+    if (type == FTW_D) {
+        add_key_stat(walked_key, path, st);
+    }
+    return 0;
+}
+
+// A file stands for its contents through size and mtime; a directory for the names below it,
+// every directory under it is stat'ed since adding or removing an entry changes its mtime
+static void add_key_input(struct Buffer *key, const char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        add_key_field(key, path, "missing");
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        add_key_stat(key, path, &st);
+        return;
+    }
+    walked_key = key;
+    nftw(path, add_walked_directory, 16, FTW_PHYS);
+    walked_key = NULL;
+}
+
+// Path of a file in the result directory, names are short
+static void result_path(char *path, const char *name) {
+    snprintf(path, MAX_PATH_LENGTH, "%.*s/%.32s", MAX_CACHE_DIR_LENGTH, cached_dir, name);
+}
+
+static int open_result_file(const char *name, int flags) {
+    char path[MAX_PATH_LENGTH];
+    result_path(path, name);
+    return open(path, flags | O_CLOEXEC, 0600);
+}
+
+// Unnamed file in the result directory, on the same filesystem so copy_file_range() can share its blocks
+static int open_scratch_file() {
+    int fd = open(cached_dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+        return fd;
+    }
+    char path[MAX_PATH_LENGTH];
+    result_path(path, "scratch-XXXXXX");
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd != -1) {
+        unlink(path);
+    }
+    return fd;
+}
+
+static void read_cached_stats(struct CachedStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    char path[MAX_PATH_LENGTH];
+    result_path(path, CACHED_STATS_FILE);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+    if (fscanf(file, "%lld %lld %lld", &stats->hits, &stats->misses, &stats->evictions) != 3) {
+        memset(stats, 0, sizeof(*stats));
+    }
+    fclose(file);
+}
+
+static void add_cached_stats(int hits, int misses, int evictions) {
+    struct CachedStats stats;
+    read_cached_stats(&stats);
+    char path[MAX_PATH_LENGTH];
+    result_path(path, CACHED_STATS_FILE);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return;
+    }
+    fprintf(file, "%lld %lld %lld\n", stats.hits + hits, stats.misses + misses, stats.evictions + evictions);
+    fclose(file);
+}
+
+// Result files start with "<key length> <exit code> <stdout length> <stderr length>\n" and the key,
+// followed by the bytes of stdout and stderr
+static int replay_result(const char *name, const struct Buffer *key) {
+    int fd = open_result_file(name, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    char header[128];
+    ssize_t length = pread(fd, header, sizeof(header) - 1, 0);
+    size_t key_length;
+    int exit_code, header_length;
+    long long out_length, err_length;
+    if (length <= 0) {
+        close(fd);
+        return -1;
+    }
+    header[length] = '\0';
+    if (sscanf(header, "%zu %d %lld %lld\n%n", &key_length, &exit_code, &out_length, &err_length, &header_length) != 4 ||
+        key_length != key->length) {
+        close(fd);
+        return -1;
+    }
+
+    // Equal hashes of different keys are told apart by the stored key
+    char *stored_key = malloc(key_length + 1);
+    if (stored_key == NULL || pread(fd, stored_key, key_length, header_length) != (ssize_t)key_length ||
+        memcmp(stored_key, key->data, key_length) != 0) {
+        free(stored_key);
+        close(fd);
+        return -1;
+    }
+    free(stored_key);
+
+    off_t offset = header_length + key_length;
+    send_file_range(STDOUT_FILENO, fd, offset, out_length);
+    send_file_range(STDERR_FILENO, fd, offset + out_length, err_length);
+    futimens(fd, NULL); // mtime is the last use for the eviction
+    close(fd);
+    last_status = exit_code;
+    return 0;
+}
+
+// Runs the command with its output streams going into out_fd and err_fd, returns the wait status
+static int run_uncached(char *command[], int out_fd, int err_fd) {
+    fflush(stdout);
+    pid_t pid = counted_fork();
+    if (pid == -1) {
+        perror("Internal function fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        // Results must not depend on whatever the terminal would have typed
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+        dup2(out_fd, STDOUT_FILENO);
+        dup2(err_fd, STDERR_FILENO);
+
+        // A single quoted word is a whole command line, e.g. "git log --oneline | head"
+        if (command[1] == NULL && strpbrk(command[0], " \t|;<>") != NULL) {
+            char input[MAX_INPUT_LENGTH];
+            snprintf(input, sizeof(input), "%s", command[0]);
+            execute_input(input);
+            fflush(stdout);
+            exit(last_status);
+        }
+        if (run_builtin(command)) {
+            fflush(stdout);
+            exit(last_status);
+        }
+        environ = get_environment();
+        execvp(command[0], command);
+        perror("No such internal or GoGiShell command");
+        exit(127);
+    }
+    int status;
+    if (wait_for_child(pid, &status) == -1) {
+        perror("Internal function waitpid failed");
+        return -1;
+    }
+    return status;
+}
+
+static int copy_range(int out_fd, int fd, off_t length) {
+    off_t offset = 0;
+    while (offset < length) {
+        ssize_t copied = copy_file_range(fd, &offset, out_fd, NULL, length - offset, 0);
+        if (copied <= 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Writes the result under a temporary name and renames it, readers never see half of it
+static void store_result(const char *name, const struct Buffer *key, int exit_code, int out_fd, off_t out_length, int err_fd, off_t err_length) {
+    char temporary_path[MAX_PATH_LENGTH], path[MAX_PATH_LENGTH];
+    char temporary_name[CACHED_NAME_LENGTH + 8];
+    snprintf(temporary_name, sizeof(temporary_name), "%.16s.XXXXXX", name);
+    result_path(temporary_path, temporary_name);
+    result_path(path, name);
+    int fd = mkostemp(temporary_path, O_CLOEXEC);
+    if (fd == -1) {
+        perror("cached: failed to store the result");
+        return;
+    }
+
+    char header[128];
+    int header_length = snprintf(header, sizeof(header), "%zu %d %lld %lld\n", key->length, exit_code, (long long)out_length, (long long)err_length);
+    if (write(fd, header, header_length) != header_length || write(fd, key->data, key->length) != (ssize_t)key->length ||
+        copy_range(fd, out_fd, out_length) == -1 || copy_range(fd, err_fd, err_length) == -1) {
+        perror("cached: failed to store the result");
+        close(fd);
+        unlink(temporary_path);
+        return;
+    }
+    close(fd);
+    if (rename(temporary_path, path) == -1) {
+        perror("cached: failed to store the result");
+        unlink(temporary_path);
+    }
+}
+
+static long long cached_size_limit() {
+    const char *value = get_variable(CACHED_LIMIT_VARIABLE);
+    if (value != NULL && atoll(value) > 0) {
+        return atoll(value) << 20;
+    }
+    return CACHED_SIZE_LIMIT;
+}
+
+static int is_result_name(const char *name) {
+    return strlen(name) == CACHED_NAME_LENGTH && strspn(name, "0123456789abcdef") == CACHED_NAME_LENGTH;
+}
+
+// Returns the result files with their sizes, *total is the sum of the sizes
+static struct CachedEntry *list_results(int *count, long long *total) {
+    struct CachedEntry *entries = NULL;
+    int capacity = 0;
+    *count = 0;
+    *total = 0;
+    DIR *directory = opendir(cached_dir);
+    if (directory == NULL) {
+        return NULL;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        struct stat st;
+        if (!is_result_name(entry->d_name) || fstatat(dirfd(directory), entry->d_name, &st, 0) == -1) {
+            continue;
+        }
+        if (*count == capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            entries = realloc(entries, capacity * sizeof(struct CachedEntry));
+            if (entries == NULL) {
+                perror("Failed to allocate memory");
+                exit(EXIT_FAILURE);
+            }
+        }
+        snprintf(entries[*count].name, sizeof(entries[*count].name), "%.16s", entry->d_name);
+        entries[*count].size = st.st_size;
+        entries[*count].last_use = st.st_mtim;
+        *total += st.st_size;
+        (*count)++;
+    }
+    closedir(directory);
+    return entries;
+}
+
+static int compare_last_use(const void *a, const void *b) {
+    const struct timespec *use_a = &((const struct CachedEntry *)a)->last_use;
+    const struct timespec *use_b = &((const struct CachedEntry *)b)->last_use;
+    if (use_a->tv_sec != use_b->tv_sec) {
+        return use_a->tv_sec < use_b->tv_sec ? -1 : 1;
+    }
+    return (use_a->tv_nsec > use_b->tv_nsec) - (use_a->tv_nsec < use_b->tv_nsec);
+}
+
+// Removes the least recently used results until the rest fits into the limit, returns how many went
+static int evict_results() {
+    int count;
+    long long total;
+    struct CachedEntry *entries = list_results(&count, &total);
+    long long limit = cached_size_limit();
+    int evicted = 0;
+    if (total > limit) {
+        qsort(entries, count, sizeof(struct CachedEntry), compare_last_use);
+        for (int i = 0; i < count && total > limit; i++) {
+            char path[MAX_PATH_LENGTH];
+            result_path(path, entries[i].name);
+            if (unlink(path) == 0) {
+                total -= entries[i].size;
+                evicted++;
+            }
+        }
+    }
+    free(entries);
+    return evicted;
+}
+
+static void print_cached_stats() {
+    int count;
+    long long total;
+    struct CachedEntry *entries = list_results(&count, &total);
+    free(entries);
+    struct CachedStats stats;
+    read_cached_stats(&stats);
+    long long lookups = stats.hits + stats.misses;
+    printf("cached: %d results, %lld of %lld bytes, %lld hits, %lld misses (%.1f%% hit rate), %lld evicted\n", count, total,
+           cached_size_limit(), stats.hits, stats.misses, lookups > 0 ? 100.0 * stats.hits / lookups : 0.0, stats.evictions);
+}
+
+static void clear_results() {
+    int count;
+    long long total;
+    struct CachedEntry *entries = list_results(&count, &total);
+    for (int i = 0; i < count; i++) {
+        char path[MAX_PATH_LENGTH];
+        result_path(path, entries[i].name);
+        unlink(path);
+    }
+    free(entries);
+    char path[MAX_PATH_LENGTH];
+    result_path(path, CACHED_STATS_FILE);
+    unlink(path);
+    printf("cached: %d results removed\n", count);
+}
+
+static void print_cached_usage() {
+    printf("Usage: cached [-i <input path>] ... [-e <variable>] ... -- <command> [<argument> ...]\n\tcached --stats\n\tcached --clear\n");
+}
+
+void cached(char *args[]) {
+    const char *inputs[MAX_CACHED_INPUTS], *variables[MAX_CACHED_INPUTS];
+    int total_inputs = 0, total_variables = 0;
+    char **command = NULL;
+    last_status = 1;
+
+    if (mkdir(cached_dir, 0700) == -1 && errno != EEXIST) {
+        perror("cached: failed to create the result directory");
+        return;
+    }
+    if (args[1] != NULL && args[2] == NULL && strcmp(args[1], "--stats") == 0) {
+        print_cached_stats();
+        last_status = 0;
+        return;
+    }
+    if (args[1] != NULL && args[2] == NULL && strcmp(args[1], "--clear") == 0) {
+        clear_results();
+        last_status = 0;
+        return;
+    }
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-i") == 0 && args[i + 1] != NULL && total_inputs < MAX_CACHED_INPUTS) {
+            inputs[total_inputs++] = args[++i];
+        } else if (strcmp(args[i], "-e") == 0 && args[i + 1] != NULL && total_variables < MAX_CACHED_INPUTS) {
+            variables[total_variables++] = args[++i];
+        } else if (strcmp(args[i], "--") == 0 && args[i + 1] != NULL) {
+            command = &args[i + 1];
+            break;
+        } else {
+            print_cached_usage();
+            return;
+        }
+    }
+    if (command == NULL) {
+        print_cached_usage();
+        return;
+    }
+
+    // The key is everything the output may depend on: the expanded words, the directory, variables and inputs
+    struct Buffer key = {0};
+    for (int i = 0; command[i] != NULL; i++) {
+        add_key_field(&key, "word", command[i]);
+    }
+    char cwd[MAX_PATH_LENGTH];
+    add_key_field(&key, "cwd", getcwd(cwd, sizeof(cwd)) != NULL ? cwd : "");
+    for (int i = 0; keyed_variables[i] != NULL; i++) {
+        const char *value = get_variable(keyed_variables[i]);
+        add_key_field(&key, keyed_variables[i], value != NULL ? value : "");
+    }
+    for (int i = 0; i < total_variables; i++) {
+        const char *value = get_variable(variables[i]);
+        add_key_field(&key, variables[i], value != NULL ? value : "");
+    }
+    for (int i = 0; i < total_inputs; i++) {
+        add_key_input(&key, inputs[i]);
+    }
+    char name[CACHED_NAME_LENGTH + 1];
+    snprintf(name, sizeof(name), "%016llx", hash_key(key.data, key.length));
+
+    if (replay_result(name, &key) == 0) {
+        add_cached_stats(1, 0, 0);
+        buffer_free(&key);
+        return;
+    }
+
+    int out_fd = open_scratch_file();
+    int err_fd = open_scratch_file();
+    if (out_fd == -1 || err_fd == -1) {
+        perror("cached: failed to create a file for the output");
+        if (out_fd != -1) {
+            close(out_fd);
+        }
+        buffer_free(&key);
+        return;
+    }
+    int status = run_uncached(command, out_fd, err_fd);
+    off_t out_length = lseek(out_fd, 0, SEEK_END);
+    off_t err_length = lseek(err_fd, 0, SEEK_END);
+    send_file_range(STDOUT_FILENO, out_fd, 0, out_length);
+    send_file_range(STDERR_FILENO, err_fd, 0, err_length);
+
+    // Interrupted runs aren't kept, nor results that alone would fill the whole cache
+    int evicted = 0;
+    if (status != -1) {
+        last_status = status_to_exit_code(status);
+        if (WIFEXITED(status) && out_length + err_length < cached_size_limit()) {
+            store_result(name, &key, last_status, out_fd, out_length, err_fd, err_length);
+            evicted = evict_results();
+        }
+    }
+    add_cached_stats(0, 1, evicted);
+    close(out_fd);
+    close(err_fd);
+    buffer_free(&key);
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <fcntl.h>
 
 #include "headers.h"
 
@@ -68,6 +69,7 @@ void ldir(char *args[]) {
 
     // Call fulfil_labeled_directories_file to handle file operations
     fulfil_labeled_directories_file(absolute_path, description, color);
+    label_directory(absolute_path, description);
 }
 
 void sethome(char *args[]) {
@@ -129,40 +131,44 @@ void sethome(char *args[]) {
 void history(char *args[]) {
     // If too many arguments are provided, print usage
     if (args[1] != NULL && args[2] != NULL) {
-        printf("Usage: history <number_of_lines>\n\thistory clear\n\thistory\n");
+        printf("Usage: history <number_of_lines>\n\thistory clear\n\thistory compact\n\thistory segments\n\thistory\n");
         return;
     }
 
     // Handle "history clear"
     if (args[1] != NULL && strcmp(args[1], "clear") == 0) {
-        FILE *file = fopen(history_file, "w");
-        if (file == NULL) {
+        if (clear_history() == -1) {
             perror("Failed to open .history");
             return;
         }
-        fclose(file);
+        FILE *file = open_cache_file(history_stats_file, "w");
+        if (file != NULL) {
+            fclose(file);
+        }
         total_commands = 0;
         printf("History was successfully cleared.\n");
         return;
     }
 
-    // Open the history file for reading
-    FILE *file = fopen(history_file, "r");
-    if (file == NULL) {
-        perror("Failed to open .history");
+    // Handle "history compact", which moves all of history into one segment
+    if (args[1] != NULL && strcmp(args[1], "compact") == 0) {
+        if (compact_history(1) == -1) {
+            fprintf(stderr, "history: compaction failed\n");
+            last_status = 1;
+            return;
+        }
+        print_history_segments();
+        return;
+    }
+
+    if (args[1] != NULL && strcmp(args[1], "segments") == 0) {
+        print_history_segments();
         return;
     }
 
     // If no arguments are provided, show the entire history
     if (args[1] == NULL) {
-        char line[MAX_COMMAND_NUMBER];
-        int line_number = 1;
-
-        while (fgets(line, sizeof(line), file) != NULL) {
-            printf("%d %s", line_number++, line);
-        }
-
-        fclose(file);
+        print_history_entries(1);
         return;
     }
 
@@ -170,27 +176,11 @@ void history(char *args[]) {
     char *endptr;
     long num_lines = strtol(args[1], &endptr, 10);
     if (*endptr != '\0' || num_lines <= 0) {
-        printf("Usage: history <number_of_lines>\n\thistory clear\n\thistory\n");
-        fclose(file);
+        printf("Usage: history <number_of_lines>\n\thistory clear\n\thistory compact\n\thistory segments\n\thistory\n");
         return;
     }
-
-    // Read and count the total number of lines in the file
-    char lines[MAX_COMMAND_NUMBER][MAX_COMMAND_NUMBER]; // Temporary storage for lines
-    int total_lines = 0;
-
-    while (fgets(lines[total_lines], sizeof(lines[0]), file) != NULL) {
-        if (total_lines < MAX_COMMAND_NUMBER - 1) { // Avoid buffer overflow
-            total_lines++;
-        }
-    }
-    fclose(file);
-
-    // Print the requested number of lines from the end
-    int start_line = (num_lines >= total_lines) ? 0 : total_lines - num_lines;
-    for (int i = start_line; i < total_lines; i++) {
-        printf("%d %s", i + 1, lines[i]);
-    }
+    long total_lines = count_history_entries();
+    print_history_entries(num_lines >= total_lines ? 1 : total_lines - num_lines + 1);
 }
 
 void home(char *args[]) {
@@ -210,7 +200,7 @@ void setabbr(char *args[]) {
 
     if (strcmp(args[1], "clear") == 0) {
         // Open the file in write mode to clear its contents
-        FILE *file = fopen(abbreviation_file, "w");
+        FILE *file = open_cache_file(abbreviation_file, "w");
         if (file == NULL) {
             perror("Failed to open .abbreviation_file");
             return;
@@ -255,7 +245,7 @@ void abbr(char *args[]) {
         printf("Usage: abbr\n");
     }
     else {
-        FILE *file = fopen(abbreviation_file, "r");
+        FILE *file = open_cache_file(abbreviation_file, "r");
         if (file == NULL) {
             perror("Failed to opening .abbreviation");
             return;
@@ -270,6 +260,112 @@ void abbr(char *args[]) {
     }
 }
 
+void export(char *args[]) {
+    if (args[1] == NULL) {
+        print_variables(1);
+        return;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        char *equal_sign = strchr(args[i], '=');
+        if (equal_sign != NULL) {
+            *equal_sign = '\0';
+            if (set_variable(args[i], equal_sign + 1) == -1) {
+                printf("export: '%s' is not a valid variable name\n", args[i]);
+                last_status = 1;
+                *equal_sign = '=';
+                continue;
+            }
+        }
+        if (export_variable(args[i]) == -1) {
+            printf("export: '%s' is not a valid variable name\n", args[i]);
+            last_status = 1;
+        }
+        if (equal_sign != NULL) {
+            *equal_sign = '=';
+        }
+    }
+}
+
+void unset(char *args[]) {
+    int remove_functions = args[1] != NULL && strcmp(args[1], "-f") == 0;
+    if (args[1 + remove_functions] == NULL) {
+        printf("Usage: unset [-f] <name> [<name> ...]\n");
+        last_status = 1;
+        return;
+    }
+
+    for (int i = 1 + remove_functions; args[i] != NULL; i++) {
+        if (!remove_functions) {
+            unset_variable(args[i]);
+        } else if (undefine_function(args[i]) == -1) {
+            printf("unset: no such function: %s\n", args[i]);
+            last_status = 1;
+        }
+    }
+}
+
+void set(char *args[]) {
+    if (args[1] != NULL) {
+        printf("Usage: set\n");
+        last_status = 1;
+        return;
+    }
+    print_variables(0);
+}
+
+void fanout(char *args[]) {
+    if (args[1] == NULL) {
+        printf("Usage: fanout [-a] <file> [<file> ...]\n");
+        last_status = 1;
+        return;
+    }
+
+    int flags = O_CREAT | O_WRONLY | O_TRUNC;
+    int first = 1;
+    if (strcmp(args[1], "-a") == 0) {
+        flags = O_CREAT | O_WRONLY; // O_APPEND is not used, splice() refuses such files
+        first = 2;
+    }
+
+    int count = 0;
+    for (int i = first; args[i] != NULL; i++) {
+        count++;
+    }
+
+    // Files (or >(command) pipes) first, stdout is the last output and consumes the input
+    int *out_fds = malloc((count + 1) * sizeof(int));
+    if (out_fds == NULL) {
+        perror("Failed to allocate memory");
+        last_status = 1;
+        return;
+    }
+    int opened = 0;
+    for (int i = first; args[i] != NULL; i++) {
+        int fd = open(args[i], flags, 0644);
+        if (fd == -1) {
+            perror("Failed to open file for fanout");
+            last_status = 1;
+            continue;
+        }
+        if (first == 2) {
+            lseek(fd, 0, SEEK_END);
+        }
+        out_fds[opened++] = fd;
+    }
+    out_fds[opened++] = STDOUT_FILENO;
+
+    fflush(stdout);
+    if (fan_out(STDIN_FILENO, out_fds, opened) == -1) {
+        last_status = 1;
+    }
+
+    for (int i = 0; i < opened - 1; i++) {
+        close(out_fds[i]);
+    }
+    free(out_fds);
+}
+
 void help(char *args[]) {
     if (args[1] != NULL) {
         printf("Usage: help\n");
@@ -295,11 +391,82 @@ void help(char *args[]) {
         printf("history - print the whole GoGiShell history of commands without arguments, or:\n");
         printf("        clear - clear the GoGiShell history\n");
         printf("        <number> - print <number> last commands\n");
+        printf("        compact - move all of history into one compressed segment and print the segments\n");
+        printf("        segments - print the compressed segments holding older history and their size on disk\n");
         printf("\n");
         printf("ldir <path> -d <description> [-c <color>] - add to the directory description showing when directory is entering and color of prompt if user is in this directory (color should be a standard name corresponding to some ASCII color code\n");
         printf("\n");
+        printf("z <fragment> [<fragment> ...] - jump to the most frecent (often and recently visited) directory whose path or ldir description contains the fragments in order\n");
+        printf("        -l [<fragment> ...] lists matching directories with their scores, fragments without capitals ignore case\n");
+        printf("\n");
+        printf("each [-P <jobs>] [--label <pattern>] -- <command> - run command in every labeled directory (whose description matches pattern), <jobs> at a time\n");
+        printf("        Outputs are printed as the runs finish, every line prefixed with the description, followed by a summary of timings and failures\n");
+        printf("\n");
+        printf("parallel [-j <jobs>] [-k | -u] [--halt] [--stats] <command> [<argument> ...] [::: <item> ...] - run command once per item, <jobs> at a time (the number of CPUs by default)\n");
+        printf("        Items are the words after ::: or the lines of input, {} in the arguments is replaced with the item (appended if there is none)\n");
+        printf("        Outputs come whole as the jobs finish, in the order of items with -k or straight from the jobs with -u; --halt stops at the first failure, --stats prints throughput\n");
+        printf("\n");
+        printf("watch-run [-p <path>] ... [-x <pattern>] ... -- <command> - run command, and again whenever files under the paths (. by default) change\n");
+        printf("        Changes to names matching a pattern (and .*) are ignored, a run still going is stopped with its whole process group; Enter runs again, q or Ctrl-C stops watching\n");
+        printf("\n");
+        printf("NAME=value - set shell variable NAME, used as $NAME or ${NAME} in following inputs ($? is the exit code of the last command)\n");
+        printf("\n");
+        printf("$(command) or `command` - substitute the output of command, GoGiShell commands like history or home are evaluated without launching a process\n");
+        printf("\n");
+        printf("<(command) or >(command) - pass the output (input) of command running alongside as a /dev/fd/N file, e.g. diff <(sort a) <(sort b)\n");
+        printf("\n");
+        printf("command <<WORD - pass the following lines up to WORD as input of command ($VAR is expanded unless WORD is quoted, <<-WORD strips leading tabs)\n");
+        printf("command <<< word - pass word as input of command\n");
+        printf("\n");
+        printf("Redirections are applied from left to right: N>file, N>>file, N<file, N<>file, N>&M (copy M into N), N>&- (close N), &>file (stdout and stderr)\n");
+        printf("\n");
+        printf("if <commands>; then <commands>; [elif <commands>; then <commands>;] [else <commands>;] fi\n");
+        printf("while|until <commands>; do <commands>; done, for <name> in <words>; do <commands>; done\n");
+        printf("case <word> in <pattern>[|<pattern>]) <commands>;; ... esac - run commands of the first matching pattern\n");
+        printf("        Control flow runs inside GoGiShell and may span several lines, break and continue leave or restart a loop\n");
+        printf("\n");
+        printf("function <name> { <commands>; } or <name>() { <commands>; } - define a function called like a command, its arguments are $1 ... $9, $@ and $#\n");
+        printf("        return [<code>] leaves it, functions are kept in the cache and parsed once per session\n");
+        printf("functions - print the defined functions\n");
+        printf("\n");
+        printf("GOGI_PROMPT=<segments> - choose prompt segments from git (branch, '*' if changed), duration (of the last command if it took 1s or more) and status (exit code if not 0)\n");
+        printf("\n");
+        printf("GOGI_CAPTURE=<count> - keep the output of the last <count> commands shown on the terminal, without running them again it is printed by:\n");
+        printf("last [<history number>] - the output of the last command (or of a history entry), e.g. last | grep error; -l lists the kept outputs\n");
+        printf("        $LAST_OUT expands to the output of the last command, commands reading it don't replace it\n");
+        printf("\n");
+        printf("cached [-i <input path>] ... [-e <variable>] ... -- <command> - run a read-only command once and print its stored output and exit code\n");
+        printf("        while the words, directory, variables and inputs stay the same, e.g. cached -i . -- \"find . -name '*.h' | wc -l\"\n");
+        printf("        --stats prints hits and misses, --clear removes the results\n");
+        printf("\n");
+        printf("time <command> - execute command and print its wall time, user and sys CPU time, max RSS and context switches\n");
+        printf("pipestat <command> | <command> ... - relay between the stages with splice() and print bytes, MB/s and how long each stage\n");
+        printf("        waited for input (starved) or for its output to be read (backpressured), the busy stage is the bottleneck\n");
+        printf("\n");
+        printf("hstat - statistics of commands recorded with history, accepts -s <age> (e.g. 7d) and -c (current directory only), or:\n");
+        printf("        slowest [<count>] - print the slowest commands\n");
+        printf("        <command> - print runs, failures and mean/p50/p95/p99/max wall time of command\n");
+        printf("\n");
+        printf("bench [-n <runs>] [-w <warmups>] -- <command> - run command repeatedly and print min/mean/median/p95/p99/max wall time and user/sys CPU time\n");
+        printf("      -c <command> adds a command line to compare side by side, --export-csv/--export-json <file> save the results\n");
+        printf("\n");
+        printf("trace on|off|dump <file> - record the time spent in every phase of the shell and save it as Chrome trace-event JSON (open it in Perfetto)\n");
+        printf("\n");
+        printf("gogistat [-r] - print counters of cache file I/O, history and completion lookups, abbreviation expansions, forks and prompt renders, -r resets them\n");
+        printf("\n");
+        printf("fanout [-a] <file> [<file> ...] - copy input to every file and to output, e.g. make | fanout build.log >(grep error); -a appends\n");
+        printf("\n");
+        printf("export [NAME[=value] ...] - pass variables to the environment of launched commands, prints exported ones without arguments\n");
+        printf("\n");
+        printf("unset [-f] <name> [<name> ...] - remove variables, or functions with -f\n");
+        printf("\n");
+        printf("set - print all shell variables\n");
+        printf("\n");
         printf("help - print manual\n");
         printf("\n");
+        printf("GoGiShell --server - start a background server keeping the cache loaded, new GoGiShell sessions are forked from it ready at once\n");
+        printf("        --stop-server stops it, --no-server starts a session without it\n");
+        printf("\n");
         printf("Furthermore, GoGiShell provides access to commands from history in-line.\n");
         printf("Using UP_ARROW and DOWN_ARROW buttons navigates in history.\n");
         printf("\n");
@@ -0,0 +1,144 @@
+#include <string.h>
+
+#include "headers.h"
+
+// LZ77 block format in the manner of LZ4: every sequence starts with a token whose high nibble is
+// the number of literals and low nibble the match length minus COMPRESS_MIN_MATCH, a nibble of 15
+// is continued by bytes added to it until one is below 255. The literals follow, then the match
+// as a two-byte offset back into the output and the continued match length. The last sequence
+// of a block has literals only.
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_HASH_BITS 12
+#define COMPRESS_MAX_OFFSET 65535
+
+
+static unsigned int hash_sequence(const unsigned char *data) {
+    unsigned int value;
+    memcpy(&value, data, sizeof(value));
+    return (value * 2654435761U) >> (32 - COMPRESS_HASH_BITS);
+}
+
+// Writes a nibble overflow as bytes of 255 and a last byte below it, returns 0 if it doesn't fit
+static int put_length(unsigned char *out, size_t *position, size_t capacity, size_t length) {
+    while (length >= 255) {
+        if (*position >= capacity) {
+            return 0;
+        }
+        out[(*position)++] = 255;
+        length -= 255;
+    }
+    if (*position >= capacity) {
+        return 0;
+    }
+    out[(*position)++] = (unsigned char)length;
+    return 1;
+}
+
+static int put_sequence(unsigned char *out, size_t *position, size_t capacity, const unsigned char *literals,
+                        size_t literal_length, size_t offset, size_t match_length) {
+    if (*position >= capacity) {
+        return 0;
+    }
+    size_t match_code = match_length > 0 ? match_length - COMPRESS_MIN_MATCH : 0;
+    out[(*position)++] = (unsigned char)((literal_length < 15 ? literal_length : 15) << 4 | (match_code < 15 ? match_code : 15));
+    if (literal_length >= 15 && !put_length(out, position, capacity, literal_length - 15)) {
+        return 0;
+    }
+    if (*position + literal_length > capacity) {
+        return 0;
+    }
+    memcpy(out + *position, literals, literal_length);
+    *position += literal_length;
+    if (match_length == 0) {
+        return 1;
+    }
+
+    if (*position + 2 > capacity) {
+        return 0;
+    }
+    out[(*position)++] = offset & 0xff;
+    out[(*position)++] = offset >> 8;
+    return match_code < 15 || put_length(out, position, capacity, match_code - 15);
+}
+
+size_t compress_block(const unsigned char *data, size_t length, unsigned char *out, size_t capacity) {
+    int table[1 << COMPRESS_HASH_BITS];
+    memset(table, -1, sizeof(table));
+
+    size_t position = 0, anchor = 0, i = 0;
+    while (i + COMPRESS_MIN_MATCH <= length) {
+        unsigned int hash = hash_sequence(data + i);
+        int candidate = table[hash];
+        table[hash] = (int)i;
+        if (candidate < 0 || i - candidate > COMPRESS_MAX_OFFSET || memcmp(data + candidate, data + i, COMPRESS_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+
+        size_t match_length = COMPRESS_MIN_MATCH;
+        while (i + match_length < length && data[candidate + match_length] == data[i + match_length]) {
+            match_length++;
+        }
+        if (!put_sequence(out, &position, capacity, data + anchor, i - anchor, i - candidate, match_length)) {
+            return 0;
+        }
+        i += match_length;
+        anchor = i;
+    }
+    if (!put_sequence(out, &position, capacity, data + anchor, length - anchor, 0, 0)) {
+        return 0;
+    }
+    return position;
+}
+
+// Reads a continued nibble, returns -1 past the end of the input
+static int get_length(const unsigned char *data, size_t length, size_t *position, size_t *value) {
+    unsigned char byte;
+    do {
+        if (*position >= length) {
+            return -1;
+        }
+        byte = data[(*position)++];
+        *value += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+int decompress_block(const unsigned char *data, size_t length, unsigned char *out, size_t raw_length) {
+    size_t position = 0, written = 0;
+    while (position < length) {
+        unsigned char token = data[position++];
+        size_t literal_length = token >> 4;
+        if (literal_length == 15 && get_length(data, length, &position, &literal_length) == -1) {
+            return -1;
+        }
+        if (literal_length > length - position || literal_length > raw_length - written) {
+            return -1;
+        }
+        memcpy(out + written, data + position, literal_length);
+        position += literal_length;
+        written += literal_length;
+        if (position == length) {
+            break; // The last sequence has no match
+        }
+
+        if (position + 2 > length) {
+            return -1;
+        }
+        size_t offset = data[position] | data[position + 1] << 8;
+        position += 2;
+        size_t match_length = token & 15;
+        if (match_length == 15 && get_length(data, length, &position, &match_length) == -1) {
+            return -1;
+        }
+        match_length += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > written || match_length > raw_length - written) {
+            return -1;
+        }
+        // Byte by byte, a match may overlap the bytes it produces
+        for (size_t j = 0; j < match_length; j++, written++) {
+            out[written] = out[written - offset];
+        }
+    }
+    return written == raw_length ? 0 : -1;
+}
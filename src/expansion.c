@@ -0,0 +1,790 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "headers.h"
+
+
+void buffer_reserve(struct Buffer *buffer, size_t extra) {
+    if (buffer->length + extra + 1 <= buffer->capacity) {
+        return;
+    }
+    size_t capacity = buffer->capacity == 0 ? 64 : buffer->capacity;
+    while (buffer->length + extra + 1 > capacity) {
+        capacity *= 2;
+    }
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+}
+
+void buffer_append(struct Buffer *buffer, const char *data, size_t length) {
+    buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+}
+
+void buffer_append_char(struct Buffer *buffer, char ch) {
+    buffer_reserve(buffer, 1);
+    buffer->data[buffer->length++] = ch;
+    buffer->data[buffer->length] = '\0';
+}
+
+void buffer_free(struct Buffer *buffer) {
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+static void push_word(struct Words *words, char *word) {
+    if (words->argc + 1 >= words->capacity) {
+        int capacity = words->capacity * 2;
+        char **argv = realloc(words->argv, capacity * sizeof(char *));
+        if (argv == NULL) {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        words->argv = argv;
+        words->capacity = capacity;
+    }
+    words->argv[words->argc++] = word;
+    words->argv[words->argc] = NULL;
+}
+
+static int is_borrowed(struct Words *words, const char *word) {
+    // Words cut out of a substitution output in place are released together with it
+    for (int i = 0; i < words->num_captures; i++) {
+        struct Capture *capture = &words->captures[i];
+        if (word >= capture->data && word <= capture->data + capture->length) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void free_words(struct Words *words) {
+    for (int i = 0; i < words->argc; i++) {
+        if (!is_borrowed(words, words->argv[i])) {
+            free(words->argv[i]);
+        }
+    }
+    for (int i = 0; i < words->num_captures; i++) {
+        free_capture(&words->captures[i]);
+    }
+    free(words->captures);
+
+    // Closing first lets writers get SIGPIPE and readers EOF, so waiting can't deadlock
+    for (int i = 0; i < words->num_process_substitutions; i++) {
+        close(words->process_substitutions[i].fd);
+    }
+    for (int i = 0; i < words->num_process_substitutions; i++) {
+        wait_for_child(words->process_substitutions[i].pid, NULL);
+    }
+    free(words->process_substitutions);
+
+    for (int i = 0; i < words->num_redirections; i++) {
+        free(words->redirections[i].target);
+        if (words->redirections[i].type == REDIRECT_HERE_DOCUMENT && words->redirections[i].source_fd != -1) {
+            close(words->redirections[i].source_fd);
+        }
+    }
+    free(words->redirections);
+    free(words->argv);
+    words->argv = NULL;
+    words->argc = 0;
+    words->capacity = 0;
+    words->num_assignments = 0;
+    words->captures = NULL;
+    words->num_captures = 0;
+    words->process_substitutions = NULL;
+    words->num_process_substitutions = 0;
+    words->redirections = NULL;
+    words->num_redirections = 0;
+}
+
+// Tokenizer state shared by the expansion helpers
+struct Tokenizer {
+    struct Words *words;
+    struct Buffer word;
+    int word_started; // Set by quotes too, so "" still produces an (empty) argument
+    int no_split;     // Expansions are kept whole, e.g. in redirection targets
+    int assignment;   // The word began with an unquoted NAME=, right after other assignments
+};
+
+static void reset_word(struct Tokenizer *tokenizer) {
+    tokenizer->word.length = 0;
+    if (tokenizer->word.data != NULL) {
+        tokenizer->word.data[0] = '\0';
+    }
+    tokenizer->word_started = 0;
+    tokenizer->assignment = 0;
+}
+
+static void finish_word(struct Tokenizer *tokenizer) {
+    if (!tokenizer->word_started) {
+        return;
+    }
+    char *word = strdup(tokenizer->word.data != NULL ? tokenizer->word.data : "");
+    if (word == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    if (tokenizer->assignment) {
+        tokenizer->words->num_assignments++;
+    }
+    push_word(tokenizer->words, word);
+    reset_word(tokenizer);
+}
+
+static int is_blank(char ch) {
+    return ch == ' ' || ch == '\t' || ch == '\n';
+}
+
+static int is_name_char(char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_';
+}
+
+// Appends an expanded value; unquoted values are split into fields on blanks
+static void append_value(struct Tokenizer *tokenizer, const char *value, int quoted) {
+    if (quoted) {
+        buffer_append(&tokenizer->word, value, strlen(value));
+        tokenizer->word_started = 1;
+        return;
+    }
+    for (const char *p = value; *p != '\0'; p++) {
+        if (is_blank(*p)) {
+            finish_word(tokenizer);
+        } else {
+            buffer_append_char(&tokenizer->word, *p);
+            tokenizer->word_started = 1;
+        }
+    }
+}
+
+// Values assigned with NAME=value are never split, as if they were quoted (neither are redirection targets)
+static int in_assignment(struct Tokenizer *tokenizer) {
+    return tokenizer->no_split || tokenizer->assignment;
+}
+
+// Returns 1 if the raw word at p is an assignment, checked before quotes are removed so 'A=b' is none
+static int starts_assignment(const char *p) {
+    size_t length = 0;
+    while (is_name_char(p[length])) {
+        length++;
+    }
+    return p[length] == '=' && is_valid_variable_name(p, length);
+}
+
+// Appends $@ or $*, the arguments of the running function; "$@" keeps every argument a word of its own
+static void append_arguments(struct Tokenizer *tokenizer, int quoted, int separate) {
+    for (int i = 0; i < positional_count; i++) {
+        if (i > 0 && separate) {
+            finish_word(tokenizer);
+        } else if (i > 0) {
+            append_value(tokenizer, " ", quoted);
+        }
+        append_value(tokenizer, positional_args[i], quoted);
+    }
+    if (positional_count == 0 && quoted && !separate) {
+        tokenizer->word_started = 1;
+    }
+}
+
+static void keep_capture(struct Words *words, struct Capture *capture) {
+    struct Capture *captures = realloc(words->captures, (words->num_captures + 1) * sizeof(struct Capture));
+    if (captures == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    words->captures = captures;
+    words->captures[words->num_captures++] = *capture;
+}
+
+// Appends the output of a substitution, next is the input right after it.
+// Unquoted fields that form whole words are cut out of the output in place instead of being copied.
+static void append_capture(struct Tokenizer *tokenizer, struct Capture *capture, int quoted, const char *next) {
+    char *data = capture->data;
+    size_t length = capture->length;
+    int borrowed = 0;
+
+    // Trailing newlines are removed, as in other shells
+    while (length > 0 && data[length - 1] == '\n') {
+        length--;
+    }
+
+    if (quoted) {
+        buffer_append(&tokenizer->word, data, length);
+        tokenizer->word_started = 1;
+        free_capture(capture);
+        return;
+    }
+
+    size_t i = 0;
+    while (i < length) {
+        if (is_blank(data[i])) {
+            finish_word(tokenizer);
+            i++;
+            continue;
+        }
+
+        size_t start = i;
+        while (i < length && !is_blank(data[i])) {
+            i++;
+        }
+
+        // Fields glued to the text before or after the substitution are part of a longer word
+        int joined_before = start == 0 && tokenizer->word_started;
+        int joined_after = i == length && !(is_blank(*next) || *next == '\0');
+        if (joined_before || joined_after) {
+            buffer_append(&tokenizer->word, data + start, i - start);
+            tokenizer->word_started = 1;
+        } else {
+            data[i] = '\0';
+            push_word(tokenizer->words, data + start);
+            borrowed = 1;
+            i++;
+        }
+    }
+
+    if (borrowed) {
+        keep_capture(tokenizer->words, capture);
+    } else {
+        free_capture(capture);
+    }
+}
+
+// Expands the reference starting at '$' and returns the position after it
+static const char *expand_variable(struct Tokenizer *tokenizer, const char *p, int quoted) {
+    char number[32];
+    int in_double_quotes = quoted;
+
+    quoted = quoted || in_assignment(tokenizer);
+
+    if (p[1] >= '0' && p[1] <= '9') {
+        // $0 is the shell itself, $1 to $9 are the arguments of the running function
+        int index = p[1] - '0';
+        const char *value = index == 0 ? "GoGiShell" : index <= positional_count ? positional_args[index - 1] : NULL;
+        if (value != NULL) {
+            append_value(tokenizer, value, quoted);
+        } else if (quoted) {
+            tokenizer->word_started = 1;
+        }
+        return p + 2;
+    }
+    if (p[1] == '#') {
+        snprintf(number, sizeof(number), "%d", positional_count);
+        append_value(tokenizer, number, quoted);
+        return p + 2;
+    }
+    if (p[1] == '@' || p[1] == '*') {
+        append_arguments(tokenizer, quoted, p[1] == '@' && in_double_quotes);
+        return p + 2;
+    }
+    if (p[1] == '?') {
+        snprintf(number, sizeof(number), "%d", last_status);
+        append_value(tokenizer, number, quoted);
+        return p + 2;
+    }
+    if (p[1] == '$') {
+        snprintf(number, sizeof(number), "%d", (int)getpid());
+        append_value(tokenizer, number, quoted);
+        return p + 2;
+    }
+    if (p[1] == '{') {
+        const char *end = strchr(p + 2, '}');
+        if (end != NULL && end > p + 2 && strspn(p + 2, "0123456789") == (size_t)(end - (p + 2))) {
+            int index = atoi(p + 2);
+            if (index >= 1 && index <= positional_count) {
+                append_value(tokenizer, positional_args[index - 1], quoted);
+            } else if (quoted) {
+                tokenizer->word_started = 1;
+            }
+            return end + 1;
+        }
+        if (end == NULL || !is_valid_variable_name(p + 2, end - (p + 2))) {
+            fprintf(stderr, "Bad substitution\n");
+            return NULL;
+        }
+        if (end - (p + 2) == sizeof(LAST_OUTPUT_VARIABLE) - 1 && strncmp(p + 2, LAST_OUTPUT_VARIABLE, end - (p + 2)) == 0) {
+            struct Capture capture;
+            read_last_output(&capture);
+            append_capture(tokenizer, &capture, quoted, end + 1);
+            return end + 1;
+        }
+        const char *value = get_variable_n(p + 2, end - (p + 2));
+        if (value != NULL) {
+            append_value(tokenizer, value, quoted);
+        } else if (quoted) {
+            tokenizer->word_started = 1;
+        }
+        return end + 1;
+    }
+    if (is_name_char(p[1]) && !(p[1] >= '0' && p[1] <= '9')) {
+        const char *end = p + 1;
+        while (is_name_char(*end)) {
+            end++;
+        }
+        // $LAST_OUT is the captured output of the last command, read without running anything
+        if (end - (p + 1) == sizeof(LAST_OUTPUT_VARIABLE) - 1 && strncmp(p + 1, LAST_OUTPUT_VARIABLE, end - (p + 1)) == 0) {
+            struct Capture capture;
+            read_last_output(&capture);
+            append_capture(tokenizer, &capture, quoted, end);
+            return end;
+        }
+        const char *value = get_variable_n(p + 1, end - (p + 1));
+        if (value != NULL) {
+            append_value(tokenizer, value, quoted);
+        } else if (quoted) {
+            tokenizer->word_started = 1;
+        }
+        return end;
+    }
+
+    // Not a reference, '$' stays literal
+    buffer_append_char(&tokenizer->word, '$');
+    tokenizer->word_started = 1;
+    return p + 1;
+}
+
+// Runs $(command) or `command` starting at p and returns the position after it
+static const char *expand_substitution(struct Tokenizer *tokenizer, const char *p, int quoted) {
+    struct Buffer command = {NULL, 0, 0};
+    const char *end;
+
+    quoted = quoted || in_assignment(tokenizer);
+
+    if (*p == '$') {
+        end = skip_substitution(p);
+        if (end == NULL) {
+            fprintf(stderr, "Unterminated command substitution\n");
+            return NULL;
+        }
+        buffer_append(&command, p + 2, end - 1 - (p + 2));
+    } else {
+        // Inside backquotes a backslash only escapes '`', '$' and itself
+        end = p + 1;
+        while (*end != '`') {
+            if (*end == '\0') {
+                fprintf(stderr, "Unterminated command substitution\n");
+                buffer_free(&command);
+                return NULL;
+            }
+            if (*end == '\\' && (end[1] == '`' || end[1] == '$' || end[1] == '\\')) {
+                end++;
+            }
+            buffer_append_char(&command, *end++);
+        }
+        end++;
+    }
+
+    struct Capture capture;
+    capture_command(command.data != NULL ? command.data : "", &capture);
+    buffer_free(&command);
+
+    append_capture(tokenizer, &capture, quoted, end);
+    return end;
+}
+
+// Starts <(command) or >(command) at p and appends /dev/fd/N to the word, returns the position after it
+static const char *expand_process_substitution(struct Tokenizer *tokenizer, const char *p) {
+    const char *end = skip_substitution(p);
+    if (end == NULL) {
+        fprintf(stderr, "Unterminated process substitution\n");
+        return NULL;
+    }
+
+    struct Buffer command = {NULL, 0, 0};
+    buffer_append(&command, p + 2, end - 1 - (p + 2));
+
+    struct ProcessSubstitution substitution;
+    substitution.fd = start_process_substitution(command.data != NULL ? command.data : "", *p == '>', &substitution.pid);
+    buffer_free(&command);
+    if (substitution.fd == -1) {
+        return NULL;
+    }
+
+    struct Words *words = tokenizer->words;
+    struct ProcessSubstitution *substitutions = realloc(words->process_substitutions,
+        (words->num_process_substitutions + 1) * sizeof(struct ProcessSubstitution));
+    if (substitutions == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    words->process_substitutions = substitutions;
+    words->process_substitutions[words->num_process_substitutions++] = substitution;
+
+    char path[32];
+    snprintf(path, sizeof(path), "/dev/fd/%d", substitution.fd);
+    buffer_append(&tokenizer->word, path, strlen(path));
+    tokenizer->word_started = 1;
+    return end;
+}
+
+// Parses one part of a word (quoted string, expansion or character) and returns the position after it
+static const char *parse_word_part(struct Tokenizer *tokenizer, const char *p) {
+    if (*p == '\\') {
+        if (p[1] != '\0' && p[1] != '\n') {
+            buffer_append_char(&tokenizer->word, p[1]);
+            tokenizer->word_started = 1;
+            return p + 2;
+        }
+        return p + 1;
+    }
+    if (*p == '\'') {
+        const char *end = strchr(p + 1, '\'');
+        if (end == NULL) {
+            fprintf(stderr, "Unterminated quote\n");
+            return NULL;
+        }
+        buffer_append(&tokenizer->word, p + 1, end - (p + 1));
+        tokenizer->word_started = 1;
+        return end + 1;
+    }
+    if (*p == '"') {
+        tokenizer->word_started = 1;
+        p++;
+        while (*p != '"') {
+            if (*p == '\0') {
+                fprintf(stderr, "Unterminated quote\n");
+                return NULL;
+            }
+            if (*p == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`')) {
+                buffer_append_char(&tokenizer->word, p[1]);
+                p += 2;
+            } else if ((*p == '$' && p[1] == '(') || *p == '`') {
+                p = expand_substitution(tokenizer, p, 1);
+            } else if (*p == '$') {
+                p = expand_variable(tokenizer, p, 1);
+            } else {
+                buffer_append_char(&tokenizer->word, *p++);
+            }
+            if (p == NULL) {
+                return NULL;
+            }
+        }
+        return p + 1;
+    }
+    if ((*p == '$' && p[1] == '(') || *p == '`') {
+        return expand_substitution(tokenizer, p, 0);
+    }
+    if ((*p == '<' || *p == '>') && p[1] == '(') {
+        return expand_process_substitution(tokenizer, p);
+    }
+    if (*p == '$') {
+        return expand_variable(tokenizer, p, 0);
+    }
+    buffer_append_char(&tokenizer->word, *p);
+    tokenizer->word_started = 1;
+    return p + 1;
+}
+
+static int is_redirection_operator(const char *p) {
+    return (*p == '<' || *p == '>') && p[1] != '(';
+}
+
+// Takes the accumulated word out of the tokenizer
+static char *take_word(struct Tokenizer *tokenizer) {
+    char *word = strdup(tokenizer->word.data != NULL ? tokenizer->word.data : "");
+    if (word == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    reset_word(tokenizer);
+    return word;
+}
+
+// Expands $VAR and $(command) in an unquoted here-document body, nothing is split
+static void expand_here_document(struct Tokenizer *tokenizer, const char *body, size_t length) {
+    const char *p = body;
+    const char *end = body + length;
+
+    tokenizer->no_split = 1;
+    while (p != NULL && p < end) {
+        if (*p == '\\' && p + 1 < end && (p[1] == '$' || p[1] == '`' || p[1] == '\\')) {
+            buffer_append_char(&tokenizer->word, p[1]);
+            p += 2;
+        } else if ((*p == '$' && p[1] == '(') || *p == '`') {
+            p = expand_substitution(tokenizer, p, 1);
+        } else if (*p == '$') {
+            p = expand_variable(tokenizer, p, 1);
+        } else {
+            buffer_append_char(&tokenizer->word, *p++);
+        }
+    }
+    tokenizer->no_split = 0;
+}
+
+static void add_redirection(struct Words *words, struct Redirection *redirection) {
+    struct Redirection *redirections = realloc(words->redirections, (words->num_redirections + 1) * sizeof(struct Redirection));
+    if (redirections == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    words->redirections = redirections;
+    words->redirections[words->num_redirections++] = *redirection;
+}
+
+// Parses a redirection operator with its target into the redirection table, returns the position after it
+static const char *parse_redirection(struct Tokenizer *tokenizer, const char *p, int fd_length) {
+    struct Redirection redirection = {REDIRECT_INPUT, STDIN_FILENO, NULL, -1};
+    int default_fd = STDIN_FILENO;
+    int both_outputs = 0; // &> and &>> redirect stdout and stderr together
+    int explicit_fd = fd_length > 0;
+
+    if (explicit_fd) {
+        redirection.fd = (int)strtol(p, NULL, 10);
+        p += fd_length;
+    }
+
+    if (p[0] == '&' && p[1] == '>' && p[2] == '>') {
+        redirection.type = REDIRECT_APPEND;
+        default_fd = STDOUT_FILENO;
+        both_outputs = 1;
+        p += 3;
+    } else if (p[0] == '&' && p[1] == '>') {
+        redirection.type = REDIRECT_OUTPUT;
+        default_fd = STDOUT_FILENO;
+        both_outputs = 1;
+        p += 2;
+    } else if (p[0] == '<' && p[1] == '<' && p[2] == '<') {
+        redirection.type = REDIRECT_HERE_STRING;
+        p += 3;
+    } else if (p[0] == '<' && p[1] == '<') {
+        redirection.type = REDIRECT_HERE_DOCUMENT;
+        p += 2;
+        if (*p == '-') {
+            p++;
+        }
+    } else if (p[0] == '<' && p[1] == '>') {
+        redirection.type = REDIRECT_READ_WRITE;
+        p += 2;
+    } else if (p[0] == '<' && p[1] == '&') {
+        redirection.type = REDIRECT_DUPLICATE;
+        p += 2;
+    } else if (p[0] == '>' && p[1] == '>') {
+        redirection.type = REDIRECT_APPEND;
+        default_fd = STDOUT_FILENO;
+        p += 2;
+    } else if (p[0] == '>' && p[1] == '&') {
+        redirection.type = REDIRECT_DUPLICATE;
+        default_fd = STDOUT_FILENO;
+        p += 2;
+    } else if (p[0] == '>') {
+        redirection.type = REDIRECT_OUTPUT;
+        default_fd = STDOUT_FILENO;
+        p += 1;
+    } else {
+        p += 1;
+    }
+
+    if (!explicit_fd) {
+        redirection.fd = default_fd;
+    }
+
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+
+    // The target is a single word; expansions in it are never split
+    tokenizer->no_split = 1;
+    while (p != NULL && *p != '\0' && !is_blank(*p) && !is_redirection_operator(p) && *p != '|' &&
+           !(p[0] == '&' && p[1] == '>')) {
+        if (redirection.type == REDIRECT_HERE_DOCUMENT) {
+            // The delimiter was already used by collect_here_documents(), it is only skipped here
+            p = (*p == '\'' || *p == '"') ? skip_quoted(p) : p + 1;
+            tokenizer->word_started = 1;
+        } else {
+            p = parse_word_part(tokenizer, p);
+        }
+    }
+    tokenizer->no_split = 0;
+    if (p == NULL) {
+        return NULL;
+    }
+    if (!tokenizer->word_started) {
+        fprintf(stderr, "Missing target of redirection\n");
+        return NULL;
+    }
+
+    if (redirection.type == REDIRECT_HERE_DOCUMENT) {
+        struct HereDocument here_document;
+        reset_word(tokenizer);
+        if (next_here_document(&here_document) == -1) {
+            here_document.body = "";
+            here_document.length = 0;
+            here_document.expand = 0;
+        }
+        if (here_document.expand) {
+            expand_here_document(tokenizer, here_document.body, here_document.length);
+            redirection.source_fd = open_here_document(tokenizer->word.data != NULL ? tokenizer->word.data : "",
+                                                       tokenizer->word.length);
+            reset_word(tokenizer);
+        } else {
+            redirection.source_fd = open_here_document(here_document.body, here_document.length);
+        }
+    } else if (redirection.type == REDIRECT_HERE_STRING) {
+        buffer_append_char(&tokenizer->word, '\n');
+        redirection.type = REDIRECT_HERE_DOCUMENT;
+        redirection.source_fd = open_here_document(tokenizer->word.data, tokenizer->word.length);
+        reset_word(tokenizer);
+    } else if (redirection.type == REDIRECT_DUPLICATE) {
+        // N>&M duplicates M, N>&- closes N and >&file is the same as &>file
+        char *target = take_word(tokenizer);
+        char *end;
+        long source_fd = strtol(target, &end, 10);
+        if (strcmp(target, "-") == 0) {
+            redirection.type = REDIRECT_CLOSE;
+            free(target);
+        } else if (*target != '\0' && *end == '\0' && source_fd >= 0) {
+            redirection.source_fd = (int)source_fd;
+            free(target);
+        } else if (!explicit_fd && redirection.fd == STDOUT_FILENO) {
+            redirection.type = REDIRECT_OUTPUT;
+            redirection.target = target;
+            both_outputs = 1;
+        } else {
+            fprintf(stderr, "Ambiguous redirect: %s\n", target);
+            free(target);
+            return NULL;
+        }
+    } else {
+        redirection.target = take_word(tokenizer);
+    }
+
+    add_redirection(tokenizer->words, &redirection);
+
+    if (both_outputs) {
+        struct Redirection duplicate = {REDIRECT_DUPLICATE, STDERR_FILENO, NULL, STDOUT_FILENO};
+        add_redirection(tokenizer->words, &duplicate);
+    }
+    return p;
+}
+
+// Returns the length of the descriptor number before a redirection starting at p ("2" in 2>file), -1 if there is none
+static int redirection_start(const char *p) {
+    int digits = 0;
+    while (p[digits] >= '0' && p[digits] <= '9') {
+        digits++;
+    }
+    if (digits == 0 && p[0] == '&' && p[1] == '>') {
+        return 0;
+    }
+    return is_redirection_operator(p + digits) ? digits : -1;
+}
+
+int parse_input(const char *input, struct Words *words) {
+    struct Tokenizer tokenizer = {words, {NULL, 0, 0}, 0, 0, 0};
+    const char *p = input;
+
+    words->argc = 0;
+    words->num_assignments = 0;
+    words->captures = NULL;
+    words->num_captures = 0;
+    words->process_substitutions = NULL;
+    words->num_process_substitutions = 0;
+    words->redirections = NULL;
+    words->num_redirections = 0;
+    words->capacity = MAX_ARGS;
+    words->argv = malloc(words->capacity * sizeof(char *));
+    if (words->argv == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    words->argv[0] = NULL;
+
+    while (*p != '\0') {
+        if (is_blank(*p)) {
+            finish_word(&tokenizer);
+            p++;
+            continue;
+        }
+
+        // Digits right before an operator at the start of a word select the descriptor, as in 2>file
+        int fd_length = tokenizer.word_started ? (is_redirection_operator(p) ? 0 : -1) : redirection_start(p);
+        if (fd_length >= 0) {
+            finish_word(&tokenizer);
+            p = parse_redirection(&tokenizer, p, fd_length);
+        } else {
+            if (!tokenizer.word_started && (p == input || is_blank(p[-1]))) {
+                tokenizer.assignment = words->num_assignments == words->argc && starts_assignment(p);
+            }
+            p = parse_word_part(&tokenizer, p);
+        }
+        if (p == NULL) {
+            buffer_free(&tokenizer.word);
+            free_words(words);
+            return -1;
+        }
+    }
+    finish_word(&tokenizer);
+    buffer_free(&tokenizer.word);
+    return 0;
+}
+
+size_t protected_span_length(const char *text) {
+    // Single-quoted strings and variable references are never rewritten by abbreviations
+    if (text[0] == '\\' && text[1] != '\0') {
+        return 2;
+    }
+    if (text[0] == '\'') {
+        const char *end = strchr(text + 1, '\'');
+        return end != NULL ? (size_t)(end - text) + 1 : strlen(text);
+    }
+    if (text[0] == '$' && text[1] == '{') {
+        const char *end = strchr(text + 2, '}');
+        return end != NULL ? (size_t)(end - text) + 1 : strlen(text);
+    }
+    if (text[0] == '$' && is_name_char(text[1])) {
+        size_t length = 1;
+        while (is_name_char(text[length])) {
+            length++;
+        }
+        return length;
+    }
+    return 0;
+}
+
+const char *skip_quoted(const char *p) {
+    // Returns the position right after the quoted string starting at p
+    if (*p == '\'') {
+        const char *end = strchr(p + 1, '\'');
+        return end != NULL ? end + 1 : p + strlen(p);
+    }
+    if (*p == '"' || *p == '`') {
+        char quote = *p++;
+        while (*p != '\0' && *p != quote) {
+            if (*p == '\\' && p[1] != '\0') {
+                p += 2;
+            } else if (quote == '"' && *p == '$' && p[1] == '(') {
+                const char *end = skip_substitution(p);
+                p = end != NULL ? end : p + strlen(p);
+            } else if (quote == '"' && *p == '`') {
+                p = skip_quoted(p);
+            } else {
+                p++;
+            }
+        }
+        return *p == quote ? p + 1 : p;
+    }
+    return p + 1;
+}
+
+void apply_assignments(char *args[], int count, int exported) {
+    for (int i = 0; i < count; i++) {
+        char *equal_sign = strchr(args[i], '=');
+        *equal_sign = '\0';
+        set_variable(args[i], equal_sign + 1);
+        if (exported) {
+            export_variable(args[i]);
+        }
+        *equal_sign = '=';
+    }
+}
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE // For strcasestr()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "headers.h"
+
+// One directory of the frecency index; visits are appended to .directories as "path|rank|time"
+struct VisitedDirectory {
+    char *path;
+    char *description; // ldir label, NULL if the directory has none
+    double rank;       // Number of visits, aged once all ranks together exceed DIRECTORY_RANK_LIMIT
+    time_t last_visit;
+};
+
+static struct VisitedDirectory *directories = NULL;
+static int total_directories = 0;
+static int directories_capacity = 0;
+
+// Open-addressing index from path to position in directories, -1 marks an empty slot
+static int *directory_slots = NULL;
+static size_t directory_slots_capacity = 0;
+
+static int directories_loaded = 0;
+static int directory_records = 0; // Lines in .directories, several of them may belong to one directory
+
+
+static int *find_directory_slot(const char *path) {
+    size_t mask = directory_slots_capacity - 1;
+    size_t index = hash_bytes(path, strlen(path)) & mask;
+    while (directory_slots[index] != -1 && strcmp(directories[directory_slots[index]].path, path) != 0) {
+        index = (index + 1) & mask;
+    }
+    return &directory_slots[index];
+}
+
+static void grow_directory_slots() {
+    free(directory_slots);
+    directory_slots_capacity = directory_slots_capacity == 0 ? 256 : directory_slots_capacity * 2;
+    directory_slots = malloc(directory_slots_capacity * sizeof(int));
+    if (directory_slots == NULL) {
+        perror("Failed to allocate directory index");
+        exit(EXIT_FAILURE);
+    }
+    memset(directory_slots, -1, directory_slots_capacity * sizeof(int));
+    for (int i = 0; i < total_directories; i++) {
+        *find_directory_slot(directories[i].path) = i;
+    }
+}
+
+// Returns the directory with this path, added with no visits if it isn't known yet
+static struct VisitedDirectory *get_directory(const char *path) {
+    // The table stays at most half full
+    if ((size_t)(total_directories + 1) * 2 > directory_slots_capacity) {
+        grow_directory_slots();
+    }
+    int *slot = find_directory_slot(path);
+    if (*slot != -1) {
+        return &directories[*slot];
+    }
+
+    if (total_directories == directories_capacity) {
+        directories_capacity = directories_capacity == 0 ? 128 : directories_capacity * 2;
+        directories = realloc(directories, directories_capacity * sizeof(struct VisitedDirectory));
+        if (directories == NULL) {
+            perror("Failed to allocate directory index");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct VisitedDirectory *directory = &directories[total_directories];
+    directory->path = strdup(path);
+    if (directory->path == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    directory->description = NULL;
+    directory->rank = 0;
+    directory->last_visit = 0;
+    *slot = total_directories++;
+    return directory;
+}
+
+void label_directory(const char *path, const char *description) {
+    if (!directories_loaded) {
+        return; // Labels are read together with the visits on the first use
+    }
+    struct VisitedDirectory *directory = get_directory(path);
+    free(directory->description);
+    directory->description = strdup(description);
+}
+
+static void load_labels() {
+    FILE *file = open_cache_file(labeled_directories_file, "r");
+    if (file == NULL) {
+        return;
+    }
+    char line[MAX_INPUT_LENGTH];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char path[MAX_INPUT_LENGTH], description[MAX_INPUT_LENGTH];
+        if (sscanf(line, "%[^:]:%[^:\n]", path, description) == 2) {
+            label_directory(path, description);
+        }
+    }
+    fclose(file);
+}
+
+static void load_directories() {
+    directories_loaded = 1;
+    grow_directory_slots();
+
+    FILE *file = open_cache_file(directories_file, "r");
+    if (file != NULL) {
+        char line[MAX_INPUT_LENGTH];
+        while (fgets(line, sizeof(line), file) != NULL) {
+            // Split from the right, '|' may be part of the path
+            line[strcspn(line, "\n")] = '\0';
+            char *time_separator = strrchr(line, '|');
+            if (time_separator == NULL) {
+                continue;
+            }
+            *time_separator = '\0';
+            char *rank_separator = strrchr(line, '|');
+            if (rank_separator == NULL || line[0] != '/') {
+                continue;
+            }
+            *rank_separator = '\0';
+
+            struct VisitedDirectory *directory = get_directory(line);
+            directory->rank += atof(rank_separator + 1);
+            time_t last_visit = (time_t)atoll(time_separator + 1);
+            if (last_visit > directory->last_visit) {
+                directory->last_visit = last_visit;
+            }
+            directory_records++;
+        }
+        fclose(file);
+    }
+    load_labels();
+}
+
+// Rewrites .directories with one line per directory, aging the ranks once they grew too large
+static void compact_directories() {
+    double total_rank = 0;
+    for (int i = 0; i < total_directories; i++) {
+        total_rank += directories[i].rank;
+    }
+    double aging = total_rank > DIRECTORY_RANK_LIMIT ? 0.99 : 1;
+
+    FILE *file = open_cache_file(directories_file, "w");
+    if (file == NULL) {
+        perror("Failed to open .directories for writing");
+        return;
+    }
+    directory_records = 0;
+    for (int i = 0; i < total_directories; i++) {
+        directories[i].rank *= aging;
+        // Directories visited long ago fade out, labeled ones stay in memory anyway
+        if (directories[i].rank >= 1) {
+            fprintf(file, "%s|%.2f|%lld\n", directories[i].path, directories[i].rank, (long long)directories[i].last_visit);
+            directory_records++;
+        }
+    }
+    fclose(file);
+}
+
+void record_directory_visit() {
+    char cwd[MAX_PATH_LENGTH];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return;
+    }
+    if (!directories_loaded) {
+        load_directories();
+    }
+
+    struct VisitedDirectory *directory = get_directory(cwd);
+    directory->rank += 1;
+    directory->last_visit = time(NULL);
+
+    // Only the visit is appended, the file is rewritten once it holds many records per directory
+    if (directory_records > 2 * total_directories + 64) {
+        compact_directories();
+        return;
+    }
+    FILE *file = open_cache_file(directories_file, "a");
+    if (file == NULL) {
+        perror("Failed to open .directories");
+        return;
+    }
+    fprintf(file, "%s|1|%lld\n", cwd, (long long)directory->last_visit);
+    fclose(file);
+    directory_records++;
+}
+
+static double frecency(const struct VisitedDirectory *directory, time_t now) {
+    // Labeled directories are found even if they were never visited
+    double rank = directory->rank > 0 ? directory->rank : (directory->description != NULL ? 0.5 : 0);
+    time_t age = now - directory->last_visit;
+    if (age < 3600) {
+        return rank * 4;
+    }
+    if (age < 86400) {
+        return rank * 2;
+    }
+    if (age < 604800) {
+        return rank / 2;
+    }
+    return rank / 4;
+}
+
+// Fragments must occur in order; a fragment without capitals matches regardless of case
+static int fragments_match(const char *text, char *fragments[]) {
+    for (int i = 0; fragments[i] != NULL; i++) {
+        int ignore_case = 1;
+        for (const char *p = fragments[i]; *p != '\0'; p++) {
+            if (isupper((unsigned char)*p)) {
+                ignore_case = 0;
+            }
+        }
+        const char *found = ignore_case ? strcasestr(text, fragments[i]) : strstr(text, fragments[i]);
+        if (found == NULL) {
+            return 0;
+        }
+        text = found + strlen(fragments[i]);
+    }
+    return 1;
+}
+
+static int directory_matches(const struct VisitedDirectory *directory, char *fragments[]) {
+    return fragments_match(directory->path, fragments) ||
+           (directory->description != NULL && fragments_match(directory->description, fragments));
+}
+
+static int compare_scores(const void *a, const void *b) {
+    double score_a = *(const double *)a;
+    double score_b = *(const double *)b;
+    return (score_a < score_b) - (score_a > score_b);
+}
+
+static void list_directories(char *fragments[]) {
+    // Pairs of score and index, sorted by score
+    double (*matches)[2] = malloc((total_directories + 1) * sizeof(*matches));
+    if (matches == NULL) {
+        perror("Failed to allocate memory");
+        return;
+    }
+    time_t now = time(NULL);
+    int count = 0;
+    for (int i = 0; i < total_directories; i++) {
+        if (directory_matches(&directories[i], fragments)) {
+            matches[count][0] = frecency(&directories[i], now);
+            matches[count][1] = i;
+            count++;
+        }
+    }
+    qsort(matches, count, sizeof(*matches), compare_scores);
+    for (int i = 0; i < count; i++) {
+        const struct VisitedDirectory *directory = &directories[(int)matches[i][1]];
+        printf("%10.2f  %s", matches[i][0], directory->path);
+        if (directory->description != NULL) {
+            printf("  (%s)", directory->description);
+        }
+        printf("\n");
+    }
+    free(matches);
+}
+
+void z(char *args[]) {
+    if (args[1] == NULL) {
+        printf("Usage: z <fragment> [<fragment> ...]\n\tz -l [<fragment> ...]\n");
+        last_status = 1;
+        return;
+    }
+    if (!directories_loaded) {
+        load_directories();
+    }
+    if (strcmp(args[1], "-l") == 0) {
+        list_directories(args + 2);
+        return;
+    }
+
+    // The best match that still exists wins, the current directory only if nothing else matches
+    char cwd[MAX_PATH_LENGTH];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        cwd[0] = '\0';
+    }
+    time_t now = time(NULL);
+    const struct VisitedDirectory *best = NULL;
+    double best_score = -1;
+    for (int i = 0; i < total_directories; i++) {
+        const struct VisitedDirectory *directory = &directories[i];
+        double score = frecency(directory, now);
+        if (strcmp(directory->path, cwd) == 0) {
+            score = 0;
+        }
+        if (score > best_score && directory_matches(directory, args + 1)) {
+            struct stat st;
+            if (stat(directory->path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                best = directory;
+                best_score = score;
+            }
+        }
+    }
+    if (best == NULL) {
+        printf("z: no directory matches\n");
+        last_status = 1;
+        return;
+    }
+
+    print_directory_description(best->path);
+    if (chdir(best->path) == -1) {
+        perror("Failed to change directory");
+        last_status = 1;
+        return;
+    }
+    cwd_changed = 1;
+    record_directory_visit();
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "headers.h"
+
+// A function defined with "function name { ... }", its body is parsed on the first call and kept
+struct Function {
+    char *body;
+    struct ScriptNode *script;
+    int parsed;
+    int running;         // Nesting count of calls, a running function is freed only after it returns
+    int retired;         // Redefined or unset while running
+    struct Command command; // Entry returned by find_gogi_command(), command is the name
+};
+
+char **positional_args = NULL; // $1, $2, ... of the function being called, NULL-terminated
+int positional_count = 0;
+
+static struct Function **defined_functions = NULL;
+static int total_functions = 0;
+static int functions_capacity = 0;
+static int function_depth = 0;
+
+
+static void free_function(struct Function *function) {
+    free((char *)function->command.command);
+    free(function->body);
+    free_script(function->script);
+    free(function);
+}
+
+static void retire_function(struct Function *function) {
+    if (function->running > 0) {
+        function->retired = 1;
+    } else {
+        free_function(function);
+    }
+}
+
+static int find_function_index(const char *name, size_t length) {
+    for (int i = 0; i < total_functions; i++) {
+        const char *function_name = defined_functions[i]->command.command;
+        if (strlen(function_name) == length && strncmp(function_name, name, length) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct Command *find_function_command(const char *name, size_t length) {
+    int index = find_function_index(name, length);
+    return index == -1 ? NULL : &defined_functions[index]->command;
+}
+
+static void call_function(char *args[]) {
+    int index = find_function_index(args[0], strlen(args[0]));
+    if (index == -1) {
+        return;
+    }
+    struct Function *function = defined_functions[index];
+    if (function_depth >= MAX_FUNCTION_DEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", args[0]);
+        last_status = 1;
+        return;
+    }
+
+    // Parsed once, every following call runs the cached tree
+    if (!function->parsed) {
+        long long trace_start = trace_begin();
+        function->script = compile_script(function->body);
+        trace_end("function parse", trace_start);
+        if (function->script == NULL && function->body[strspn(function->body, " \t\n;")] != '\0') {
+            last_status = 2;
+            return;
+        }
+        function->parsed = 1;
+    }
+
+    // The arguments of the caller come back once the function returns
+    char **saved_args = positional_args;
+    int saved_count = positional_count;
+    positional_args = args + 1;
+    for (positional_count = 0; positional_args[positional_count] != NULL; positional_count++) {
+    }
+
+    function->running++;
+    function_depth++;
+    last_status = 0;
+    run_script_tree(function->script);
+    function_depth--;
+    function->running--;
+
+    positional_args = saved_args;
+    positional_count = saved_count;
+    if (function->retired && function->running == 0) {
+        free_function(function);
+    }
+}
+
+static void save_functions() {
+    FILE *file = open_cache_file(functions_file, "w");
+    if (file == NULL) {
+        perror("Failed to open .functions for writing");
+        return;
+    }
+    // "name length" followed by the body, which may span several lines
+    for (int i = 0; i < total_functions; i++) {
+        fprintf(file, "%s %zu\n%s\n", defined_functions[i]->command.command, strlen(defined_functions[i]->body), defined_functions[i]->body);
+    }
+    fclose(file);
+}
+
+static void add_function(const char *name, const char *body) {
+    struct Function *function = calloc(1, sizeof(struct Function));
+    char *name_copy = strdup(name);
+    char *body_copy = strdup(body);
+    if (function == NULL || name_copy == NULL || body_copy == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    function->body = body_copy;
+    function->command.command = name_copy;
+    function->command.function = call_function;
+    function->command.capturable = 0;
+
+    int index = find_function_index(name, strlen(name));
+    if (index != -1) {
+        retire_function(defined_functions[index]);
+        defined_functions[index] = function;
+        return;
+    }
+    if (total_functions == functions_capacity) {
+        functions_capacity = functions_capacity == 0 ? 16 : functions_capacity * 2;
+        defined_functions = realloc(defined_functions, functions_capacity * sizeof(struct Function *));
+        if (defined_functions == NULL) {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+    defined_functions[total_functions++] = function;
+}
+
+void define_function(const char *name, const char *body) {
+    // GoGiShell commands are looked up first, a function of the same name would never be called
+    struct Command *gogi_command = find_gogi_command(name, strlen(name));
+    if (gogi_command != NULL && gogi_command->function != call_function) {
+        fprintf(stderr, "function: '%s' is a GoGiShell command\n", name);
+        last_status = 1;
+        return;
+    }
+    add_function(name, body);
+    save_functions();
+}
+
+int undefine_function(const char *name) {
+    int index = find_function_index(name, strlen(name));
+    if (index == -1) {
+        return -1;
+    }
+    retire_function(defined_functions[index]);
+    defined_functions[index] = defined_functions[--total_functions];
+    save_functions();
+    return 0;
+}
+
+void load_functions() {
+    FILE *file = open_cache_file(functions_file, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char header[MAX_INPUT_LENGTH];
+    while (fgets(header, sizeof(header), file)) {
+        char name[MAX_COMMAND_LENGTH];
+        size_t length;
+        if (sscanf(header, "%63s %zu", name, &length) != 2 || length >= MAX_INPUT_LENGTH) {
+            fprintf(stderr, "Corrupted .functions, the rest of it is ignored\n");
+            break;
+        }
+        char body[MAX_INPUT_LENGTH];
+        if (fread(body, 1, length + 1, file) != length + 1) {
+            break;
+        }
+        body[length] = '\0';
+        add_function(name, body);
+    }
+    fclose(file);
+}
+
+// Replaces every function with the definitions of .functions, e.g. after another shell changed them
+void reload_functions() {
+    for (int i = 0; i < total_functions; i++) {
+        retire_function(defined_functions[i]);
+    }
+    total_functions = 0;
+    load_functions();
+}
+
+void functions(char *args[]) {
+    if (args[1] != NULL) {
+        printf("Usage: functions\n");
+        last_status = 1;
+        return;
+    }
+    for (int i = 0; i < total_functions; i++) {
+        printf("function %s {%s }\n", defined_functions[i]->command.command, defined_functions[i]->body);
+    }
+}
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE // For fopencookie()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include "headers.h"
+
+struct Counters counters;
+int cache_files_written = 0;
+int cache_files_truncated = 0;
+
+// Names of the cache files, in the order of the CACHE_* indices
+static const char *cache_file_names[NUM_CACHE_FILES] = {
+    ".home_path", ".history", ".sorted_history", ".abbreviation", ".labeled_directories", ".history_stats", ".functions", ".directories"
+};
+
+// The stdio stream of a cache file reads and writes through these, so every byte is counted
+struct CountedFile {
+    int fd;
+    int cache_index;
+};
+
+
+static int cache_file_index(const char *path) {
+    const char *paths[NUM_CACHE_FILES] = {
+        home_path_file, history_file, sorted_history_file, abbreviation_file, labeled_directories_file, history_stats_file, functions_file, directories_file
+    };
+    for (int i = 0; i < NUM_CACHE_FILES; i++) {
+        if (strcmp(path, paths[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static ssize_t counted_read(void *cookie, char *buffer, size_t size) {
+    struct CountedFile *file = cookie;
+    ssize_t bytes_read = read(file->fd, buffer, size);
+    if (bytes_read > 0) {
+        COUNT(cache_bytes_read[file->cache_index], bytes_read);
+    }
+    return bytes_read;
+}
+
+static ssize_t counted_write(void *cookie, const char *buffer, size_t size) {
+    struct CountedFile *file = cookie;
+    ssize_t bytes_written = write(file->fd, buffer, size);
+    if (bytes_written > 0) {
+        COUNT(cache_bytes_written[file->cache_index], bytes_written);
+    }
+    return bytes_written;
+}
+
+static int counted_seek(void *cookie, off64_t *offset, int whence) {
+    struct CountedFile *file = cookie;
+    off64_t result = lseek64(file->fd, *offset, whence);
+    if (result == -1) {
+        return -1;
+    }
+    *offset = result;
+    return 0;
+}
+
+static int counted_close(void *cookie) {
+    struct CountedFile *file = cookie;
+    int result = close(file->fd);
+    free(file);
+    return result;
+}
+
+// Opens open_path as a stdio stream counted as the cache file cache_index
+static FILE *open_counted_file(const char *open_path, int cache_index, int flags, const char *mode) {
+    struct CountedFile *counted = malloc(sizeof(struct CountedFile));
+    if (counted == NULL) {
+        return NULL;
+    }
+    counted->fd = open(open_path, flags | O_CLOEXEC, 0644);
+    if (counted->fd == -1) {
+        free(counted);
+        return NULL;
+    }
+    counted->cache_index = cache_index;
+    COUNT(cache_opens[cache_index], 1);
+
+    cookie_io_functions_t functions = {counted_read, counted_write, counted_seek, counted_close};
+    FILE *file = fopencookie(counted, mode, functions);
+    if (file == NULL) {
+        close(counted->fd);
+        free(counted);
+    }
+    return file;
+}
+
+FILE *open_cache_file(const char *path, const char *mode) {
+    int cache_index = cache_file_index(path);
+    if (cache_index == -1) {
+        return fopen(path, mode);
+    }
+
+    int flags;
+    if (mode[0] == 'r') {
+        flags = 0;
+    } else if (mode[0] == 'w') {
+        flags = O_CREAT | O_TRUNC;
+    } else {
+        flags = O_CREAT | O_APPEND;
+    }
+    if (strchr(mode, '+') != NULL) {
+        flags |= O_RDWR;
+    } else {
+        flags |= mode[0] == 'r' ? O_RDONLY : O_WRONLY;
+    }
+    if ((flags & O_ACCMODE) != O_RDONLY) {
+        cache_files_written |= 1 << cache_index;
+        cache_files_truncated |= flags & O_TRUNC ? 1 << cache_index : 0;
+    }
+    return open_counted_file(path, cache_index, flags, mode);
+}
+
+static void replacement_path(char *replacement, size_t size, const char *path) {
+    snprintf(replacement, size, "%s.new", path);
+}
+
+FILE *open_cache_replacement(const char *path) {
+    char replacement[MAX_PATH_LENGTH + 8];
+    replacement_path(replacement, sizeof(replacement), path);
+    int cache_index = cache_file_index(path);
+    if (cache_index == -1) {
+        return fopen(replacement, "w");
+    }
+    return open_counted_file(replacement, cache_index, O_CREAT | O_TRUNC | O_WRONLY, "w");
+}
+
+int replace_cache_file(FILE *file, const char *path) {
+    char replacement[MAX_PATH_LENGTH + 8];
+    replacement_path(replacement, sizeof(replacement), path);
+    if (fclose(file) != 0 || rename(replacement, path) == -1) {
+        unlink(replacement);
+        return -1;
+    }
+    int cache_index = cache_file_index(path);
+    if (cache_index != -1) {
+        cache_files_written |= 1 << cache_index;
+        cache_files_truncated |= 1 << cache_index;
+    }
+    return 0;
+}
+
+void discard_cache_replacement(FILE *file, const char *path) {
+    char replacement[MAX_PATH_LENGTH + 8];
+    replacement_path(replacement, sizeof(replacement), path);
+    fclose(file);
+    unlink(replacement);
+}
+
+pid_t counted_fork() {
+    long long start = monotonic_ns();
+    pid_t pid = fork();
+    if (pid > 0) {
+        COUNT(forks, 1);
+        COUNT(fork_ns, monotonic_ns() - start);
+    }
+    return pid;
+}
+
+void count_spawn(long long start_ns) {
+    COUNT(spawns, 1);
+    COUNT(spawn_ns, monotonic_ns() - start_ns);
+}
+
+long long count_completion_start() {
+    COUNT(completion_lookups, 1);
+    return monotonic_ns();
+}
+
+void count_completion_end(long long start_ns, int hit) {
+    COUNT(completion_ns, monotonic_ns() - start_ns);
+    if (hit) {
+        COUNT(completion_hits, 1);
+    }
+}
+
+static long long load(const long long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static double mean_ms(long long total_ns, long long count) {
+    return count == 0 ? 0 : total_ns / 1e6 / count;
+}
+
+void gogistat(char *args[]) {
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0 && args[2] == NULL) {
+        memset(&counters, 0, sizeof(counters));
+        printf("Counters were reset.\n");
+        return;
+    }
+    if (args[1] != NULL) {
+        printf("Usage: gogistat [-r]\n");
+        last_status = 1;
+        return;
+    }
+
+    printf("%-24s %10s %14s %14s\n", "cache file", "opens", "bytes read", "bytes written");
+    for (int i = 0; i < NUM_CACHE_FILES; i++) {
+        printf("%-24s %10lld %14lld %14lld\n", cache_file_names[i], load(&counters.cache_opens[i]),
+               load(&counters.cache_bytes_read[i]), load(&counters.cache_bytes_written[i]));
+    }
+    printf("\n");
+
+    long long completion_lookups = load(&counters.completion_lookups);
+    long long forks = load(&counters.forks);
+    long long spawns = load(&counters.spawns);
+
+    printf("%-24s %lld (%lld hits)\n", "history lookups", load(&counters.history_lookups), load(&counters.history_hits));
+    printf("%-24s %lld (%lld hits), %.3f ms mean\n", "completion lookups", completion_lookups,
+           load(&counters.completion_hits), mean_ms(load(&counters.completion_ns), completion_lookups));
+    printf("%-24s %lld\n", "abbreviation expansions", load(&counters.abbreviation_expansions));
+    printf("%-24s %lld, %.3f ms mean\n", "forks", forks, mean_ms(load(&counters.fork_ns), forks));
+    printf("%-24s %lld, %.3f ms mean\n", "spawns", spawns, mean_ms(load(&counters.spawn_ns), spawns));
+    printf("%-24s %lld\n", "prompt renders", load(&counters.prompt_renders));
+}
@@ -1,6 +1,11 @@
 #ifndef HEADERS_H
 #define HEADERS_H
 
+#include <stddef.h> // For size_t in struct Buffer
+#include <stdio.h> // For FILE in open_cache_file()
+#include <sys/types.h> // For pid_t in struct ProcessSubstitution
+#include <time.h> // For struct timespec in struct CommandStats
+#include <sys/resource.h> // For struct rusage in struct CommandStats
 #include <termios.h> // For declaration of enable/disable_noncanonical_mode()
 
 #define MAX_INPUT_LENGTH 4096
@@ -9,22 +14,220 @@
 #define MAX_COMMAND_NUMBER 1024
 #define MAX_COMMAND_LENGTH 64
 #define MAX_ARG_LENGTH 64
-#define MAX_ABBREVIATIONS 64
 #define MAX_KEY_LENGTH 16
 #define MAX_VALUE_LENGTH 64
-#define MAX_LABELED_DIRECTORIES 32
 #define MAX_COLOR_NAME_LENGTH 16
+#define MAX_HERE_DOCUMENTS 16
+#define MAX_REDIRECTIONS 16
+#define HERE_DOCUMENT_PIPE_LIMIT 4096 // Larger here-document bodies go to a sealed memfd instead of a pipe
+#define MAX_HERE_DOCUMENT_INPUT (64 * 1024 * 1024) // Here-document bodies may grow the input up to this size
+
+// Types of struct Redirection
+#define REDIRECT_INPUT 0
+#define REDIRECT_OUTPUT 1
+#define REDIRECT_APPEND 2
+#define REDIRECT_HERE_DOCUMENT 3
+#define REDIRECT_HERE_STRING 4
+#define REDIRECT_READ_WRITE 5
+#define REDIRECT_DUPLICATE 6
+#define REDIRECT_CLOSE 7
+#define FAN_OUT_CHUNK 65536
+#define MAX_BENCH_COMMANDS 16
+#define EACH_DEFAULT_JOBS 16 // Runs are mostly waiting for disk or network, not for a CPU
+#define MAX_CAPTURED_OUTPUTS 64
+#define CAPTURE_MEMORY_LIMIT (16 << 20) // Captured outputs over this in total are moved from memfds to temporary files
+#define CAPTURE_VARIABLE "GOGI_CAPTURE" // Number of command outputs kept for last and $LAST_OUT, none if unset
+#define LAST_OUTPUT_VARIABLE "LAST_OUT"
+#define CACHED_SIZE_LIMIT (64LL << 20) // Results of cached beyond this in total are evicted, least recently used first
+#define CACHED_LIMIT_VARIABLE "GOGI_CACHED_LIMIT" // Overrides CACHED_SIZE_LIMIT, in MiB
+#define MAX_CACHED_INPUTS 32
+#define HISTORY_HOT_LIMIT 4096 // .history is moved into a compressed segment in the background once it has this many entries
+#define HISTORY_HOT_VARIABLE "GOGI_HISTORY_HOT" // Overrides HISTORY_HOT_LIMIT
+#define HISTORY_MERGE_FANOUT 4 // This many segments of one size class are merged into one
+#define PIPESTAT_SAMPLE_MS 1 // pipestat samples the pipes at least this often
+#define WATCH_DEBOUNCE_MS 50 // watch-run starts once the changes have been quiet this long
+#define TRACE_RING_SIZE 65536
+#define TRACE_NAME_LENGTH 64 // Longer phase names are cut in the trace
+#define SCRIPT_CACHE_SIZE 16
+
+// Flags of start_job()
+#define JOB_CAPTURE 1        // Output and errors go to a pipe read into struct Job
+#define JOB_PROCESS_GROUP 2  // The job leads its own process group, so it can be stopped with all its children
+
+// Types of struct ScriptNode
+#define NODE_COMMAND 0
+#define NODE_IF 1
+#define NODE_WHILE 2
+#define NODE_UNTIL 3
+#define NODE_FOR 4
+#define NODE_CASE 5
+#define NODE_CASE_ITEM 6
+#define NODE_BREAK 7
+#define NODE_CONTINUE 8
+#define NODE_FUNCTION 9
+#define NODE_RETURN 10
+#define MAX_FUNCTION_DEPTH 256
+#define MAX_BRANCH_LENGTH 64
+#define PROMPT_CACHE_SIZE 64
+#define PROMPT_SEGMENTS_VARIABLE "GOGI_PROMPT" // Segments shown after the directory, e.g. "git status"
+#define DEFAULT_PROMPT_SEGMENTS "git duration status"
+#define PROMPT_DURATION_MIN_NS 1000000000LL // Shorter commands don't show their duration
+#define DIRECTORY_RANK_LIMIT 9000 // Ranks in .directories are aged once their sum exceeds it
+
+// Cache files counted by gogistat, see open_cache_file()
+#define CACHE_HOME_PATH 0
+#define CACHE_HISTORY 1
+#define CACHE_SORTED_HISTORY 2
+#define CACHE_ABBREVIATION 3
+#define CACHE_LABELED_DIRECTORIES 4
+#define CACHE_HISTORY_STATS 5
+#define CACHE_FUNCTIONS 6
+#define CACHE_DIRECTORIES 7
+#define NUM_CACHE_FILES 8
+
+// Relaxed atomic increment of one of the gogistat counters
+#define COUNT(counter, value) __atomic_fetch_add(&counters.counter, (value), __ATOMIC_RELAXED)
 
 #define PRE_CACHE_DIR "/.gogicache"
-#define PRE_HOME_PATH_FILE "/.gogicache/.home_path"
-#define PRE_HISTORY_FILE "/.gogicache/.history"
-#define PRE_ABBREVIATION_FILE "/.gogicache/.abbreviation"
-#define PRE_SORTED_HISTORY_FILE "/.gogicache/.sorted_history"
-#define PRE_LABELED_DIRECTORIES_FILE "/.gogicache/.labeled_directories"
+#define MAX_CACHE_DIR_LENGTH (MAX_PATH_LENGTH - 64) // Leaves room for the file names
+#define CACHE_DIR_VARIABLE "GOGICACHE_DIR" // Overrides $HOME/.gogicache, as does the --cache-dir flag
+#define PRE_HOME_PATH_FILE "/.home_path"
+#define PRE_HISTORY_FILE "/.history"
+#define PRE_ABBREVIATION_FILE "/.abbreviation"
+#define PRE_SORTED_HISTORY_FILE "/.sorted_history"
+#define PRE_LABELED_DIRECTORIES_FILE "/.labeled_directories"
+#define PRE_HISTORY_STATS_FILE "/.history_stats"
+#define PRE_FUNCTIONS_FILE "/.functions"
+#define PRE_DIRECTORIES_FILE "/.directories"
+#define PRE_CACHED_DIR "/.cached" // Results of cached, one file per key
+#define PRE_SERVER_SOCKET "/.server" // Unix socket of GoGiShell --server
+#define PRE_HISTORY_SEGMENTS_DIR "/.history_segments" // Older history in compressed segments
+#define MAX_SERVER_SESSIONS 256
 
 struct Command {
     const char *command;
     void (*function)(char *args[]);
+    int capturable; // Has no side effects, so $(command) may run it inside the shell process
+};
+
+// Growable byte buffer, always kept null-terminated
+struct Buffer {
+    char *data;
+    size_t length;
+    size_t capacity;
+};
+
+// Output of a command substitution, data has one spare byte after length
+struct Capture {
+    char *data;
+    size_t length;
+    size_t mapped_length; // Non-zero if data is a mapped memfd instead of a heap buffer
+};
+
+// <(command) or >(command) running next to the command it is passed to as /dev/fd/N
+struct ProcessSubstitution {
+    pid_t pid;
+    int fd;
+};
+
+// One entry of the redirection table of a command, applied in order
+struct Redirection {
+    int type;
+    int fd;         // Descriptor of the command being redirected
+    char *target;   // File name, NULL for here-documents and duplicates
+    int source_fd;  // Here-document body owned by the table, or descriptor copied by N>&M; -1 otherwise
+};
+
+// Here-document body cut out of the input by collect_here_documents()
+struct HereDocument {
+    char *body;
+    size_t length;
+    int expand; // The delimiter was unquoted, so $VAR and $(command) are expanded
+};
+
+// Descriptors replaced while redirecting a GoGiShell command inside the shell process
+struct SavedFds {
+    int fds[MAX_REDIRECTIONS];
+    int copies[MAX_REDIRECTIONS];
+    int count;
+};
+
+// Timing and resource usage of one executed command, children included
+struct CommandStats {
+    struct timespec start;      // CLOCK_MONOTONIC
+    time_t started_at;
+    long long wall_ns;
+    struct rusage usage;        // User/sys CPU, max RSS and context switches
+    int exit_code;
+    struct rusage start_self;
+    struct rusage start_children;
+    long outer_maxrss;
+};
+
+// Command run by each or parallel in the background, its output and errors may be collected through a pipe
+struct Job {
+    pid_t pid;
+    int pidfd;          // Readable once the job exited, -1 if pidfd_open() isn't supported
+    int fd;             // Read end of the output pipe, -1 once it is closed or if output isn't captured
+    struct Buffer output;
+    long long start_ns; // CLOCK_MONOTONIC
+    long long wall_ns;
+    int exit_code;
+    int running;
+};
+
+// Pipe between two stages of a pipeline run by pipestat, the shell relays from in_fd to out_fd
+struct PipelineEdge {
+    int in_fd;                  // Read end of the pipe the upstream stage writes, -1 once closed
+    int out_fd;                 // Write end of the pipe the downstream stage reads
+    int capacity;               // Of the upstream pipe, it is full at this many bytes
+    long long bytes;
+    long long open_ns;          // Until the upstream stage closed its output or the downstream one exited
+    long long starved_ns;       // The downstream pipe was empty
+    long long backpressured_ns; // The upstream pipe was full
+};
+
+// Hot-path counters printed by gogistat, latencies are summed up in nanoseconds
+struct Counters {
+    long long cache_opens[NUM_CACHE_FILES];
+    long long cache_bytes_read[NUM_CACHE_FILES];
+    long long cache_bytes_written[NUM_CACHE_FILES];
+    long long history_lookups;
+    long long history_hits;
+    long long completion_lookups;
+    long long completion_hits;
+    long long completion_ns;
+    long long abbreviation_expansions;
+    long long forks;
+    long long fork_ns;
+    long long spawns;
+    long long spawn_ns;
+    long long prompt_renders;
+};
+
+// Node of a parsed script; lists are chained through next and executed from the tree as is
+struct ScriptNode {
+    int type;
+    char *text;                    // Command line, words of for, word of case, patterns of a case item or body of a function
+    char *name;                    // Variable of for, name of a function
+    struct ScriptNode *condition;  // Condition of if, while and until
+    struct ScriptNode *body;       // Commands of a branch, a loop or a case item; the items of case
+    struct ScriptNode *otherwise;  // else branch, an elif is an if nested here
+    struct ScriptNode *next;
+};
+
+// NULL-terminated argument vector produced by parse_input()
+struct Words {
+    char **argv;
+    int argc;
+    int capacity;
+    int num_assignments;      // Leading words written as NAME=value, a quoted word never is one
+    struct Capture *captures; // Substitution outputs some of argv points into
+    int num_captures;
+    struct ProcessSubstitution *process_substitutions; // Closed and reaped by free_words()
+    int num_process_substitutions;
+    struct Redirection *redirections;
+    int num_redirections;
 };
 
 extern char home_dir[MAX_PATH_LENGTH];
@@ -32,6 +235,10 @@ extern int cwd_changed;
 extern int total_commands;
 extern int total_abbreviations;
 extern int total_labeled_directories;
+extern int last_status;
+extern int tracing;
+extern struct Counters counters;
+extern int pipeline_stats_requested;
 
 extern char cache_dir[MAX_PATH_LENGTH];
 extern char home_path_file[MAX_PATH_LENGTH];
@@ -39,9 +246,17 @@ extern char history_file[MAX_PATH_LENGTH];
 extern char abbreviation_file[MAX_PATH_LENGTH];
 extern char sorted_history_file[MAX_PATH_LENGTH];
 extern char labeled_directories_file[MAX_PATH_LENGTH];
+extern char history_stats_file[MAX_PATH_LENGTH];
+extern char functions_file[MAX_PATH_LENGTH];
+extern char directories_file[MAX_PATH_LENGTH];
+extern char cached_dir[MAX_PATH_LENGTH];
+extern char server_socket_file[MAX_PATH_LENGTH];
+extern char history_segments_dir[MAX_PATH_LENGTH];
+extern int cache_files_written;   // Bits of the CACHE_* indices opened for writing, see notify_server()
+extern int cache_files_truncated;
 
 // Functions updating cache files from variables
-void initialize_paths();
+void initialize_paths(const char *cache_dir_override);
 void create_cache();
 void fulfil_home_path_file(const char *home_dir);
 void fulfil_history_file(char *input);
@@ -49,17 +264,111 @@ void fulfil_abbreviation_file(char *value, char *key);
 void fulfil_sorted_history_file(char *input);
 void fulfil_labeled_directories_file(char *path, char *description, char *color);
 
-// Comparison for fulfil_sorted_history_file()
-int compare(const void *a, const void *b);
-
 // Functions handling non-canonical mode
 void enable_noncanonical_mode(struct termios *original_termios);
 void disable_noncanonical_mode(struct termios *original_termios);
 
 // Main group of functions interpreting input
 void process_input(char *input);
+void execute_input(char *input);
+struct Command *find_gogi_command(const char *name, size_t length);
+int run_builtin(char *args[]);
 void expand_abbreviations_in_input(char *input);
-void parse_input(char *input, char *args[]);
+int parse_input(const char *input, struct Words *words);
+void free_words(struct Words *words);
+int status_to_exit_code(int status);
+
+// Helpers of the tokenizer
+void buffer_reserve(struct Buffer *buffer, size_t extra);
+void buffer_append(struct Buffer *buffer, const char *data, size_t length);
+void buffer_append_char(struct Buffer *buffer, char ch);
+void buffer_free(struct Buffer *buffer);
+size_t protected_span_length(const char *text);
+const char *skip_quoted(const char *p);
+const char *skip_substitution(const char *p);
+void apply_assignments(char *args[], int count, int exported);
+
+// Command substitution
+int capture_command(const char *command, struct Capture *capture);
+void free_capture(struct Capture *capture);
+int start_process_substitution(const char *command, int output, pid_t *pid);
+void pass_process_substitutions(struct Words *words);
+
+// Scripting engine for if, while, until, for and case, run inside the shell process
+int is_script(const char *input);
+int script_complete(const char *input);
+void run_script(const char *text);
+void free_script(struct ScriptNode *node);
+struct ScriptNode *compile_script(const char *text);
+void run_script_tree(struct ScriptNode *script);
+
+// Shell functions, dispatched like GoGiShell commands and kept in .functions
+extern char **positional_args;
+extern int positional_count;
+void define_function(const char *name, const char *body);
+int undefine_function(const char *name);
+struct Command *find_function_command(const char *name, size_t length);
+void load_functions();
+void reload_functions();
+
+// Frecency of visited directories, kept in .directories and indexed in memory for z
+void record_directory_visit();
+void label_directory(const char *path, const char *description);
+
+// Output of foreground commands kept for last and $LAST_OUT while GOGI_CAPTURE is set
+void initialize_output_capture();
+int begin_output_capture();
+void finish_output_capture();
+void mark_output_replayed();
+int read_last_output(struct Capture *capture);
+int send_file_range(int out_fd, int fd, off_t offset, off_t length);
+
+// Background server holding the startup state, new shells are forked from it and attach their terminal
+void start_server();
+int stop_server();
+int attach_to_server(int *exit_code);
+void notify_server();
+void finish_session(int exit_code);
+
+// Background jobs with captured output, started and reaped without blocking on any single one
+int start_job(struct Job *job, const char *directory, char *argv[], int flags);
+int wait_for_jobs(struct Job *jobs, int count);
+
+// Timing of commands recorded next to history
+long long monotonic_ns(); // CLOCK_MONOTONIC in nanoseconds
+pid_t wait_for_child(pid_t pid, int *status);
+pid_t wait_for_child_usage(pid_t pid, int *status, struct rusage *usage);
+void begin_command_stats(struct CommandStats *stats);
+void end_command_stats(struct CommandStats *stats);
+void print_command_stats(const struct CommandStats *stats);
+void fulfil_history_stats_file(const char *command, const struct CommandStats *stats);
+
+// Phase tracing into a ring buffer, exported as Chrome trace-event JSON
+long long trace_begin();
+void trace_end(const char *name, long long start_ns);
+
+// Counted cache file I/O, forks and lookups
+FILE *open_cache_file(const char *path, const char *mode);
+// A cache file is rewritten into "<path>.new", which then replaces it at once with rename()
+FILE *open_cache_replacement(const char *path);
+int replace_cache_file(FILE *file, const char *path);
+void discard_cache_replacement(FILE *file, const char *path);
+pid_t counted_fork();
+void count_spawn(long long start_ns);
+long long count_completion_start();
+void count_completion_end(long long start_ns, int hit);
+
+// Shell variables (open-addressing table shared with the environment of children)
+void initialize_variables();
+unsigned long hash_bytes(const char *data, size_t length); // FNV-1a, also for the other hash tables
+int is_valid_variable_name(const char *name, size_t length);
+const char *get_variable(const char *name);
+const char *get_variable_n(const char *name, size_t length);
+int set_variable(const char *name, const char *value);
+int export_variable(const char *name);
+void unset_variable(const char *name);
+char **get_environment();
+void print_variables(int exported_only);
 
 // Functions updating variables from cache files
 void get_home_dir();
@@ -74,6 +383,21 @@ void setabbr(char *args[]);
 void abbr(char *args[]);
 void ldir(char *args[]);
 void help(char *args[]);
+void export(char *args[]);
+void unset(char *args[]);
+void set(char *args[]);
+void fanout(char *args[]);
+void hstat(char *args[]);
+void bench(char *args[]);
+void trace(char *args[]);
+void gogistat(char *args[]);
+void functions(char *args[]);
+void z(char *args[]);
+void each(char *args[]);
+void parallel(char *args[]);
+void watch_run(char *args[]);
+void last(char *args[]);
+void cached(char *args[]);
 
 // Functions completing input
 char* get_command_from_history(int command_index);
@@ -83,10 +407,17 @@ char* get_most_used_command(char *input);
 void handle_up_arrow(char *input, int *command_index, int *i);
 void handle_down_arrow(char *input, int *command_index, int *i);
 void handle_tab(char *input, int *i);
+void read_continuation_line(char **input, size_t *capacity, int *i, int limit);
 
 // Updating prompt
 void get_prompt(char *cwd, char *home_dir, char *display_cwd);
 
+// Prompt segments; git state is computed by a worker thread and the prompt is repainted when it arrives
+extern long long last_command_ns;
+void render_prompt(const char *cwd, const char *display_cwd);
+void invalidate_prompt_segments();
+int read_key(const char *input, int length);
+
 // Printing the description of entering directory if labeled
 void print_directory_description(const char *path);
 
@@ -94,10 +425,33 @@ int get_color_for_directory(const char *cwd);
 int color_name_to_code(const char *color_name);
 
 // Handling redirection operators
-void handle_redirection(char *args[]);
+void handle_redirection(struct Words *words);
+int apply_redirections(struct Words *words, struct SavedFds *saved);
+void restore_redirections(struct SavedFds *saved);
+int begin_here_document_input(char *input);
+int continue_here_document_input(char *line);
+int collect_here_documents(char *input);
+int next_here_document(struct HereDocument *here_document);
+int open_here_document(const char *data, size_t length);
+int fan_out(int in_fd, int out_fds[], int count);
 
 // Handling pipelines
 void parse_pipeline(char *input, char *commands[], int *num_commands);
 void execute_pipeline(char *commands[], int num_commands);
+void relay_pipeline(struct PipelineEdge edges[], int count);
+void print_pipeline_report(struct Words stages[], struct PipelineEdge edges[], int num_stages, long long wall_ns);
+
+// History split into the hot .history and older compressed segments, numbers span both
+int count_history_entries();
+char *read_history_entry(int number);
+void print_history_entries(int from);
+int lock_history_append();
+void unlock_history_append(int lock_fd);
+void compact_history_in_background();
+int compact_history(int full);
+int clear_history();
+void print_history_segments();
+size_t compress_block(const unsigned char *data, size_t length, unsigned char *out, size_t capacity);
+int decompress_block(const unsigned char *data, size_t length, unsigned char *out, size_t raw_length);
 
 #endif
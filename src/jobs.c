@@ -0,0 +1,385 @@
+#define _GNU_SOURCE // For pipe2() and posix_spawn_file_actions_addchdir_np()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <poll.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "headers.h"
+
+// A directory labeled with ldir, as selected by each
+struct LabeledDirectory {
+    char *path;
+    char *description;
+};
+
+
+// Commands are spawned without copying the shell, only GoGiShell commands need a fork
+static pid_t spawn_job_command(const char *directory, char *argv[], int output_fd, int flags) {
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    if (flags & JOB_PROCESS_GROUP) {
+        posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+        posix_spawnattr_setpgroup(&attributes, 0);
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (output_fd != -1) {
+        posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, output_fd, STDERR_FILENO);
+    }
+    if (directory != NULL) {
+        posix_spawn_file_actions_addchdir_np(&actions, directory);
+    }
+
+    long long start_ns = monotonic_ns();
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], &actions, &attributes, argv, get_environment());
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (error != 0) {
+        fprintf(stderr, "%s: %s%s%s\n", argv[0], strerror(error), directory != NULL ? " in " : "", directory != NULL ? directory : "");
+        return -1;
+    }
+    count_spawn(start_ns);
+    return pid;
+}
+
+static pid_t fork_job_command(const char *directory, char *argv[], int output_fd, int flags) {
+    fflush(stdout);
+    pid_t pid = counted_fork();
+    if (pid == -1) {
+        perror("Internal function fork failed");
+        return -1;
+    }
+    if (pid == 0) {
+        if (flags & JOB_PROCESS_GROUP) {
+            setpgid(0, 0);
+        }
+
+        // The job never reads the terminal, its output streams go to the pipe if it is captured
+        int null_fd = open("/dev/null", O_RDONLY);
+        if (null_fd != -1) {
+            dup2(null_fd, STDIN_FILENO);
+            close(null_fd);
+        }
+        if (output_fd != -1) {
+            dup2(output_fd, STDOUT_FILENO);
+            dup2(output_fd, STDERR_FILENO);
+        }
+        if (directory != NULL && chdir(directory) == -1) {
+            perror(directory);
+            exit(1);
+        }
+        environ = get_environment();
+        run_builtin(argv);
+        fflush(stdout);
+        exit(last_status);
+    }
+    if (flags & JOB_PROCESS_GROUP) {
+        setpgid(pid, pid); // Also here, so the group exists as soon as fork() returns
+    }
+    return pid;
+}
+
+int start_job(struct Job *job, const char *directory, char *argv[], int flags) {
+    int capture = flags & JOB_CAPTURE;
+    int fds[2] = {-1, -1};
+    if (capture && pipe2(fds, O_CLOEXEC) == -1) {
+        perror("Internal function pipe failed");
+        return -1;
+    }
+
+    // GoGiShell commands and functions run in a forked copy of the shell
+    job->start_ns = monotonic_ns();
+    pid_t pid;
+    if (find_gogi_command(argv[0], strlen(argv[0])) != NULL) {
+        pid = fork_job_command(directory, argv, fds[1], flags);
+    } else {
+        pid = spawn_job_command(directory, argv, fds[1], flags);
+    }
+    if (capture) {
+        close(fds[1]);
+    }
+    if (pid == -1) {
+        if (capture) {
+            close(fds[0]);
+        }
+        return -1;
+    }
+
+    if (capture) {
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    }
+    job->pid = pid;
+    job->fd = fds[0];
+    job->pidfd = (int)syscall(SYS_pidfd_open, pid, 0); // -1 on old kernels, the job is polled then
+    memset(&job->output, 0, sizeof(job->output));
+    job->running = 1;
+    return 0;
+}
+
+// Reads what the job has written so far, closes the pipe at its end
+static void read_job_output(struct Job *job) {
+    char chunk[FAN_OUT_CHUNK];
+    while (job->fd != -1) {
+        ssize_t bytes_read = read(job->fd, chunk, sizeof(chunk));
+        if (bytes_read > 0) {
+            buffer_append(&job->output, chunk, bytes_read);
+        } else if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        } else {
+            if (bytes_read == 0 || errno != EAGAIN) {
+                close(job->fd);
+                job->fd = -1;
+            }
+            return;
+        }
+    }
+}
+
+static void finish_job(struct Job *job, int status) {
+    job->wall_ns = monotonic_ns() - job->start_ns;
+    job->exit_code = status_to_exit_code(status);
+    job->running = 0;
+
+    // Output left behind by the job is taken, a daemon it started may keep the pipe open forever
+    read_job_output(job);
+    if (job->fd != -1) {
+        close(job->fd);
+        job->fd = -1;
+    }
+    if (job->pidfd != -1) {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+}
+
+int wait_for_jobs(struct Job *jobs, int count) {
+    struct pollfd *pollfds = malloc(2 * count * sizeof(struct pollfd));
+    int *owners = malloc(2 * count * sizeof(int));
+    if (pollfds == NULL || owners == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    int finished = -1;
+    while (finished == -1) {
+        int total = 0, running = 0, polled = 1;
+        for (int i = 0; i < count; i++) {
+            if (!jobs[i].running) {
+                continue;
+            }
+            running++;
+            if (jobs[i].fd != -1) {
+                pollfds[total] = (struct pollfd){jobs[i].fd, POLLIN, 0};
+                owners[total++] = i;
+            }
+            if (jobs[i].pidfd != -1) {
+                pollfds[total] = (struct pollfd){jobs[i].pidfd, POLLIN, 0};
+                owners[total++] = i;
+            } else {
+                polled = 0;
+            }
+        }
+        if (running == 0) {
+            break;
+        }
+
+        // Without pidfds an exit shows up only as the end of the output, so waitpid() is retried
+        if (poll(pollfds, total, polled ? -1 : 10) == -1 && errno != EINTR) {
+            perror("Internal function poll failed");
+            break;
+        }
+        for (int p = 0; p < total; p++) {
+            struct Job *job = &jobs[owners[p]];
+            if (pollfds[p].revents == 0 || !job->running) {
+                continue;
+            }
+            if (pollfds[p].fd == job->fd) {
+                read_job_output(job);
+            } else if (pollfds[p].fd == job->pidfd && finished == -1) {
+                int status;
+                if (wait_for_child(job->pid, &status) == -1) {
+                    perror("Internal function waitpid failed");
+                    status = 1 << 8;
+                }
+                finish_job(job, status);
+                finished = owners[p];
+            }
+        }
+        for (int i = 0; i < count && finished == -1 && !polled; i++) {
+            int status;
+            if (jobs[i].running && jobs[i].pidfd == -1 && waitpid(jobs[i].pid, &status, WNOHANG) == jobs[i].pid) {
+                finish_job(&jobs[i], status);
+                finished = i;
+            }
+        }
+    }
+
+    free(pollfds);
+    free(owners);
+    return finished;
+}
+
+static void print_each_usage() {
+    printf("Usage: each [-P <jobs>] [--label <pattern>] -- <command> [<argument> ...]\n");
+}
+
+// Labeled directories whose description matches pattern, all of them if pattern is NULL
+static int read_labeled_directories(const char *pattern, struct LabeledDirectory **directories) {
+    *directories = NULL;
+    FILE *file = open_cache_file(labeled_directories_file, "r");
+    if (file == NULL) {
+        return 0;
+    }
+
+    int count = 0, capacity = 0;
+    char line[MAX_INPUT_LENGTH];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char path[MAX_INPUT_LENGTH], description[MAX_INPUT_LENGTH];
+        if (sscanf(line, "%[^:]:%[^:\n]", path, description) != 2) {
+            continue;
+        }
+        if (pattern != NULL && fnmatch(pattern, description, 0) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            *directories = realloc(*directories, capacity * sizeof(struct LabeledDirectory));
+            if (*directories == NULL) {
+                perror("Failed to allocate memory");
+                exit(EXIT_FAILURE);
+            }
+        }
+        (*directories)[count].path = strdup(path);
+        (*directories)[count].description = strdup(description);
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+// Prints the whole output of a job at once, every line prefixed with the label of its directory
+static void print_job_output(const struct Job *job, const char *label) {
+    const char *line = job->output.data;
+    const char *end = line + job->output.length;
+    while (line != NULL && line < end) {
+        const char *newline = memchr(line, '\n', end - line);
+        size_t length = newline != NULL ? (size_t)(newline - line) : (size_t)(end - line);
+        printf("[%s] %.*s\n", label, (int)length, line);
+        line += length + 1;
+    }
+    fflush(stdout);
+}
+
+void each(char *args[]) {
+    long max_jobs = EACH_DEFAULT_JOBS;
+    const char *pattern = NULL;
+    char **command = NULL;
+    char *end;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-P") == 0 && args[i + 1] != NULL) {
+            max_jobs = strtol(args[++i], &end, 10);
+            if (*end != '\0' || max_jobs <= 0) {
+                print_each_usage();
+                last_status = 1;
+                return;
+            }
+        } else if (strcmp(args[i], "--label") == 0 && args[i + 1] != NULL) {
+            pattern = args[++i];
+        } else if (strcmp(args[i], "--") == 0 && args[i + 1] != NULL) {
+            command = &args[i + 1];
+            break;
+        } else {
+            print_each_usage();
+            last_status = 1;
+            return;
+        }
+    }
+    if (command == NULL) {
+        print_each_usage();
+        last_status = 1;
+        return;
+    }
+
+    struct LabeledDirectory *directories;
+    int count = read_labeled_directories(pattern, &directories);
+    if (count == 0) {
+        printf("each: no labeled directory matches\n");
+        last_status = 1;
+        return;
+    }
+
+    struct Job *jobs = calloc(count, sizeof(struct Job));
+    int *order = malloc(count * sizeof(int)); // Jobs in the order they finished
+    if (jobs == NULL || order == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    // A directory starts as soon as a slot is free, the outputs are printed as the jobs finish
+    long long start_ns = monotonic_ns();
+    int started = 0, running = 0, finished = 0, failures = 0;
+    while (started < count || running > 0) {
+        if (started < count && running < max_jobs) {
+            if (start_job(&jobs[started], directories[started].path, command, JOB_CAPTURE) == -1) {
+                jobs[started].exit_code = 126;
+                order[finished++] = started;
+            } else {
+                running++;
+            }
+            started++;
+            continue;
+        }
+        int index = wait_for_jobs(jobs, started);
+        if (index == -1) {
+            break;
+        }
+        running--;
+        order[finished++] = index;
+        print_job_output(&jobs[index], directories[index].description);
+        buffer_free(&jobs[index].output);
+    }
+    long long wall_ns = monotonic_ns() - start_ns;
+
+    long long total_ns = 0;
+    int slowest = order[0];
+    for (int i = 0; i < finished; i++) {
+        const struct Job *job = &jobs[order[i]];
+        total_ns += job->wall_ns;
+        if (job->wall_ns > jobs[slowest].wall_ns) {
+            slowest = order[i];
+        }
+        if (job->exit_code != 0) {
+            failures++;
+        }
+    }
+    printf("each: %d directories in %.2fs (%.2fs one after another, slowest %.2fs in %s), %d failed\n",
+           count, wall_ns / 1e9, total_ns / 1e9, jobs[slowest].wall_ns / 1e9, directories[slowest].path, failures);
+    for (int i = 0; i < finished; i++) {
+        const struct Job *job = &jobs[order[i]];
+        if (job->exit_code != 0) {
+            printf("  exit %d after %.2fs in %s (%s)\n", job->exit_code, job->wall_ns / 1e9, directories[order[i]].path, directories[order[i]].description);
+        }
+    }
+    last_status = failures == 0 ? 0 : 1;
+
+    for (int i = 0; i < count; i++) {
+        free(directories[i].path);
+        free(directories[i].description);
+    }
+    free(directories);
+    free(jobs);
+    free(order);
+}
@@ -7,6 +7,8 @@
 
 #include "headers.h"
 
+extern char **environ;
+
 char home_dir[MAX_PATH_LENGTH];
 int cwd_changed = 1;
 int total_commands = 0;
@@ -17,10 +19,12 @@ void expand_abbreviations_in_input(char *input) {
     char expanded[MAX_INPUT_LENGTH] = {0}; // Buffer to store the expanded input
     char key[MAX_KEY_LENGTH];
     char value[MAX_VALUE_LENGTH];
-    int i = 0, j = 0;
+    size_t i = 0, j = 0;
+    size_t first_line_length = strcspn(input, "\n");
+    size_t rest_length = strlen(&input[first_line_length]);
 
     // Open the file containing abbreviations
-    FILE *file = fopen(abbreviation_file, "r");
+    FILE *file = open_cache_file(abbreviation_file, "r");
     if (!file) {
         perror("Failed to open .abbreviation");
         return;
@@ -40,14 +44,28 @@ void expand_abbreviations_in_input(char *input) {
             // Remove newline character from value
             value[strcspn(value, "\n")] = '\0';
 
-            // Process input to expand the abbreviation
+            // Process the first line to expand the abbreviation
             i = 0;
             j = 0;
-            while (input[i] != '\0' && j < MAX_INPUT_LENGTH - 1) {
-                if (strncmp(&input[i], key, strlen(key)) == 0) {
+            while (i < first_line_length && j < MAX_INPUT_LENGTH - 1) {
+                // Quoted text and variable references are copied as they are
+                size_t protected_length = protected_span_length(&input[i]);
+                if (i + protected_length > first_line_length) {
+                    protected_length = first_line_length - i;
+                }
+                if (protected_length > 0) {
+                    if (j + protected_length >= MAX_INPUT_LENGTH - 1) {
+                        perror("Expanded output exceeds maximum input length");
+                        break;
+                    }
+                    memcpy(&expanded[j], &input[i], protected_length);
+                    j += protected_length;
+                    i += protected_length;
+                } else if (strncmp(&input[i], key, strlen(key)) == 0) {
                     // Match found; check if the expanded output can fit
                     int value_len = strlen(value);
                     if (j + value_len < MAX_INPUT_LENGTH - 1) {
+                        COUNT(abbreviation_expansions, 1);
                         strcpy(&expanded[j], value);
                         j += value_len;
                         i += strlen(key);
@@ -67,10 +85,13 @@ void expand_abbreviations_in_input(char *input) {
                 }
             }
 
-            expanded[j] = '\0';
-
-            strncpy(input, expanded, MAX_INPUT_LENGTH - 1);
-            input[MAX_INPUT_LENGTH - 1] = '\0';
+            // Here-document bodies after the first line are left as they are, only moved along with its end.
+            // The input has room for that, see read_continuation_line().
+            if ((size_t)j != first_line_length) {
+                memmove(&input[j], &input[first_line_length], rest_length + 1);
+            }
+            memcpy(input, expanded, j);
+            first_line_length = j;
         }
     }
 
@@ -82,24 +103,174 @@ void expand_abbreviations_in_input(char *input) {
     fclose(file);
 }
 
-void parse_input(char *input, char *args[]) {
-    char *token;
-    int i = 0;
+struct Command GoGi_commands[] = {
+    {"sethome", sethome, 0},
+    {"history", history, 1},
+    {"home", home, 1},
+    {"setabbr", setabbr, 0},
+    {"abbr", abbr, 1},
+    {"help", help, 1},
+    {"ldir", ldir, 0},
+    {"export", export, 0},
+    {"unset", unset, 0},
+    {"set", set, 1},
+    {"fanout", fanout, 0},
+    {"hstat", hstat, 1},
+    {"bench", bench, 0},
+    {"trace", trace, 1},
+    {"gogistat", gogistat, 1},
+    {"functions", functions, 1},
+    {"z", z, 0},
+    {"each", each, 0},
+    {"parallel", parallel, 0},
+    {"watch-run", watch_run, 0},
+    {"last", last, 1},
+    {"cached", cached, 0}
+};
+
+const size_t num_gogi_commands = sizeof(GoGi_commands) / sizeof(GoGi_commands[0]);
+
+struct Command *find_gogi_command(const char *name, size_t length) {
+    for (size_t i = 0; i < num_gogi_commands; i++) {
+        if (strlen(GoGi_commands[i].command) == length && strncmp(name, GoGi_commands[i].command, length) == 0) {
+            return &GoGi_commands[i];
+        }
+    }
+    // Shell functions are dispatched through the same entries
+    return find_function_command(name, length);
+}
+
+int run_builtin(char *args[]) {
+    // Returns 1 if args[0] is a custom GoGiShell command and it was executed
+    struct Command *gogi_command = find_gogi_command(args[0], strlen(args[0]));
+    if (gogi_command == NULL) {
+        return 0;
+    }
+    last_status = 0;
+    gogi_command->function(args);
+    return 1;
+}
 
-    token = strtok(input, " \n");
-    while (token != NULL && i < MAX_ARGS - 1) {
-        args[i++] = token;
-        token = strtok(NULL, " \n");
+int status_to_exit_code(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
     }
-    args[i] = NULL;
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+// Returns 1 if a script line continues into the next one without a separator, e.g. "then" or "|"
+static int continues_without_separator(const char *line, size_t length) {
+    while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\t')) {
+        length--;
+    }
+    if (length == 0) {
+        return 1;
+    }
+    if (strchr(";|&({", line[length - 1]) != NULL) {
+        return 1;
+    }
+    const char *keywords[] = {"then", "do", "else", "in"};
+    for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++) {
+        size_t keyword_length = strlen(keywords[i]);
+        if (length >= keyword_length && strncmp(line + length - keyword_length, keywords[i], keyword_length) == 0 &&
+            (length == keyword_length || line[length - keyword_length - 1] == ' ' || line[length - keyword_length - 1] == '\t')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// History keeps one line per command: here-document bodies are left out, and the lines of a script
+// are joined like bash does, so UP brings back a command that runs as a whole
+static void build_history_line(char *input, char *command_line, size_t size) {
+    size_t line_length = strcspn(input, "\n");
+    size_t length = snprintf(command_line, size, "%.*s", (int)line_length, input);
+    int here_documents = begin_here_document_input(input);
+    const char *previous = input;
+    size_t previous_length = line_length;
+
+    for (char *line = input + line_length; *line == '\n' && line[1] != '\0' && length < size - 1; line += line_length) {
+        line++;
+        line_length = strcspn(line, "\n");
+        if (here_documents > 0) {
+            here_documents = continue_here_document_input(line);
+            continue;
+        }
+        const char *separator = continues_without_separator(previous, previous_length) ? " " : "; ";
+        length += snprintf(command_line + length, size - length, "%s%.*s", separator, (int)line_length, line);
+        previous = line;
+        previous_length = line_length;
+    }
+    if (length > size - 2) {
+        length = size - 2;
+    }
+    command_line[length] = '\n';
+    command_line[length + 1] = '\0';
 }
 
 void process_input(char *input) {
+    char command_line[MAX_INPUT_LENGTH];
+    build_history_line(input, command_line, sizeof(command_line));
+    long long trace_start = trace_begin();
+    fulfil_history_file(command_line);
+    trace_end("history append", trace_start);
+
+    struct CommandStats stats;
+    begin_command_stats(&stats);
+
+    trace_start = trace_begin();
+    expand_abbreviations_in_input(input);
+    trace_end("abbreviation expansion", trace_start);
+
+    trace_start = trace_begin();
+    execute_input(input);
+    trace_end("execute", trace_start);
+
+    end_command_stats(&stats);
+    last_command_ns = stats.wall_ns;
+    invalidate_prompt_segments();
+    trace_start = trace_begin();
+    fulfil_history_stats_file(command_line, &stats);
+    trace_end("history stats append", trace_start);
+    notify_server();
+}
+
+void execute_input(char *input) {
     char *commands[MAX_ARGS];
     int pipeline_count;
 
-    fulfil_history_file(input);
-    expand_abbreviations_in_input(input);
+    // "time <command>" reports the measurements of the rest of the input
+    char *start = input + strspn(input, " \t");
+    if (strncmp(start, "time", 4) == 0 && (start[4] == ' ' || start[4] == '\t' || start[4] == '\n')) {
+        struct CommandStats stats;
+        begin_command_stats(&stats);
+        execute_input(start + 4);
+        end_command_stats(&stats);
+        print_command_stats(&stats);
+        return;
+    }
+
+    // "pipestat <pipeline>" relays between the stages itself and reports where the pipeline waits
+    if (strncmp(start, "pipestat", 8) == 0 && (start[8] == ' ' || start[8] == '\t')) {
+        pipeline_stats_requested = 1;
+        execute_input(start + 8);
+        pipeline_stats_requested = 0;
+        return;
+    }
+
+    // Control flow is interpreted by the shell itself, only the commands inside may fork
+    if (is_script(start)) {
+        run_script(start);
+        return;
+    }
+
+    if (collect_here_documents(input) == -1) {
+        last_status = 2;
+        return;
+    }
 
     // Split input into pipeline segments
     parse_pipeline(input, commands, &pipeline_count);
@@ -109,161 +280,290 @@ void process_input(char *input) {
         execute_pipeline(commands, pipeline_count);
     } else {
         // Handle single commands (no pipeline)
-        char *args[MAX_ARGS];
-        parse_input(input, args);
-
-        struct Command GoGi_commands[] = {
-            {"sethome", sethome},
-            {"history", history},
-            {"home", home},
-            {"setabbr", setabbr},
-            {"abbr", abbr},
-            {"help", help},
-            {"ldir", ldir}
-        };
+        struct Words words;
+        long long trace_start = trace_begin();
+        int parsed = parse_input(input, &words);
+        trace_end("parse", trace_start);
+        if (parsed == -1) {
+            last_status = 2;
+            return;
+        }
 
-        if (args[0] == NULL) {
+        if (words.argv[0] == NULL && words.num_redirections > 0) {
+            // Redirections alone, e.g. "> file" truncating the file
+            struct SavedFds saved;
+            last_status = apply_redirections(&words, &saved) == -1 ? 1 : 0;
+            restore_redirections(&saved);
+            free_words(&words);
+            return;
+        }
+
+        if (words.argv[0] == NULL) {
             printf("No command provided.\n");
+            free_words(&words);
             return;
         }
 
-        size_t num_gogi_commands = sizeof(GoGi_commands) / sizeof(GoGi_commands[0]);
+        // Leading NAME=value words either set shell variables or the environment of the command
+        int assignments = words.num_assignments;
+        char **args = words.argv + assignments;
 
-        // Check if the command is a custom GoGiShell command
-        for (size_t i = 0; i < num_gogi_commands; i++) {
-            if (strcmp(args[0], GoGi_commands[i].command) == 0) {
-                GoGi_commands[i].function(args);
-                return;
+        if (args[0] == NULL) {
+            apply_assignments(words.argv, assignments, 0);
+            free_words(&words);
+            return;
+        }
+
+        // Check if the command is a custom GoGiShell command, its redirections are undone afterwards
+        struct Command *gogi_command = find_gogi_command(args[0], strlen(args[0]));
+        if (gogi_command != NULL) {
+            struct SavedFds saved;
+            if (apply_redirections(&words, &saved) == 0) {
+                // A function may unset or redefine itself, so its name is copied before it runs
+                char phase[TRACE_NAME_LENGTH] = "";
+                trace_start = trace_begin();
+                if (trace_start != 0) {
+                    snprintf(phase, sizeof(phase), "%s", gogi_command->command);
+                }
+                run_builtin(args);
+                trace_end(phase, trace_start);
+            } else {
+                last_status = 1;
             }
+            restore_redirections(&saved);
+            free_words(&words);
+            return;
         }
 
         // Handle `cd` command
         if (strcmp(args[0], "cd") == 0) {
+            last_status = 0;
             if (args[1] == NULL) {
-                chdir(home_dir);
+                if (chdir(home_dir) == 0) {
+                    record_directory_visit();
+                }
                 cwd_changed = 1;
             } else {
                 print_directory_description(args[1]);
 
                 if (chdir(args[1]) == -1) {
                     perror("BASH command cd failed");
+                    last_status = 1;
                 } else {
                     cwd_changed = 1;
+                    record_directory_visit();
                 }
             }
         } else {
             // External command execution
-            pid_t pid = fork();
+            fflush(stdout);
+            int capture_fd = begin_output_capture();
+            trace_start = trace_begin();
+            pid_t pid = counted_fork();
             if (pid == 0) {
+                if (capture_fd != -1) {
+                    dup2(capture_fd, STDOUT_FILENO);
+                }
+                apply_assignments(words.argv, assignments, 1);
+                environ = get_environment();
+                pass_process_substitutions(&words);
+
                 // Handle redirection for this single command
-                handle_redirection(args);
+                handle_redirection(&words);
 
                 if (execvp(args[0], args) == -1) {
                     perror("No such internal or GoGiShell command");
-                    exit(EXIT_FAILURE);
+                    exit(127);
                 }
             } else if (pid > 0) {
+                trace_end("fork", trace_start);
+
+                // Exec and the run of the command itself, as seen from the shell
+                trace_start = trace_begin();
+                finish_output_capture();
                 int status;
-                if (waitpid(pid, &status, 0) == -1) {
+                if (wait_for_child(pid, &status) == -1) {
                     perror("Internal function waitpid failed");
+                } else {
+                    last_status = status_to_exit_code(status);
                 }
+                trace_end("exec and wait", trace_start);
             } else {
                 perror("Internal function fork failed");
                 exit(EXIT_FAILURE);
             }
         }
+        free_words(&words);
     }
 }
 
 void parse_pipeline(char *input, char *commands[], int *num_commands) {
-    char *token;
+    char *p = input;
     *num_commands = 0;
 
-    token = strtok(input, "|");
-    while (token != NULL && *num_commands < MAX_ARGS - 1) {
-        commands[(*num_commands)++] = token;
-        token = strtok(NULL, "|");
+    // Split on '|' outside of quotes and substitutions
+    commands[(*num_commands)++] = input;
+    while (*p != '\0') {
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            p = (char *)skip_quoted(p);
+        } else if ((*p == '$' || *p == '<' || *p == '>') && p[1] == '(') {
+            const char *end = skip_substitution(p);
+            p = end != NULL ? (char *)end : p + strlen(p);
+        } else if (*p == '|' && *num_commands < MAX_ARGS - 1) {
+            *p++ = '\0';
+            commands[(*num_commands)++] = p;
+        } else {
+            p++;
+        }
     }
     commands[*num_commands] = NULL;
 }
 
 void execute_pipeline(char *commands[], int num_commands) {
     int pipe_fds[2];
-    pid_t pid;
+    pid_t pids[MAX_ARGS];
+    struct Words stages[MAX_ARGS];
+    int num_stages = num_commands;
     int fd_in = 0; // Input for the first command is STDIN
+    struct PipelineEdge edges[MAX_ARGS];
+    int num_edges = 0;
+    int instrumented = pipeline_stats_requested;
 
+    // Words are expanded by the shell itself, so substitutions of every stage are its own children
+    long long trace_start = trace_begin();
     for (int i = 0; i < num_commands; i++) {
-        pipe(pipe_fds);
+        if (parse_input(commands[i], &stages[i]) == -1 || (stages[i].argv[0] == NULL && stages[i].num_redirections == 0)) {
+            if (stages[i].argv != NULL) {
+                free_words(&stages[i]);
+                fprintf(stderr, "Empty command in pipeline\n");
+            }
+            for (int j = 0; j < i; j++) {
+                free_words(&stages[j]);
+            }
+            last_status = 2;
+            return;
+        }
+    }
+
+    trace_end("parse", trace_start);
+    fflush(stdout);
 
-        pid = fork();
-        if (pid == 0) {
+    // "last | grep ..." can be run again and again, its own output doesn't replace the one it reads
+    for (int i = 0; i < num_commands; i++) {
+        if (stages[i].argv[0] != NULL && strcmp(stages[i].argv[0], "last") == 0) {
+            mark_output_replayed();
+        }
+    }
+
+    // All stages run concurrently, so a stage never blocks on a full pipe nobody reads yet.
+    // With pipestat every pipe is split in two and the shell relays between the halves.
+    int capture_fd = instrumented ? -1 : begin_output_capture();
+    struct CommandStats pipeline_stats;
+    begin_command_stats(&pipeline_stats);
+    for (int i = 0; i < num_commands; i++) {
+        if (i < num_commands - 1 && pipe(pipe_fds) == -1) {
+            perror("Internal function pipe failed");
+            if (fd_in != 0) {
+                close(fd_in);
+            }
+            num_commands = i;
+            break;
+        }
+
+        trace_start = trace_begin();
+        pids[i] = counted_fork();
+        if (pids[i] == 0) {
+            // The relayed ends of earlier pipes belong to the shell only, or no stage would see EOF
+            for (int j = 0; j < num_edges; j++) {
+                if (edges[j].in_fd != -1) {
+                    close(edges[j].in_fd);
+                    close(edges[j].out_fd);
+                }
+            }
             dup2(fd_in, STDIN_FILENO); // Set input to fd_in
+            if (fd_in != 0) {
+                close(fd_in);
+            }
             if (i < num_commands - 1) {
                 dup2(pipe_fds[1], STDOUT_FILENO); // Redirect output to the pipe
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+            } else if (capture_fd != -1) {
+                dup2(capture_fd, STDOUT_FILENO);
             }
-            close(pipe_fds[0]);
-            close(pipe_fds[1]);
 
-            // Parse and handle redirection for the current command
-            char *args[MAX_ARGS];
-            parse_input(commands[i], args);
-            handle_redirection(args);
+            // Handle assignments and redirection for the current command
+            int assignments = stages[i].num_assignments;
+            char **args = stages[i].argv + assignments;
+            apply_assignments(stages[i].argv, assignments, 1);
+            environ = get_environment();
+            pass_process_substitutions(&stages[i]);
+            handle_redirection(&stages[i]);
+
+            // GoGiShell commands can be pipeline stages as well
+            if (args[0] != NULL && run_builtin(args)) {
+                fflush(stdout);
+                exit(last_status);
+            }
+
+            if (args[0] == NULL) {
+                exit(EXIT_SUCCESS);
+            }
 
             // Execute the command
             if (execvp(args[0], args) == -1) {
                 perror("Pipeline command failed");
-                exit(EXIT_FAILURE);
+                exit(127);
             }
-        } else if (pid > 0) {
-            wait(NULL); // Wait for the child process
-            close(pipe_fds[1]);
-            fd_in = pipe_fds[0]; // Set the input for the next command
-        } else {
+        } else if (pids[i] < 0) {
             perror("Fork failed");
             exit(EXIT_FAILURE);
         }
-    }
-}
-
-void handle_redirection(char *args[]) {
-    int i = 0;
+        trace_end("fork", trace_start);
 
-    while (args[i] != NULL) {
-        if (strcmp(args[i], ">") == 0) {
-            // Output redirection
-            int fd = open(args[i + 1], O_CREAT | O_WRONLY | O_TRUNC, 0644);
-            if (fd == -1) {
-                perror("Failed to open file for output redirection");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd, STDOUT_FILENO); // Redirect stdout to the file
-            close(fd);
-            args[i] = NULL; // End the argument list before the redirection symbol
-            break;
-        } else if (strcmp(args[i], ">>") == 0) {
-            // Append output redirection
-            int fd = open(args[i + 1], O_CREAT | O_WRONLY | O_APPEND, 0644);
-            if (fd == -1) {
-                perror("Failed to open file for append output redirection");
-                exit(EXIT_FAILURE);
-            }
-            dup2(fd, STDOUT_FILENO); // Redirect stdout to the file
-            close(fd);
-            args[i] = NULL; // End the argument list before the redirection symbol
-            break;
-        } else if (strcmp(args[i], "<") == 0) {
-            // Input redirection
-            int fd = open(args[i + 1], O_RDONLY);
-            if (fd == -1) {
-                perror("Failed to open file for input redirection");
-                exit(EXIT_FAILURE);
+        if (fd_in != 0) {
+            close(fd_in);
+        }
+        if (i < num_commands - 1) {
+            close(pipe_fds[1]);
+            fd_in = pipe_fds[0]; // Set the input for the next command
+        }
+        if (i < num_commands - 1 && instrumented) {
+            // The next command reads a second pipe, filled by the shell from the first one
+            int relay_fds[2];
+            memset(&edges[num_edges], 0, sizeof(edges[num_edges]));
+            edges[num_edges].in_fd = -1;
+            if (pipe(relay_fds) == 0) {
+                edges[num_edges].in_fd = pipe_fds[0];
+                edges[num_edges].out_fd = relay_fds[1];
+                fd_in = relay_fds[0];
+            } else {
+                perror("Internal function pipe failed");
             }
-            dup2(fd, STDIN_FILENO); // Redirect stdin to the file
-            close(fd);
-            args[i] = NULL; // End the argument list before the redirection symbol
-            break;
+            num_edges++;
         }
-        i++;
+    }
+
+    trace_start = trace_begin();
+    if (instrumented) {
+        relay_pipeline(edges, num_edges);
+    }
+    finish_output_capture();
+    for (int i = 0; i < num_commands; i++) {
+        int status;
+        if (wait_for_child(pids[i], &status) != -1 && i == num_commands - 1) {
+            last_status = status_to_exit_code(status); // The last stage decides $?
+        }
+    }
+    trace_end("exec and wait", trace_start);
+    if (instrumented) {
+        end_command_stats(&pipeline_stats);
+        print_pipeline_report(stages, edges, num_commands, pipeline_stats.wall_ns);
+    }
+    for (int i = 0; i < num_stages; i++) {
+        free_words(&stages[i]);
     }
 }
 
@@ -275,6 +575,9 @@ void handle_up_arrow(char *input, int *command_index, int *i) {
         }
         (*command_index)--;
         char *command = get_command_from_history(*command_index);
+        if (command == NULL) {
+            return;
+        }
 
         strcpy(input, command);
         printf("%s", command);
@@ -292,6 +595,9 @@ void handle_down_arrow(char *input, int *command_index, int *i) {
         }
         (*command_index)++;
         char *command = get_command_from_history(*command_index);
+        if (command == NULL) {
+            return;
+        }
 
         strcpy(input, command);
         printf("%s", command);
@@ -309,7 +615,9 @@ void handle_down_arrow(char *input, int *command_index, int *i) {
 
 void handle_tab(char *input, int *i) {
     input[*i] = '\0';
+    long long start = count_completion_start();
     char *suggestion = get_most_used_command(input);
+    count_completion_end(start, suggestion != NULL);
 
     if (suggestion) {
         while (*i > 0) {
@@ -344,21 +652,97 @@ void get_prompt(char *cwd, char *home_dir, char *display_cwd) {
     }
 }
 
-int main() {
-    char input[MAX_INPUT_LENGTH];
+void read_continuation_line(char **input, size_t *capacity, int *i, int limit) {
+    int ch;
+    int line_start = *i;
+
+    while ((ch = getchar()) != '\n' && ch != EOF) {
+        if (ch == 27) { // Arrows mean nothing here, the whole sequence is dropped
+            if (getchar() == '[') {
+                getchar();
+            }
+        } else if ((ch == 8) || (ch == 127)) {
+            if (*i > line_start) {
+                printf("\b \b");
+                (*i)--;
+            }
+        } else if (*i < limit - 2) {
+            // MAX_INPUT_LENGTH stays to spare, abbreviations may lengthen the first line by as much
+            if ((size_t)*i + 2 + MAX_INPUT_LENGTH > *capacity) {
+                char *grown = realloc(*input, *capacity * 2);
+                if (grown == NULL) {
+                    perror("Failed to allocate memory");
+                    break;
+                }
+                *input = grown;
+                *capacity *= 2;
+            }
+            (*input)[(*i)++] = ch;
+            putchar(ch);
+        }
+    }
+    putchar('\n');
+    (*input)[(*i)++] = '\n';
+    (*input)[*i] = '\0';
+}
+
+int main(int argc, char *argv[]) {
+    // The first line fits into MAX_INPUT_LENGTH, here-document bodies following it grow the buffer
+    size_t input_capacity = 2 * MAX_INPUT_LENGTH;
+    char *input = malloc(input_capacity);
     char cwd[MAX_PATH_LENGTH];
     char display_cwd[MAX_PATH_LENGTH];
     struct termios original_termios;
     int i, ch, command_index = 0;
 
-    printf("Welcome to GoGiShell!\n");
-    printf("Please read the GoGiShell manual by printing 'help'\n");
-    printf("\n");
+    const char *cache_dir_override = NULL;
+    int server_requested = 0, stop_requested = 0, use_server = 1;
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--cache-dir") == 0 && arg + 1 < argc) {
+            cache_dir_override = argv[++arg];
+        } else if (strcmp(argv[arg], "--server") == 0) {
+            server_requested = 1;
+        } else if (strcmp(argv[arg], "--stop-server") == 0) {
+            stop_requested = 1;
+        } else if (strcmp(argv[arg], "--no-server") == 0) {
+            use_server = 0;
+        } else {
+            printf("Usage: GoGiShell [--cache-dir <directory>] [--server | --stop-server | --no-server]\n");
+            return 1;
+        }
+    }
+
+    if (input == NULL) {
+        perror("Failed to allocate memory");
+        return 1;
+    }
+    initialize_paths(cache_dir_override);
+
+    if (stop_requested) {
+        return stop_server();
+    }
 
-    initialize_paths();
+    // A running server forks the whole session with its state loaded, nothing below is needed then
+    if (!server_requested && use_server) {
+        int exit_code;
+        if (attach_to_server(&exit_code) == 0) {
+            return exit_code;
+        }
+    }
+
+    if (!server_requested) {
+        printf("Welcome to GoGiShell!\n");
+        printf("Please read the GoGiShell manual by printing 'help'\n");
+        printf("\n");
+    }
 
     create_cache();
 
+    // Sessions of the server take the variables of their own client
+    if (!server_requested) {
+        initialize_variables();
+    }
+
     strncpy(home_dir, getenv("HOME"), MAX_PATH_LENGTH - 1);
     home_dir[MAX_PATH_LENGTH - 1] = '\0';
     fulfil_home_path_file(home_dir);
@@ -370,36 +754,65 @@ int main() {
     fulfil_abbreviation_file(home_dir, "~");
     get_total_abbreviations();
 
+    load_functions();
+    initialize_output_capture();
+
+    if (server_requested) {
+        start_server(); // Returns in every session forked by the server, with the terminal of its client
+    }
+
     enable_noncanonical_mode(&original_termios);
 
+    // Keys are read one by one, so waiting for them can be combined with waiting for the prompt worker
+    setvbuf(stdin, NULL, _IONBF, 0);
+
     while (1) {
+        long long trace_start = trace_begin();
         if (cwd_changed) {
+            long long phase_start = trace_begin();
             get_home_dir();
+            trace_end("get_home_dir", phase_start);
             if (getcwd(cwd, sizeof(cwd)) == NULL) {
                 perror("Internal function getcwd failed");
                 continue;
             }
 
+            phase_start = trace_begin();
             get_prompt(cwd, home_dir, display_cwd);
+            trace_end("prompt coloring", phase_start);
 
             cwd_changed = 0;
         }
 
-        printf("\033[1;34mGoGiShell:\033[37m%s$ ", display_cwd);
+        render_prompt(cwd, display_cwd);
         fflush(stdout);
-
+        COUNT(prompt_renders, 1);
+        trace_end("prompt", trace_start);
+
+        if (input_capacity > 2 * MAX_INPUT_LENGTH) {
+            char *shrunk = realloc(input, 2 * MAX_INPUT_LENGTH);
+            if (shrunk != NULL) {
+                input = shrunk;
+                input_capacity = 2 * MAX_INPUT_LENGTH;
+            }
+        }
         memset(input, 0, MAX_INPUT_LENGTH);
         i = 0;
         command_index = total_commands + 1;
 
-        while ((ch = getchar()) != '\n' && ch != EOF) {
+        while ((ch = read_key(input, i)) != '\n' && ch != EOF) {
+            // Each keystroke is traced from its arrival until it is echoed
+            trace_start = trace_begin();
+            const char *phase = "keystroke";
             if (ch == 27) { // Escape character (ASCII 27)
                 if ((ch = getchar()) == '[') {
                     ch = getchar();
                     if (ch == 'A') { // UP Arrow
                         handle_up_arrow(input, &command_index, &i);
+                        phase = "history up";
                     } else if (ch == 'B') { // DOWN Arrow
                         handle_down_arrow(input, &command_index, &i);
+                        phase = "history down";
                     }
                 }
             } else if ((ch == 8) || (ch == 127)) {  // Backspace (ASCII 8 или 127)
@@ -409,10 +822,13 @@ int main() {
                 }
             } else if (ch == '\t') {  // TAB
                 handle_tab(input, &i);
+                phase = "tab completion";
             } else {
                 input[i++] = ch;
                 putchar(ch);
             }
+            fflush(stdout);
+            trace_end(phase, trace_start);
         }
 
         putchar('\n');
@@ -420,6 +836,25 @@ int main() {
         i++;
         input[i] = '\0';
 
+        // Here-document bodies are read until every delimiter is found, scripts until they are closed
+        int here_documents = begin_here_document_input(input);
+        if (here_documents == -1) {
+            last_status = 2; // Rejected before any body is read, so no body line runs as a command
+            continue;
+        }
+        while (here_documents > 0 && i < MAX_HERE_DOCUMENT_INPUT - 2) {
+            int line_start = i;
+            printf("> ");
+            fflush(stdout);
+            read_continuation_line(&input, &input_capacity, &i, MAX_HERE_DOCUMENT_INPUT);
+            here_documents = continue_here_document_input(input + line_start);
+        }
+        while (!script_complete(input) && i < MAX_INPUT_LENGTH - 2) {
+            printf("> ");
+            fflush(stdout);
+            read_continuation_line(&input, &input_capacity, &i, MAX_INPUT_LENGTH);
+        }
+
         if (strcmp(input, "\n") == 0) {
             continue;
         }
@@ -432,7 +867,9 @@ int main() {
     }
 
     disable_noncanonical_mode(&original_termios);
+    free(input);
 
     printf("Thank you for using GoGiShell!\n");
+    finish_session(0);
     return 0;
 }
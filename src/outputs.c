@@ -0,0 +1,299 @@
+#define _GNU_SOURCE // For memfd_create() and posix_openpt()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+
+#include "headers.h"
+
+// Output of one command kept for last and $LAST_OUT, in memory or spilled into a temporary file
+struct CapturedOutput {
+    int number;    // History number of the command line
+    int fd;        // -1 if the slot is free
+    off_t size;
+    int in_memory; // fd is a memfd, otherwise an unlinked file under /tmp
+};
+
+// Ring of the last outputs, newest_output is the index of the most recent one
+static struct CapturedOutput captured_outputs[MAX_CAPTURED_OUTPUTS];
+static int newest_output = -1;
+static int capture_read_fd = -1;  // Master side of the pseudo-terminal the command writes to
+static int capture_write_fd = -1; // Its terminal side, the stdout of the command
+static int replayed_by = 0; // History number of the command line reading the last output, it isn't replaced then
+
+
+// Number of outputs kept as set by GOGI_CAPTURE, 0 if capturing is off
+static int captured_outputs_limit() {
+    const char *value = get_variable(CAPTURE_VARIABLE);
+    if (value == NULL) {
+        return 0;
+    }
+    int limit = atoi(value);
+    return limit < 0 ? 0 : limit > MAX_CAPTURED_OUTPUTS ? MAX_CAPTURED_OUTPUTS : limit;
+}
+
+int begin_output_capture() {
+    // Only output shown on the terminal is kept, redirected and substituted output never is
+    if (captured_outputs_limit() == 0 || !isatty(STDOUT_FILENO) || capture_write_fd != -1 || replayed_by == total_commands) {
+        return -1;
+    }
+
+    // The command writes to a terminal of its own rather than to a pipe, so isatty(), colours, columns
+    // and full-screen programs work as without capturing
+    int master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master_fd == -1 || grantpt(master_fd) == -1 || unlockpt(master_fd) == -1) {
+        perror("Internal function posix_openpt failed");
+        if (master_fd != -1) {
+            close(master_fd);
+        }
+        return -1;
+    }
+    int terminal_fd = open(ptsname(master_fd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (terminal_fd == -1) {
+        perror("Failed to open pseudo-terminal");
+        close(master_fd);
+        return -1;
+    }
+
+    // It has the size of the real terminal, and passes output on unprocessed, the real terminal processes it
+    struct termios settings;
+    struct winsize size;
+    if (tcgetattr(STDOUT_FILENO, &settings) == 0) {
+        settings.c_oflag &= ~OPOST;
+        tcsetattr(terminal_fd, TCSANOW, &settings);
+    }
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0) {
+        ioctl(terminal_fd, TIOCSWINSZ, &size);
+    }
+
+    capture_read_fd = master_fd;
+    capture_write_fd = terminal_fd;
+    return capture_write_fd;
+}
+
+static void free_captured_output(struct CapturedOutput *output) {
+    if (output->fd != -1) {
+        close(output->fd);
+    }
+    output->fd = -1;
+    output->size = 0;
+}
+
+// Moves the output out of memory into an unlinked temporary file
+static void spill_captured_output(struct CapturedOutput *output) {
+    char path[] = "/tmp/gogishell-output-XXXXXX";
+    int fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1) {
+        perror("Failed to create a file for captured output");
+        free_captured_output(output);
+        return;
+    }
+    unlink(path);
+
+    off_t offset = 0;
+    while (offset < output->size) {
+        if (sendfile(fd, output->fd, &offset, output->size - offset) <= 0) {
+            perror("Failed to spill captured output");
+            close(fd);
+            free_captured_output(output);
+            return;
+        }
+    }
+    close(output->fd);
+    output->fd = fd;
+    output->in_memory = 0;
+}
+
+static void store_captured_output(int fd, off_t size) {
+    int limit = captured_outputs_limit();
+    if (limit == 0) {
+        close(fd);
+        return;
+    }
+
+    // A command line running several commands keeps the output of the last one
+    if (newest_output == -1 || captured_outputs[newest_output].fd == -1 || captured_outputs[newest_output].number != total_commands) {
+        newest_output = (newest_output + 1) % MAX_CAPTURED_OUTPUTS;
+    }
+    struct CapturedOutput *output = &captured_outputs[newest_output];
+    free_captured_output(output);
+    output->number = total_commands;
+    output->fd = fd;
+    output->size = size;
+    output->in_memory = 1;
+
+    // Outputs beyond GOGI_CAPTURE are dropped, older ones leave memory first once all are over the budget
+    off_t in_memory = 0;
+    for (int age = MAX_CAPTURED_OUTPUTS - 1; age >= 0; age--) {
+        struct CapturedOutput *old = &captured_outputs[(newest_output - age + MAX_CAPTURED_OUTPUTS) % MAX_CAPTURED_OUTPUTS];
+        if (age >= limit) {
+            free_captured_output(old);
+        } else if (old->fd != -1 && old->in_memory) {
+            in_memory += old->size;
+        }
+    }
+    for (int age = limit - 1; age >= 0 && in_memory > CAPTURE_MEMORY_LIMIT; age--) {
+        struct CapturedOutput *old = &captured_outputs[(newest_output - age + MAX_CAPTURED_OUTPUTS) % MAX_CAPTURED_OUTPUTS];
+        if (old->fd != -1 && old->in_memory) {
+            in_memory -= old->size;
+            spill_captured_output(old);
+        }
+    }
+}
+
+void finish_output_capture() {
+    if (capture_write_fd == -1) {
+        return;
+    }
+    close(capture_write_fd);
+    capture_write_fd = -1;
+
+    // The output streams to the terminal while a copy goes to the memfd, until the command and
+    // everything it started closed the pseudo-terminal
+    int memory_fd = memfd_create("gogishell-output", MFD_CLOEXEC);
+    if (memory_fd == -1) {
+        int out_fds[1] = {STDOUT_FILENO};
+        fan_out(capture_read_fd, out_fds, 1);
+    } else {
+        int out_fds[2] = {memory_fd, STDOUT_FILENO};
+        fan_out(capture_read_fd, out_fds, 2);
+    }
+    close(capture_read_fd);
+    capture_read_fd = -1;
+
+    off_t size = memory_fd == -1 ? 0 : lseek(memory_fd, 0, SEEK_CUR);
+    if (size <= 0) {
+        if (memory_fd != -1) {
+            close(memory_fd);
+        }
+        return;
+    }
+    store_captured_output(memory_fd, size);
+}
+
+// Returns the output of history entry number, the most recent one if number is 0
+static struct CapturedOutput *find_captured_output(int number) {
+    if (newest_output == -1) {
+        return NULL;
+    }
+    if (number == 0) {
+        return captured_outputs[newest_output].fd != -1 ? &captured_outputs[newest_output] : NULL;
+    }
+    for (int i = 0; i < MAX_CAPTURED_OUTPUTS; i++) {
+        if (captured_outputs[i].fd != -1 && captured_outputs[i].number == number) {
+            return &captured_outputs[i];
+        }
+    }
+    return NULL;
+}
+
+void mark_output_replayed() {
+    replayed_by = total_commands;
+}
+
+int read_last_output(struct Capture *capture) {
+    mark_output_replayed();
+    capture->data = NULL;
+    capture->length = 0;
+    capture->mapped_length = 0;
+
+    struct CapturedOutput *output = find_captured_output(0);
+    if (output == NULL) {
+        return -1;
+    }
+    char *data = malloc(output->size + 1);
+    if (data == NULL) {
+        perror("Failed to allocate memory");
+        return -1;
+    }
+    ssize_t length = pread(output->fd, data, output->size, 0);
+    if (length < 0) {
+        free(data);
+        return -1;
+    }
+    data[length] = '\0';
+    capture->data = data;
+    capture->length = length;
+    return 0;
+}
+
+int send_file_range(int out_fd, int fd, off_t offset, off_t length) {
+    // The bytes are copied to the output inside the kernel
+    fflush(out_fd == STDERR_FILENO ? stderr : stdout);
+    off_t end = offset + length;
+    while (offset < end) {
+        ssize_t sent = sendfile(out_fd, fd, &offset, end - offset);
+        if (sent > 0) {
+            continue;
+        }
+        if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            // Some outputs refuse sendfile(), they get a plain copy
+            char chunk[FAN_OUT_CHUNK];
+            ssize_t bytes_read;
+            while (offset < end && (bytes_read = pread(fd, chunk, end - offset < FAN_OUT_CHUNK ? end - offset : FAN_OUT_CHUNK, offset)) > 0) {
+                if (write(out_fd, chunk, bytes_read) != bytes_read) {
+                    return -1;
+                }
+                offset += bytes_read;
+            }
+        }
+        break;
+    }
+    return offset == end ? 0 : -1;
+}
+
+static void list_captured_outputs() {
+    for (int age = MAX_CAPTURED_OUTPUTS - 1; age >= 0 && newest_output != -1; age--) {
+        const struct CapturedOutput *output = &captured_outputs[(newest_output - age + MAX_CAPTURED_OUTPUTS) % MAX_CAPTURED_OUTPUTS];
+        if (output->fd == -1) {
+            continue;
+        }
+        char *command = get_command_from_history(output->number);
+        printf("%5d %10lld bytes %-6s %s\n", output->number, (long long)output->size, output->in_memory ? "memory" : "file",
+               command != NULL ? command : "");
+        free(command);
+    }
+}
+
+void last(char *args[]) {
+    int number = 0;
+    if (args[1] != NULL && strcmp(args[1], "-l") == 0 && args[2] == NULL) {
+        list_captured_outputs();
+        return;
+    }
+    if (args[1] != NULL) {
+        char *end;
+        number = (int)strtol(args[1], &end, 10);
+        if (*end != '\0' || number <= 0 || args[2] != NULL) {
+            printf("Usage: last [<history number>]\n\tlast -l\n");
+            last_status = 1;
+            return;
+        }
+    }
+
+    struct CapturedOutput *output = find_captured_output(number);
+    if (output == NULL) {
+        if (captured_outputs_limit() == 0) {
+            fprintf(stderr, "last: capturing is off, set " CAPTURE_VARIABLE "=<count> to keep outputs\n");
+        } else {
+            fprintf(stderr, "last: no output captured\n");
+        }
+        last_status = 1;
+        return;
+    }
+
+    send_file_range(STDOUT_FILENO, output->fd, 0, output->size);
+}
+
+void initialize_output_capture() {
+    for (int i = 0; i < MAX_CAPTURED_OUTPUTS; i++) {
+        captured_outputs[i].fd = -1;
+    }
+}
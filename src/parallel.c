@@ -0,0 +1,267 @@
+#define _GNU_SOURCE // For getline()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+
+#include "headers.h"
+
+// Options of one parallel run
+struct ParallelOptions {
+    long slots;
+    int keep_order;   // -k: outputs in the order of the items
+    int ungrouped;    // -u: jobs write to the terminal directly, lines of several jobs may mix
+    int halt;         // --halt: no new jobs after the first failure, running ones are terminated
+    int show_stats;
+    char **command;   // Words before ":::", {} is replaced with the item
+    int command_length;
+    char **items;     // Words after ":::", NULL if the items are read from the input
+};
+
+// Items in the order they were read, finished outputs wait here until their turn with -k
+struct ParallelItem {
+    char *item;
+    struct Buffer output;
+    int finished;
+    int exit_code;
+};
+
+
+static void print_parallel_usage() {
+    printf("Usage: parallel [-j <jobs>] [-k | -u] [--halt] [--stats] <command> [<argument> ...] [::: <item> ...]\n");
+}
+
+static int parse_parallel_options(char *args[], struct ParallelOptions *options) {
+    char *end;
+    memset(options, 0, sizeof(*options));
+    options->slots = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int i = 1;
+    for (; args[i] != NULL && args[i][0] == '-'; i++) {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL) {
+            options->slots = strtol(args[++i], &end, 10);
+            if (*end != '\0' || options->slots <= 0) {
+                return -1;
+            }
+        } else if (strcmp(args[i], "-k") == 0) {
+            options->keep_order = 1;
+        } else if (strcmp(args[i], "-u") == 0) {
+            options->ungrouped = 1;
+        } else if (strcmp(args[i], "--halt") == 0) {
+            options->halt = 1;
+        } else if (strcmp(args[i], "--stats") == 0) {
+            options->show_stats = 1;
+        } else if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            return -1;
+        }
+    }
+    if (args[i] == NULL || strcmp(args[i], ":::") == 0 || (options->keep_order && options->ungrouped)) {
+        return -1;
+    }
+    if (options->slots < 1) {
+        options->slots = 1;
+    }
+
+    // The arguments stay as they are, free_words() frees them all
+    options->command = &args[i];
+    for (; args[i] != NULL; i++) {
+        if (strcmp(args[i], ":::") == 0) {
+            options->items = &args[i + 1];
+            break;
+        }
+    }
+    options->command_length = &args[i] - options->command;
+    return 0;
+}
+
+// Returns the next item, from the arguments or a line of the input, NULL once there are no more
+static char *next_item(const struct ParallelOptions *options, int index) {
+    if (options->items != NULL) {
+        return options->items[index] != NULL ? strdup(options->items[index]) : NULL;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length = getline(&line, &capacity, stdin);
+    if (length == -1) {
+        free(line);
+        return NULL;
+    }
+    if (length > 0 && line[length - 1] == '\n') {
+        line[length - 1] = '\0';
+    }
+    return line;
+}
+
+// Builds the words of one job: every {} is replaced with item, or item is appended if there is none
+static char **fill_placeholders(char **command, int count, const char *item) {
+    int replaced = 0;
+    char **argv = malloc((count + 2) * sizeof(char *));
+    if (argv == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t item_length = strlen(item);
+    for (int i = 0; i < count; i++) {
+        struct Buffer word = {0};
+        const char *p = command[i];
+        const char *placeholder;
+        while ((placeholder = strstr(p, "{}")) != NULL) {
+            buffer_append(&word, p, placeholder - p);
+            buffer_append(&word, item, item_length);
+            p = placeholder + 2;
+            replaced = 1;
+        }
+        buffer_append(&word, p, strlen(p));
+        argv[i] = word.data;
+    }
+    argv[count] = replaced ? NULL : strdup(item);
+    argv[count + 1] = NULL;
+    return argv;
+}
+
+static void free_argv(char **argv) {
+    for (int i = 0; argv[i] != NULL; i++) {
+        free(argv[i]);
+    }
+    free(argv);
+}
+
+// A job that printed nothing has no output buffer at all
+static void print_item_output(struct ParallelItem *item) {
+    if (item->output.length > 0) {
+        fwrite(item->output.data, 1, item->output.length, stdout);
+    }
+    buffer_free(&item->output);
+}
+
+void parallel(char *args[]) {
+    struct ParallelOptions options;
+    if (parse_parallel_options(args, &options) == -1) {
+        print_parallel_usage();
+        last_status = 1;
+        return;
+    }
+    if (options.items == NULL && isatty(STDIN_FILENO)) {
+        printf("parallel: items are read from the input, pipe them in or pass them after :::\n");
+        last_status = 1;
+        return;
+    }
+
+    // Slots are refilled the moment their job exits, jobs[s] runs items[slot_items[s]]
+    struct Job *jobs = calloc(options.slots, sizeof(struct Job));
+    int *slot_items = malloc(options.slots * sizeof(int));
+    struct ParallelItem *items = NULL;
+    int total_items = 0, items_capacity = 0;
+    if (jobs == NULL || slot_items == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+
+    long long start_ns = monotonic_ns();
+    long long busy_ns = 0;
+    int running = 0, printed = 0, failures = 0, halted = 0, input_done = 0;
+    while (!input_done || running > 0) {
+        // Every free slot gets the next item
+        for (int s = 0; s < options.slots && !input_done && !halted; s++) {
+            if (jobs[s].running) {
+                continue;
+            }
+            char *item = next_item(&options, total_items);
+            if (item == NULL) {
+                input_done = 1;
+                break;
+            }
+            if (total_items == items_capacity) {
+                items_capacity = items_capacity == 0 ? 256 : items_capacity * 2;
+                items = realloc(items, items_capacity * sizeof(struct ParallelItem));
+                if (items == NULL) {
+                    perror("Failed to allocate memory");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memset(&items[total_items], 0, sizeof(struct ParallelItem));
+            items[total_items].item = item;
+
+            char **argv = fill_placeholders(options.command, options.command_length, item);
+            if (start_job(&jobs[s], NULL, argv, options.ungrouped ? 0 : JOB_CAPTURE) == -1) {
+                items[total_items].finished = 1;
+                items[total_items].exit_code = 126;
+                failures++;
+            } else {
+                slot_items[s] = total_items;
+                running++;
+            }
+            free_argv(argv);
+            total_items++;
+        }
+        if (halted) {
+            input_done = 1;
+        }
+        if (running == 0) {
+            continue;
+        }
+
+        int s = wait_for_jobs(jobs, options.slots);
+        if (s == -1) {
+            break;
+        }
+        running--;
+        busy_ns += jobs[s].wall_ns;
+        struct ParallelItem *item = &items[slot_items[s]];
+        item->finished = 1;
+        item->exit_code = jobs[s].exit_code;
+        item->output = jobs[s].output;
+        memset(&jobs[s].output, 0, sizeof(jobs[s].output));
+
+        if (item->exit_code != 0) {
+            failures++;
+            if (options.halt && !halted) {
+                halted = 1;
+                for (int other = 0; other < options.slots; other++) {
+                    if (jobs[other].running) {
+                        kill(jobs[other].pid, SIGTERM);
+                    }
+                }
+            }
+        }
+
+        // Whole outputs as the jobs finish, or with -k as soon as every earlier item has finished
+        if (!options.keep_order) {
+            print_item_output(item);
+        }
+        while (options.keep_order && printed < total_items && items[printed].finished) {
+            print_item_output(&items[printed]);
+            printed++;
+        }
+        fflush(stdout);
+    }
+    for (; options.keep_order && printed < total_items; printed++) {
+        print_item_output(&items[printed]);
+    }
+    fflush(stdout);
+    long long wall_ns = monotonic_ns() - start_ns;
+
+    if (options.show_stats && total_items > 0) {
+        fprintf(stderr, "parallel: %d jobs in %.3fs on %ld slots, %.1f jobs/s, %.2fms per job, %.0f%% slot utilization, %d failed\n",
+                total_items, wall_ns / 1e9, options.slots, total_items / (wall_ns / 1e9), busy_ns / 1e6 / total_items,
+                100.0 * busy_ns / ((double)wall_ns * options.slots), failures);
+    }
+    if (halted) {
+        fprintf(stderr, "parallel: stopped after the first failure\n");
+    }
+    last_status = failures == 0 ? 0 : 1;
+
+    for (int i = 0; i < total_items; i++) {
+        free(items[i].item);
+    }
+    free(items);
+    free(jobs);
+    free(slot_items);
+}
@@ -0,0 +1,165 @@
+#define _GNU_SOURCE // For splice() and F_GETPIPE_SZ
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "headers.h"
+
+int pipeline_stats_requested = 0;
+
+
+// Bytes waiting in a pipe, either end may be asked
+static int pipe_bytes(int fd) {
+    int bytes = 0;
+    if (ioctl(fd, FIONREAD, &bytes) == -1) {
+        return 0;
+    }
+    return bytes;
+}
+
+static void close_edge(struct PipelineEdge *edge) {
+    close(edge->in_fd);
+    close(edge->out_fd);
+    edge->in_fd = -1;
+    edge->out_fd = -1;
+}
+
+// Moves whatever the upstream pipe holds into the downstream pipe, without blocking on either
+static void move_edge(struct PipelineEdge *edge) {
+    while (edge->in_fd != -1) {
+        ssize_t moved = splice(edge->in_fd, NULL, edge->out_fd, NULL, FAN_OUT_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            edge->bytes += moved;
+        } else if (moved == -1 && errno == EINTR) {
+            continue;
+        } else {
+            // The upstream stage closed its output, or the downstream one exited (EPIPE)
+            if (moved == 0 || errno != EAGAIN) {
+                close_edge(edge);
+            }
+            break;
+        }
+    }
+}
+
+void relay_pipeline(struct PipelineEdge edges[], int count) {
+    // A stage leaving early, e.g. head, must not kill the shell writing its input
+    struct sigaction ignore, previous_action;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, &previous_action);
+
+    struct pollfd pollfds[MAX_ARGS];
+    int open_edges = 0;
+    for (int i = 0; i < count; i++) {
+        if (edges[i].in_fd != -1) {
+            fcntl(edges[i].in_fd, F_SETFL, O_NONBLOCK);
+            fcntl(edges[i].out_fd, F_SETFL, O_NONBLOCK);
+            edges[i].capacity = fcntl(edges[i].in_fd, F_GETPIPE_SZ);
+            open_edges++;
+        }
+    }
+
+    long long sampled_ns = monotonic_ns();
+    while (open_edges > 0) {
+        // The state of both pipes is sampled after every move and holds until the next wakeup,
+        // which comes at the latest after PIPESTAT_SAMPLE_MS
+        int starved[MAX_ARGS], backpressured[MAX_ARGS];
+        open_edges = 0;
+        for (int i = 0; i < count; i++) {
+            move_edge(&edges[i]);
+            pollfds[i].fd = -1;
+            pollfds[i].events = 0;
+            if (edges[i].in_fd == -1) {
+                continue;
+            }
+            open_edges++;
+            int waiting = pipe_bytes(edges[i].in_fd);
+            starved[i] = pipe_bytes(edges[i].out_fd) == 0;
+            backpressured[i] = edges[i].capacity > 0 && waiting >= edges[i].capacity;
+
+            // Data left upstream means the downstream pipe is full, so wait until it has room
+            pollfds[i].fd = waiting > 0 ? edges[i].out_fd : edges[i].in_fd;
+            pollfds[i].events = waiting > 0 ? POLLOUT : POLLIN;
+        }
+        if (open_edges == 0) {
+            break;
+        }
+
+        if (poll(pollfds, count, PIPESTAT_SAMPLE_MS) == -1 && errno != EINTR) {
+            perror("Internal function poll failed");
+            break;
+        }
+        long long now = monotonic_ns();
+        for (int i = 0; i < count; i++) {
+            if (edges[i].in_fd != -1) {
+                edges[i].open_ns += now - sampled_ns;
+                edges[i].starved_ns += starved[i] ? now - sampled_ns : 0;
+                edges[i].backpressured_ns += backpressured[i] ? now - sampled_ns : 0;
+            }
+        }
+        sampled_ns = now;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (edges[i].in_fd != -1) {
+            close_edge(&edges[i]);
+        }
+    }
+    sigaction(SIGPIPE, &previous_action, NULL);
+}
+
+static void print_percent(long long part_ns, long long whole_ns) {
+    if (whole_ns > 0) {
+        fprintf(stderr, " %13.1f%%", 100.0 * part_ns / whole_ns);
+    } else {
+        fprintf(stderr, " %14s", "-");
+    }
+}
+
+void print_pipeline_report(struct Words stages[], struct PipelineEdge edges[], int num_stages, long long wall_ns) {
+    fprintf(stderr, "pipestat: %d stages in %.3fs\n", num_stages, wall_ns / 1e9);
+    fprintf(stderr, "  %-32s %12s %12s %10s %14s %14s\n", "stage", "bytes in", "bytes out", "MB/s", "starved", "backpressured");
+    for (int i = 0; i < num_stages; i++) {
+        char label[33];
+        size_t length = 0;
+        label[0] = '\0';
+        for (int j = 0; stages[i].argv[j] != NULL && length < sizeof(label) - 1; j++) {
+            length += snprintf(label + length, sizeof(label) - length, "%s%s", j > 0 ? " " : "", stages[i].argv[j]);
+        }
+
+        // A stage is measured on its edges: it is starved while its input pipe is empty and
+        // backpressured while its output pipe is full; the first and the last stage have only one edge
+        const struct PipelineEdge *input = i > 0 ? &edges[i - 1] : NULL;
+        const struct PipelineEdge *output = i < num_stages - 1 ? &edges[i] : NULL;
+        const struct PipelineEdge *rate = output != NULL ? output : input;
+        fprintf(stderr, "  %d %-30.30s", i + 1, label);
+        if (input != NULL) {
+            fprintf(stderr, " %12lld", input->bytes);
+        } else {
+            fprintf(stderr, " %12s", "-");
+        }
+        if (output != NULL) {
+            fprintf(stderr, " %12lld", output->bytes);
+        } else {
+            fprintf(stderr, " %12s", "-");
+        }
+        if (rate != NULL && rate->open_ns > 0) {
+            fprintf(stderr, " %10.1f", rate->bytes / 1e6 / (rate->open_ns / 1e9));
+        } else {
+            fprintf(stderr, " %10s", "-");
+        }
+        print_percent(input != NULL ? input->starved_ns : 0, input != NULL ? input->open_ns : 0);
+        print_percent(output != NULL ? output->backpressured_ns : 0, output != NULL ? output->open_ns : 0);
+        fprintf(stderr, "\n");
+    }
+}
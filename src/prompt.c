@@ -0,0 +1,442 @@
+#define _GNU_SOURCE // For pipe2()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/inotify.h>
+
+#include "headers.h"
+
+extern char **environ;
+
+// Git state of one directory, filled in by the worker thread
+struct PromptCacheEntry {
+    char directory[MAX_PATH_LENGTH];
+    char git_dir[MAX_PATH_LENGTH];       // Empty if the directory isn't inside a repository
+    char branch[MAX_BRANCH_LENGTH];
+    int dirty;
+    int fresh;                           // Computed and not invalidated since
+    int watch;                           // inotify watch of git_dir, -1 if there is none yet
+    unsigned long used;                  // Render counter of the last use, the oldest entry is replaced
+};
+
+long long last_command_ns = 0;
+
+static struct PromptCacheEntry prompt_cache[PROMPT_CACHE_SIZE];
+static unsigned long render_count = 0;
+
+// The worker takes one directory at a time, a newer request replaces a pending one
+static pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prompt_job_ready = PTHREAD_COND_INITIALIZER;
+static char job_directory[MAX_PATH_LENGTH];
+static int job_pending = 0;
+static int worker_started = 0;
+
+static int result_pipe[2] = {-1, -1}; // The worker writes a byte here after every result
+static int inotify_fd = -1;
+
+// What the current prompt was rendered from, so it can be repainted in place
+static char prompt_cwd[MAX_PATH_LENGTH];
+static char prompt_display_cwd[MAX_PATH_LENGTH];
+static char shown_git_segment[MAX_BRANCH_LENGTH + 8];
+
+
+static void copy_path(char *destination, const char *source) {
+    snprintf(destination, MAX_PATH_LENGTH, "%s", source);
+}
+
+// Finds the git directory of the repository containing directory, returns -1 outside of repositories
+static int find_git_dir(const char *directory, char *git_dir) {
+    char path[MAX_PATH_LENGTH];
+    copy_path(path, directory);
+
+    while (1) {
+        char candidate[MAX_PATH_LENGTH + 8];
+        snprintf(candidate, sizeof(candidate), "%s/.git", strcmp(path, "/") == 0 ? "" : path);
+
+        struct stat st;
+        if (stat(candidate, &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                copy_path(git_dir, candidate);
+                return 0;
+            }
+
+            // Worktrees and submodules have a file pointing to the real git directory
+            FILE *file = fopen(candidate, "r");
+            char line[MAX_PATH_LENGTH];
+            if (file != NULL && fgets(line, sizeof(line), file) != NULL && strncmp(line, "gitdir: ", 8) == 0) {
+                line[strcspn(line, "\n")] = '\0';
+                if (line[8] == '/') {
+                    copy_path(git_dir, line + 8);
+                } else {
+                    snprintf(git_dir, MAX_PATH_LENGTH, "%.*s/%s", MAX_PATH_LENGTH / 2, path, line + 8);
+                }
+                fclose(file);
+                return 0;
+            }
+            if (file != NULL) {
+                fclose(file);
+            }
+        }
+
+        char *slash = strrchr(path, '/');
+        if (slash == NULL || strcmp(path, "/") == 0) {
+            return -1;
+        }
+        if (slash == path) {
+            slash[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+}
+
+static void read_branch(const char *git_dir, char *branch) {
+    char path[MAX_PATH_LENGTH + 8];
+    snprintf(path, sizeof(path), "%s/HEAD", git_dir);
+    strcpy(branch, "?");
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return;
+    }
+    char line[MAX_PATH_LENGTH];
+    if (fgets(line, sizeof(line), file) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strncmp(line, "ref: refs/heads/", 16) == 0) {
+            snprintf(branch, MAX_BRANCH_LENGTH, "%s", line + 16);
+        } else {
+            // Detached HEAD, shown as a short commit hash
+            snprintf(branch, MAX_BRANCH_LENGTH, "%.7s", line);
+        }
+    }
+    fclose(file);
+}
+
+// Runs "git status" on tracked files; any output means uncommitted changes
+static int read_dirty(const char *directory) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        return 0;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    // Optional locks are skipped, so the prompt never fights with a git command the user runs
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+    char **environment = malloc((count + 2) * sizeof(char *));
+    if (environment == NULL) {
+        posix_spawn_file_actions_destroy(&actions);
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return 0;
+    }
+    memcpy(environment, environ, count * sizeof(char *));
+    environment[count] = "GIT_OPTIONAL_LOCKS=0";
+    environment[count + 1] = NULL;
+
+    char *argv[] = {"git", "-C", (char *)directory, "status", "--porcelain", "--untracked-files=no",
+                    "--ignore-submodules", NULL};
+    pid_t pid;
+    int spawned = posix_spawnp(&pid, "git", &actions, NULL, argv, environment) == 0;
+    posix_spawn_file_actions_destroy(&actions);
+    free(environment);
+    close(pipe_fds[1]);
+
+    int dirty = 0;
+    if (spawned) {
+        char buffer[4096];
+        ssize_t bytes_read;
+        while ((bytes_read = read(pipe_fds[0], buffer, sizeof(buffer))) > 0) {
+            dirty = 1;
+        }
+        waitpid(pid, NULL, 0);
+    }
+    close(pipe_fds[0]);
+    return dirty;
+}
+
+// Drops the inotify watch of an entry; called with prompt_lock held
+static void release_watch(struct PromptCacheEntry *entry) {
+    if (entry->watch != -1 && inotify_fd != -1) {
+        // Watches of one git directory are shared, inotify_add_watch() returns the same descriptor
+        int shared = 0;
+        for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+            shared |= &prompt_cache[i] != entry && prompt_cache[i].watch == entry->watch;
+        }
+        if (!shared) {
+            inotify_rm_watch(inotify_fd, entry->watch);
+        }
+    }
+    entry->watch = -1;
+}
+
+// Returns the entry of directory, or the least recently used one reset for it; called with prompt_lock held
+static struct PromptCacheEntry *cache_entry(const char *directory) {
+    struct PromptCacheEntry *oldest = &prompt_cache[0];
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        if (strcmp(prompt_cache[i].directory, directory) == 0) {
+            return &prompt_cache[i];
+        }
+        if (prompt_cache[i].used < oldest->used) {
+            oldest = &prompt_cache[i];
+        }
+    }
+    release_watch(oldest);
+    memset(oldest, 0, sizeof(*oldest));
+    copy_path(oldest->directory, directory);
+    oldest->watch = -1;
+    return oldest;
+}
+
+static void *prompt_worker(void *arg) {
+    (void)arg;
+    char directory[MAX_PATH_LENGTH];
+
+    pthread_mutex_lock(&prompt_lock);
+    while (1) {
+        while (!job_pending) {
+            pthread_cond_wait(&prompt_job_ready, &prompt_lock);
+        }
+        copy_path(directory, job_directory);
+        job_pending = 0;
+        pthread_mutex_unlock(&prompt_lock);
+
+        // The slow part runs unlocked, the prompt keeps rendering from the cache meanwhile
+        char git_dir[MAX_PATH_LENGTH] = "";
+        char branch[MAX_BRANCH_LENGTH] = "";
+        int dirty = 0;
+        if (find_git_dir(directory, git_dir) == 0) {
+            read_branch(git_dir, branch);
+            dirty = read_dirty(directory);
+        } else {
+            git_dir[0] = '\0';
+        }
+
+        pthread_mutex_lock(&prompt_lock);
+        struct PromptCacheEntry *entry = cache_entry(directory);
+        if (strcmp(entry->git_dir, git_dir) != 0) {
+            copy_path(entry->git_dir, git_dir);
+            release_watch(entry); // The main thread adds the watch of the new git directory
+        }
+        snprintf(entry->branch, sizeof(entry->branch), "%s", branch);
+        entry->dirty = dirty;
+        entry->fresh = 1;
+        entry->used = render_count;
+
+        if (write(result_pipe[1], "", 1) == -1) {
+            // The pipe is full, so the main thread has a wakeup pending already
+        }
+    }
+    return NULL;
+}
+
+static int start_prompt_worker() {
+    if (worker_started) {
+        return 0;
+    }
+    if (pipe2(result_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("Internal function pipe failed");
+        return -1;
+    }
+    // Without inotify the entries are still refreshed after every command
+    inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        prompt_cache[i].watch = -1;
+    }
+
+    // The worker never needs to handle signals, they all go to the main thread
+    sigset_t all_signals, previous;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_SETMASK, &all_signals, &previous);
+    pthread_t thread;
+    int result = pthread_create(&thread, NULL, prompt_worker, NULL);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0) {
+        fprintf(stderr, "Failed to start the prompt worker\n");
+        return -1;
+    }
+    pthread_detach(thread);
+    worker_started = 1;
+    return 0;
+}
+
+static void request_git_state(const char *directory) {
+    pthread_mutex_lock(&prompt_lock);
+    copy_path(job_directory, directory);
+    job_pending = 1;
+    pthread_cond_signal(&prompt_job_ready);
+    pthread_mutex_unlock(&prompt_lock);
+}
+
+// Marks every entry of a git directory whose HEAD or index changed as outdated
+static void read_inotify_events() {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    while (inotify_fd != -1 && (length = read(inotify_fd, buffer, sizeof(buffer))) > 0) {
+        for (char *p = buffer; p < buffer + length;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len > 0 && (strcmp(event->name, "HEAD") == 0 || strcmp(event->name, "index") == 0)) {
+                pthread_mutex_lock(&prompt_lock);
+                for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+                    if (prompt_cache[i].watch == event->wd) {
+                        prompt_cache[i].fresh = 0;
+                    }
+                }
+                pthread_mutex_unlock(&prompt_lock);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static int segment_enabled(const char *segments, const char *name) {
+    size_t length = strlen(name);
+    for (const char *p = segments; (p = strstr(p, name)) != NULL; p += length) {
+        if ((p == segments || p[-1] == ' ' || p[-1] == ',') && (p[length] == '\0' || p[length] == ' ' || p[length] == ',')) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static const char *prompt_segments() {
+    const char *segments = get_variable(PROMPT_SEGMENTS_VARIABLE);
+    return segments != NULL ? segments : DEFAULT_PROMPT_SEGMENTS;
+}
+
+// Builds the git segment from the cache, asking the worker for a new value if the cached one is outdated
+static void git_segment(const char *cwd, char *segment, size_t size) {
+    segment[0] = '\0';
+    if (start_prompt_worker() == -1) {
+        return;
+    }
+    read_inotify_events();
+
+    int outdated = 1;
+    pthread_mutex_lock(&prompt_lock);
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        struct PromptCacheEntry *entry = &prompt_cache[i];
+        if (strcmp(entry->directory, cwd) != 0) {
+            continue;
+        }
+        entry->used = render_count;
+        outdated = !entry->fresh;
+        if (entry->git_dir[0] != '\0') {
+            snprintf(segment, size, "(%s%s)", entry->branch, entry->dirty ? "*" : "");
+            if (entry->watch == -1 && inotify_fd != -1) {
+                entry->watch = inotify_add_watch(inotify_fd, entry->git_dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE);
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&prompt_lock);
+
+    // Until the worker answers, the prompt shows the last known value, or nothing for a new directory
+    if (outdated) {
+        request_git_state(cwd);
+    }
+}
+
+static void print_prompt(const char *git) {
+    const char *segments = prompt_segments();
+
+    printf("\033[1;34mGoGiShell:\033[37m%s", prompt_display_cwd);
+    if (git[0] != '\0') {
+        printf(" \033[35m%s\033[37m", git);
+    }
+    if (segment_enabled(segments, "duration") && last_command_ns >= PROMPT_DURATION_MIN_NS) {
+        printf(" \033[33m%.1fs\033[37m", last_command_ns / 1e9);
+    }
+    if (segment_enabled(segments, "status") && last_status != 0) {
+        printf(" \033[31m[%d]\033[37m", last_status);
+    }
+    printf("$ ");
+}
+
+void render_prompt(const char *cwd, const char *display_cwd) {
+    render_count++;
+    copy_path(prompt_cwd, cwd);
+    copy_path(prompt_display_cwd, display_cwd);
+
+    shown_git_segment[0] = '\0';
+    if (segment_enabled(prompt_segments(), "git")) {
+        git_segment(cwd, shown_git_segment, sizeof(shown_git_segment));
+    }
+    print_prompt(shown_git_segment);
+}
+
+void invalidate_prompt_segments() {
+    // Any command may have changed the working tree, cached values are shown until they are recomputed
+    if (!worker_started) {
+        return;
+    }
+    pthread_mutex_lock(&prompt_lock);
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        prompt_cache[i].fresh = 0;
+    }
+    pthread_mutex_unlock(&prompt_lock);
+}
+
+// Repaints the prompt line with the typed input if the git segment has changed
+static void repaint_prompt(const char *input, int length) {
+    char segment[sizeof(shown_git_segment)];
+    git_segment(prompt_cwd, segment, sizeof(segment));
+    if (strcmp(segment, shown_git_segment) == 0) {
+        return;
+    }
+    strcpy(shown_git_segment, segment);
+
+    printf("\r\033[K");
+    print_prompt(shown_git_segment);
+    printf("%.*s", length, input);
+    fflush(stdout);
+}
+
+int read_key(const char *input, int length) {
+    // Without the worker there is nothing to wait for but the keyboard
+    if (!worker_started) {
+        return getchar();
+    }
+
+    struct pollfd fds[3] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {result_pipe[0], POLLIN, 0},
+        {inotify_fd, POLLIN, 0}
+    };
+    while (1) {
+        if (poll(fds, inotify_fd != -1 ? 3 : 2, -1) == -1) {
+            return getchar();
+        }
+        if (fds[0].revents != 0) {
+            return getchar();
+        }
+        if (fds[1].revents != 0) {
+            char drained[64];
+            while (read(result_pipe[0], drained, sizeof(drained)) > 0) {
+            }
+            repaint_prompt(input, length);
+        }
+        if (fds[2].revents != 0) {
+            // git_segment() reads the events and asks the worker for the new state
+            char segment[sizeof(shown_git_segment)];
+            git_segment(prompt_cwd, segment, sizeof(segment));
+        }
+    }
+}
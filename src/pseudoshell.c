@@ -13,9 +13,19 @@ char history_file[MAX_PATH_LENGTH];
 char abbreviation_file[MAX_PATH_LENGTH];
 char sorted_history_file[MAX_PATH_LENGTH];
 char labeled_directories_file[MAX_PATH_LENGTH];
+char history_stats_file[MAX_PATH_LENGTH];
+char functions_file[MAX_PATH_LENGTH];
+char directories_file[MAX_PATH_LENGTH];
+char cached_dir[MAX_PATH_LENGTH];
+char server_socket_file[MAX_PATH_LENGTH];
+char history_segments_dir[MAX_PATH_LENGTH];
 
 
-void initialize_paths() {
+static void cache_path(char *path, const char *file_name) {
+    snprintf(path, MAX_PATH_LENGTH, "%.*s%s", MAX_CACHE_DIR_LENGTH, cache_dir, file_name);
+}
+
+void initialize_paths(const char *cache_dir_override) {
     // Get the home directory from the environment variable
     const char *system_home_path = getenv("HOME");
     if (system_home_path == NULL) {
@@ -23,27 +33,65 @@ void initialize_paths() {
         exit(EXIT_FAILURE);
     }
 
-    snprintf(cache_dir, MAX_PATH_LENGTH, "%s%s", system_home_path, PRE_CACHE_DIR);
-    snprintf(home_path_file, MAX_PATH_LENGTH, "%s%s", system_home_path, PRE_HOME_PATH_FILE);
-    snprintf(history_file, MAX_PATH_LENGTH, "%s%s", system_home_path, PRE_HISTORY_FILE);
-    snprintf(abbreviation_file, MAX_PATH_LENGTH, "%s%s", system_home_path, PRE_ABBREVIATION_FILE);
-    snprintf(sorted_history_file, MAX_PATH_LENGTH, "%s%s", system_home_path, PRE_SORTED_HISTORY_FILE);
-    snprintf(labeled_directories_file, MAX_PATH_LENGTH, "%s%s", system_home_path, PRE_LABELED_DIRECTORIES_FILE);
+    // The cache can be moved with --cache-dir or $GOGICACHE_DIR, so several instances don't share it
+    if (cache_dir_override == NULL) {
+        cache_dir_override = getenv(CACHE_DIR_VARIABLE);
+    }
+    char cwd[MAX_PATH_LENGTH];
+    if (cache_dir_override != NULL && cache_dir_override[0] == '/') {
+        snprintf(cache_dir, MAX_PATH_LENGTH, "%s", cache_dir_override);
+    } else if (cache_dir_override != NULL && cache_dir_override[0] != '\0' && getcwd(cwd, sizeof(cwd)) != NULL) {
+        // Relative to the starting directory, the paths must stay valid after cd
+        snprintf(cache_dir, MAX_PATH_LENGTH, "%.*s/%s", MAX_CACHE_DIR_LENGTH, cwd, cache_dir_override);
+    } else {
+        snprintf(cache_dir, MAX_PATH_LENGTH, "%s%s", system_home_path, PRE_CACHE_DIR);
+    }
+
+    if (strlen(cache_dir) > MAX_CACHE_DIR_LENGTH) {
+        fprintf(stderr, "Cache directory path is too long: %s\n", cache_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    cache_path(home_path_file, PRE_HOME_PATH_FILE);
+    cache_path(history_file, PRE_HISTORY_FILE);
+    cache_path(abbreviation_file, PRE_ABBREVIATION_FILE);
+    cache_path(sorted_history_file, PRE_SORTED_HISTORY_FILE);
+    cache_path(labeled_directories_file, PRE_LABELED_DIRECTORIES_FILE);
+    cache_path(history_stats_file, PRE_HISTORY_STATS_FILE);
+    cache_path(functions_file, PRE_FUNCTIONS_FILE);
+    cache_path(directories_file, PRE_DIRECTORIES_FILE);
+    cache_path(cached_dir, PRE_CACHED_DIR);
+    cache_path(server_socket_file, PRE_SERVER_SOCKET);
+    cache_path(history_segments_dir, PRE_HISTORY_SEGMENTS_DIR);
 }
 
 void create_cache() {
     struct stat st;
-    if (stat(cache_dir, &st) == -1) {
-        if (mkdir(cache_dir, 0700) == -1) {
-            perror("Failed to create .gogicache directory in your home directory.");
-        }
+    if (stat(cache_dir, &st) == 0) {
+        return;
+    }
+
+    // Missing parents of a relocated cache are created as well
+    char path[MAX_PATH_LENGTH];
+    snprintf(path, sizeof(path), "%s", cache_dir);
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0700);
+        *slash = '/';
+    }
+    if (mkdir(cache_dir, 0700) == -1) {
+        perror("Failed to create the cache directory");
     }
 }
 
+// Whether line is the entry of key in a "key:..." cache file
+static int is_entry_of(const char *line, const char *key) {
+    size_t length = strlen(key);
+    return strncmp(line, key, length) == 0 && line[length] == ':';
+}
+
 void fulfil_labeled_directories_file(char *path, char *description, char *color) {
-    FILE *file = fopen(labeled_directories_file, "r");
-    char lines[MAX_LABELED_DIRECTORIES][MAX_INPUT_LENGTH];
-    int line_count = 0;
+    FILE *file = open_cache_file(labeled_directories_file, "r");
     int found = 0;
 
     char new_entry[MAX_INPUT_LENGTH];
@@ -55,7 +103,7 @@ void fulfil_labeled_directories_file(char *path, char *description, char *color)
 
     if (file == NULL) {
         // If the file doesn't exist, create it and add the new entry
-        file = fopen(labeled_directories_file, "w");
+        file = open_cache_file(labeled_directories_file, "w");
         if (file == NULL) {
             perror("Failed to create .labeled_directories_file");
             return;
@@ -66,50 +114,41 @@ void fulfil_labeled_directories_file(char *path, char *description, char *color)
         return;
     }
 
-    // Read all lines into memory
-    while (fgets(lines[line_count], MAX_INPUT_LENGTH, file) && line_count < MAX_LABELED_DIRECTORIES) {
-        char current_path[MAX_INPUT_LENGTH], current_description[MAX_INPUT_LENGTH], current_color[MAX_INPUT_LENGTH];
-
-        // Extract path, description, and optional color
-        if (sscanf(lines[line_count], "%[^:]:%[^:]:%s", current_path, current_description, current_color) >= 2) {
-            // If the path matches, replace the line
-            if (strcmp(current_path, path) == 0) {
-                snprintf(lines[line_count], MAX_INPUT_LENGTH, "%s", new_entry);
-                found = 1;
-                printf("Description and color for '%s' updated to '%s:%s'.\n", path, description, color);
-                cwd_changed = 1;
-            }
+    // Lines are copied one by one into the replacement, the entry of path is replaced on the way
+    FILE *replacement = open_cache_replacement(labeled_directories_file);
+    if (replacement == NULL) {
+        perror("Failed to open .labeled_directories_file for writing");
+        fclose(file);
+        return;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, file) != -1) {
+        if (!found && is_entry_of(line, path)) {
+            fputs(new_entry, replacement);
+            found = 1;
+            printf("Description and color for '%s' updated to '%s:%s'.\n", path, description, color);
+        } else {
+            fputs(line, replacement);
         }
-        line_count++;
     }
+    free(line);
     fclose(file);
 
     // If the path was not found, add a new entry
     if (!found) {
-        if (line_count < MAX_LABELED_DIRECTORIES) {
-            snprintf(lines[line_count++], MAX_INPUT_LENGTH, "%s", new_entry);
-            printf("Description and color for '%s' as '%s:%s' added.\n", path, description, color);
-            cwd_changed = 1;
-        } else {
-            perror("File contains too many entries");
-            return;
-        }
+        fputs(new_entry, replacement);
+        printf("Description and color for '%s' as '%s:%s' added.\n", path, description, color);
     }
+    cwd_changed = 1;
 
-    // Write all lines back to the file
-    file = fopen(labeled_directories_file, "w");
-    if (file == NULL) {
-        perror("Failed to open .labeled_directories_file for writing");
-        return;
+    if (replace_cache_file(replacement, labeled_directories_file) == -1) {
+        perror("Failed to write .labeled_directories_file");
     }
-    for (int i = 0; i < line_count; i++) {
-        fputs(lines[i], file);
-    }
-    fclose(file);
 }
 
 void fulfil_home_path_file(const char *home_dir) {
-    FILE *file = fopen(home_path_file, "w");
+    FILE *file = open_cache_file(home_path_file, "w");
     if (file == NULL) {
         perror("Failed to create or open .home_path");
         return;
@@ -125,37 +164,44 @@ void fulfil_home_path_file(const char *home_dir) {
 }
 
 void fulfil_history_file(char *input) {
-    FILE *file = fopen(history_file, "a");
-    if (file == NULL) {
-        perror("Failed to create or open .history");
+    if (strcmp(input, "\n") == 0) {
+        // Do not write empty input to history
         return;
     }
 
-    if (strcmp(input, "\n") == 0) {
-        // Do not write empty input to history
+    // .history is only moved into a segment while no shell holds the append lock
+    int lock_fd = lock_history_append();
+    FILE *file = open_cache_file(history_file, "a");
+    if (file == NULL) {
+        perror("Failed to create or open .history");
+        unlock_history_append(lock_fd);
         return;
     }
 
     // Write the input command to the file followed by a newline
-    if (fprintf(file, "%s", input) < 0) {
+    int written = fprintf(file, "%s", input) >= 0;
+    if (!written) {
         perror("Failed to write to .history");
-    } else {
+    }
+    fclose(file);
+    unlock_history_append(lock_fd);
+
+    if (written) {
         total_commands++;
+        long long trace_start = trace_begin();
         fulfil_sorted_history_file(input);
+        trace_end(".sorted_history rewrite", trace_start);
+        compact_history_in_background();
     }
-
-    fclose(file);
 }
 
 void fulfil_abbreviation_file(char *value, char *key) {
-    FILE *file = fopen(abbreviation_file, "r");
-    char lines[MAX_ABBREVIATIONS][MAX_INPUT_LENGTH];  // Array to hold file lines
-    int line_count = 0;
+    FILE *file = open_cache_file(abbreviation_file, "r");
     int found = 0;
 
     if (file == NULL) {
         // If the file doesn't exist, create it and add the new line
-        file = fopen(abbreviation_file, "w");
+        file = open_cache_file(abbreviation_file, "w");
         if (file == NULL) {
             perror("Failed to create .abbreviation");
             return;
@@ -166,141 +212,130 @@ void fulfil_abbreviation_file(char *value, char *key) {
         return;
     }
 
-    // Read all lines into memory
-    while (fgets(lines[line_count], MAX_INPUT_LENGTH, file) && line_count < MAX_ABBREVIATIONS) {
-        char current_key[MAX_INPUT_LENGTH], current_value[MAX_INPUT_LENGTH];
-
-        // Extract key and value
-        if (sscanf(lines[line_count], "%[^:]:%s", current_key, current_value) == 2) {
-            // If the key matches, replace the line
-            if (strcmp(current_key, key) == 0) {
-                snprintf(lines[line_count], MAX_INPUT_LENGTH, "%s:%s\n", key, value);
-                found = 1;
+    // Lines are copied one by one into the replacement, the line of key is replaced on the way
+    FILE *replacement = open_cache_replacement(abbreviation_file);
+    if (replacement == NULL) {
+        perror("Failed to open abbreviation file for writing");
+        fclose(file);
+        return;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    size_t key_length = strlen(key);
+    while (getline(&line, &capacity, file) != -1) {
+        if (!found && is_entry_of(line, key)) {
+            char *current_value = line + key_length + 1;
+            current_value[strcspn(current_value, "\n")] = '\0';
+            if (strcmp(current_value, value) == 0) {
+                // Nothing changes, e.g. the '~' abbreviation recorded on every start, so the file isn't rewritten
+                free(line);
+                fclose(file);
+                discard_cache_replacement(replacement, abbreviation_file);
+                printf("Abbreviation for '%s' updated to '%s'.\n", key, value);
+                printf("Abbreviation file updated successfully.\n");
+                return;
             }
+            fprintf(replacement, "%s:%s\n", key, value);
+            found = 1;
+        } else {
+            fputs(line, replacement);
         }
-        line_count++;
     }
+    free(line);
     fclose(file);
 
     // If the key was not found, add a new line
     if (!found) {
-        if (line_count < MAX_ABBREVIATIONS) {
-            snprintf(lines[line_count++], MAX_INPUT_LENGTH, "%s:%s\n", key, value);
-            printf("Abbreviation '%s' as '%s' added.\n", value, key);
-            total_abbreviations++;
-        } else {
-            printf("Error: File contains too many lines. Cannot add abbreviation.\n");
-            return;
-        }
+        fprintf(replacement, "%s:%s\n", key, value);
+        printf("Abbreviation '%s' as '%s' added.\n", value, key);
+        total_abbreviations++;
     } else {
         printf("Abbreviation for '%s' updated to '%s'.\n", key, value);
     }
 
-    // Write all lines back to the file
-    file = fopen(abbreviation_file, "w");
-    if (file == NULL) {
-        perror("Failed to open abbreviation file for writing");
+    if (replace_cache_file(replacement, abbreviation_file) == -1) {
+        perror("Failed to write abbreviation file");
         return;
     }
-    for (int i = 0; i < line_count; i++) {
-        fputs(lines[i], file);
-    }
-    fclose(file);
     printf("Abbreviation file updated successfully.\n");
 }
 
-// Comparator function for sorting in descending order of usage count
-int compare(const void *a, const void *b) {
-    int count_a = ((int *)a)[0];
-    int count_b = ((int *)b)[0];
-    return count_b - count_a; // Descending order
+// Splits a "<count> <command>" line of .sorted_history, returns 0 if it isn't one
+static int parse_sorted_history_line(char *line, int *usage, char **command) {
+    char *end;
+    *usage = (int)strtol(line, &end, 10);
+    if (end == line || *end != ' ' || end[1] == '\n' || end[1] == '\0') {
+        return 0;
+    }
+    *command = end + 1;
+    (*command)[strcspn(*command, "\n")] = '\0';
+    return 1;
 }
 
 void fulfil_sorted_history_file(char *input) {
-    FILE *file = fopen(sorted_history_file, "r+"); // Open for reading and writing
-    if (file == NULL) {
-        file = fopen(sorted_history_file, "w+");
-        if (file == NULL) {
-            perror("Failed to create or open sorted_history_file");
-            return;
-        }
+    // The line of input is stored without its newline, the empty line recorded on start is not stored
+    char entry[MAX_INPUT_LENGTH];
+    snprintf(entry, sizeof(entry), "%.*s", (int)strcspn(input, "\n"), input);
+    if (entry[0] == '\0') {
+        return;
     }
 
-    char lines[MAX_COMMAND_NUMBER][MAX_INPUT_LENGTH]; // Temporary storage for input strings
-    int usage_counts[MAX_COMMAND_NUMBER] = {0};       // Corresponding usage counts
-    int line_count = 0;                               // Number of lines in the file
-    int found = 0;                                    // Flag to indicate if input is found
-
-    // Read lines from file and parse them
-    char buffer[MAX_INPUT_LENGTH];
-    while (fgets(buffer, MAX_INPUT_LENGTH, file) != NULL) {
-        int usage;
-        char command[MAX_INPUT_LENGTH];
-
-        // Parse usage count and command
-        if (sscanf(buffer, "%d %[^\n]", &usage, command) == 2) {
-            // Remove trailing newline from the input command (if present)
-            command[strcspn(command, "\n")] = '\0';
-
-            // Check if the input command matches
-            int is_duplicate = 0;
-            for (int i = 0; i < line_count; i++) {
-                if (strcmp(lines[i], command) == 0) {
-                    usage_counts[i] += usage; // Consolidate usage count
-                    if (strcmp(command, input) == 0) {
-                        usage_counts[i]++; // Increment for the input command
-                        found = 1;
-                    }
-                    is_duplicate = 1;
-                    break;
-                }
-            }
-
-            // Add the command to the list if it's not a duplicate
-            if (!is_duplicate) {
-                strcpy(lines[line_count], command);
-                usage_counts[line_count] = usage;
-                if (strcmp(command, input) == 0) {
-                    usage_counts[line_count]++;
-                    found = 1;
-                }
-                line_count++;
-            }
+    FILE *file = open_cache_file(sorted_history_file, "r");
+    FILE *replacement = open_cache_replacement(sorted_history_file);
+    if (replacement == NULL) {
+        perror("Failed to create or open sorted_history_file");
+        if (file != NULL) {
+            fclose(file);
         }
+        return;
     }
 
-    // If input is not found, add it
-    if (!found && line_count < MAX_COMMAND_NUMBER) {
-        strcpy(lines[line_count], input);
-        usage_counts[line_count] = 1;
-        line_count++;
+    // The file is kept sorted by usage, so one more use of input only moves its line up past
+    // the lines used as often: the first pass finds its count, the second copies the lines
+    // with input inserted before the first line used no more than it
+    char *line = NULL;
+    size_t capacity = 0;
+    int usage;
+    char *command;
+    int input_usage = 0;
+    while (file != NULL && getline(&line, &capacity, file) != -1) {
+        if (parse_sorted_history_line(line, &usage, &command) && strcmp(command, entry) == 0) {
+            input_usage = usage;
+            break;
+        }
     }
+    input_usage++;
 
-    // Combine usage counts and corresponding commands into a sortable array
-    int combined[line_count][2]; // [0] = usage count, [1] = line index
-    for (int i = 0; i < line_count; i++) {
-        combined[i][0] = usage_counts[i];
-        combined[i][1] = i;
+    int written = 0, inserted = 0;
+    if (file != NULL) {
+        rewind(file);
     }
-
-    // Sort in descending order of usage counts
-    qsort(combined, line_count, sizeof(combined[0]), compare);
-
-    // Close the file and reopen for writing
-    fclose(file);
-    file = fopen(sorted_history_file, "w");
-    if (file == NULL) {
-        perror("Failed to reopen .sorted_history_file for writing");
-        return;
+    while (file != NULL && written < MAX_COMMAND_NUMBER && getline(&line, &capacity, file) != -1) {
+        if (!parse_sorted_history_line(line, &usage, &command) || strcmp(command, entry) == 0) {
+            continue;
+        }
+        if (!inserted && usage <= input_usage) {
+            fprintf(replacement, "%d %s\n", input_usage, entry);
+            inserted = 1;
+            written++;
+        }
+        // The least used lines beyond the limit are dropped
+        if (written < MAX_COMMAND_NUMBER) {
+            fprintf(replacement, "%d %s\n", usage, command);
+            written++;
+        }
     }
-
-    // Write sorted content to the file
-    for (int i = 0; i < line_count; i++) {
-        int index = combined[i][1];
-        fprintf(file, "%d %s\n", combined[i][0], lines[index]);
+    if (!inserted && written < MAX_COMMAND_NUMBER) {
+        fprintf(replacement, "%d %s\n", input_usage, entry);
+    }
+    free(line);
+    if (file != NULL) {
+        fclose(file);
     }
 
-    fclose(file);
+    if (replace_cache_file(replacement, sorted_history_file) == -1) {
+        perror("Failed to write .sorted_history_file");
+    }
 }
 
 void enable_noncanonical_mode(struct termios *original_termios) {
@@ -334,7 +369,7 @@ void disable_noncanonical_mode(struct termios *original_termios) {
 }
 
 void get_home_dir() {
-    FILE *file = fopen(home_path_file, "r");
+    FILE *file = open_cache_file(home_path_file, "r");
     if (file == NULL) {
         perror("Failed to open .home_path");
         return;
@@ -348,27 +383,12 @@ void get_home_dir() {
 }
 
 void get_total_commands() {
-    FILE *file = fopen(history_file, "r");
-    if (file == NULL) {
-        perror("Failed to open .history");
-        return;
-    }
-    int line_count = 0;
-    char ch;
-
-    // Read the file character by character
-    while ((ch = fgetc(file)) != EOF) {
-        if (ch == '\n') {
-            line_count++;  // Increment the line count on every newline character
-        }
-    }
-
-    fclose(file);
-    total_commands = line_count;
+    // Only .history is counted, the segments know their own numbers
+    total_commands = count_history_entries();
 }
 
 void get_total_abbreviations() {
-    FILE *file = fopen(abbreviation_file, "r");
+    FILE *file = open_cache_file(abbreviation_file, "r");
     if (file == NULL) {
         perror("Failed to open .abbreviation");
         return;
@@ -395,7 +415,7 @@ void print_directory_description(const char *path) {
         return;
     }
 
-    FILE *file = fopen(labeled_directories_file, "r");
+    FILE *file = open_cache_file(labeled_directories_file, "r");
     char line[MAX_INPUT_LENGTH];
 
     if (file == NULL) {
@@ -421,7 +441,7 @@ void print_directory_description(const char *path) {
 }
 
 int get_color_for_directory(const char *cwd) {
-    FILE *file = fopen(labeled_directories_file, "r");
+    FILE *file = open_cache_file(labeled_directories_file, "r");
     if (file == NULL) {
         return -1;  // Return -1 if the file can't be opened
     }
@@ -449,6 +469,8 @@ int get_color_for_directory(const char *cwd) {
 
 // Function to convert a color name to an ANSI escape code
 int color_name_to_code(const char *color_name) {
+    if (color_name == NULL) return -1; // Labeled without a color
+
     if (strcmp(color_name, "black") == 0) return 30;
     if (strcmp(color_name, "red") == 0) return 31;
     if (strcmp(color_name, "green") == 0) return 32;
@@ -482,39 +504,16 @@ int color_name_to_code(const char *color_name) {
 }
 
 char* get_command_from_history(int command_index) {
-    FILE *file = fopen(history_file, "r");
-    if (file == NULL) {
-        perror("Failed to open .history");
-        return NULL;
+    COUNT(history_lookups, 1);
+    char *command = read_history_entry(command_index);
+    if (command != NULL) {
+        COUNT(history_hits, 1);
     }
-    char *line = malloc(MAX_INPUT_LENGTH);
-    if (line == NULL) {
-        perror("Memory allocation failed");
-        fclose(file);
-        return NULL;
-    }
-
-    int current_line = 1;
-    while (fgets(line, MAX_INPUT_LENGTH, file)) {
-        if (current_line == command_index) {
-            size_t len = strlen(line);
-            if (len > 0 && line[len - 1] == '\n') {
-                line[len - 1] = '\0';
-            }
-            fclose(file);
-            return line;  // Return the found line (caller must free it)
-        }
-        current_line++;
-    }
-
-    // If line_number is beyond the number of lines in the file
-    free(line);
-    fclose(file);
-    return NULL;
+    return command; // The caller must free it
 }
 
 char* get_most_used_command(char *input) {
-    FILE *file = fopen(sorted_history_file, "r"); // Open the file for reading
+    FILE *file = open_cache_file(sorted_history_file, "r"); // Open the file for reading
     if (file == NULL) {
         perror("Failed to open .sorted_history_file");
         return NULL;
@@ -0,0 +1,448 @@
+#define _GNU_SOURCE // For memfd_create() and file seals
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "headers.h"
+
+// Bodies collected by collect_here_documents(), handed to the tokenizer in order
+static struct HereDocument here_documents[MAX_HERE_DOCUMENTS];
+static int total_here_documents = 0;
+static int next_here_document_index = 0;
+
+// Delimiter of a here-document, as written after << on the first line
+struct HereDocumentDelimiter {
+    char word[MAX_KEY_LENGTH * 4];
+    int strip_tabs; // <<- removes leading tabs of the body and of the delimiter line
+    int expand;     // The delimiter was unquoted, so $VAR and $(command) are expanded
+};
+
+// Here-documents whose bodies are still being typed, see begin_here_document_input()
+static struct HereDocumentDelimiter typed_delimiters[MAX_HERE_DOCUMENTS];
+static int total_typed_delimiters = 0;
+static int next_typed_delimiter = 0;
+
+
+static int is_delimiter_end(char ch) {
+    return ch == '\0' || ch == ' ' || ch == '\t' || ch == '\n' || ch == '|' || ch == '<' || ch == '>' || ch == '&' || ch == ';';
+}
+
+// Reads the delimiters of the here-documents on the first line of input.
+// Returns their number, or -1 if there are too many; *first_line_end is set to the end of the line.
+static int parse_here_document_delimiters(char *input, struct HereDocumentDelimiter delimiters[], char **first_line_end) {
+    int count = 0;
+    char *p = input;
+
+    // Operators of the first line, quotes and substitutions are skipped like in parse_pipeline()
+    while (*p != '\0' && *p != '\n') {
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            p = (char *)skip_quoted(p);
+        } else if ((*p == '$' || *p == '<' || *p == '>') && p[1] == '(') {
+            const char *end = skip_substitution(p);
+            p = end != NULL ? (char *)end : p + strlen(p);
+        } else if (p[0] == '<' && p[1] == '<' && p[2] == '<') {
+            p += 3;
+        } else if (p[0] == '<' && p[1] == '<') {
+            p += 2;
+            int tabs = 0;
+            if (*p == '-') {
+                tabs = 1;
+                p++;
+            }
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+
+            // Quoting any part of the delimiter turns expansion of the body off
+            char delimiter[sizeof(delimiters[0].word)];
+            int length = 0;
+            int quoted = 0;
+            while (!is_delimiter_end(*p)) {
+                if (*p == '\'' || *p == '"') {
+                    quoted = 1;
+                    p++;
+                    continue;
+                }
+                if (*p == '\\' && p[1] != '\0') {
+                    quoted = 1;
+                    p++;
+                }
+                if (length < (int)sizeof(delimiter) - 1) {
+                    delimiter[length++] = *p;
+                }
+                p++;
+            }
+            delimiter[length] = '\0';
+
+            if (length > 0) {
+                if (count == MAX_HERE_DOCUMENTS) {
+                    fprintf(stderr, "Too many here-documents, at most %d in one command\n", MAX_HERE_DOCUMENTS);
+                    return -1;
+                }
+                memcpy(delimiters[count].word, delimiter, length + 1);
+                delimiters[count].strip_tabs = tabs;
+                delimiters[count].expand = !quoted;
+                count++;
+            }
+        } else {
+            p++;
+        }
+    }
+
+    *first_line_end = p;
+    return count;
+}
+
+// Returns the start of a body line without the tabs <<- removes
+static char *strip_body_tabs(char *line, const struct HereDocumentDelimiter *delimiter) {
+    if (delimiter->strip_tabs) {
+        while (*line == '\t') {
+            line++;
+        }
+    }
+    return line;
+}
+
+static int is_delimiter_line(const char *line, const char *line_end, const struct HereDocumentDelimiter *delimiter) {
+    return (size_t)(line_end - line) == strlen(delimiter->word) && strncmp(line, delimiter->word, line_end - line) == 0;
+}
+
+int begin_here_document_input(char *input) {
+    char *first_line_end;
+    total_typed_delimiters = parse_here_document_delimiters(input, typed_delimiters, &first_line_end);
+    next_typed_delimiter = 0;
+    return total_typed_delimiters;
+}
+
+int continue_here_document_input(char *line) {
+    // Only the new line is looked at, so typing a long body costs nothing per line
+    if (next_typed_delimiter < total_typed_delimiters) {
+        const struct HereDocumentDelimiter *delimiter = &typed_delimiters[next_typed_delimiter];
+        char *start = strip_body_tabs(line, delimiter);
+        if (is_delimiter_line(start, start + strcspn(start, "\n"), delimiter)) {
+            next_typed_delimiter++;
+        }
+    }
+    return total_typed_delimiters - next_typed_delimiter;
+}
+
+int collect_here_documents(char *input) {
+    struct HereDocumentDelimiter delimiters[MAX_HERE_DOCUMENTS];
+    char *first_line_end;
+    int count = parse_here_document_delimiters(input, delimiters, &first_line_end);
+
+    total_here_documents = 0;
+    next_here_document_index = 0;
+    if (count == -1) {
+        return -1;
+    }
+    if (count == 0 || *first_line_end != '\n') {
+        return 0;
+    }
+
+    // Bodies are cut out of the input after the first line, a missing delimiter ends the body at the end of input
+    char *cursor = first_line_end + 1;
+    for (int i = 0; i < count; i++) {
+        char *body = cursor;
+        char *write = cursor;
+
+        while (*cursor != '\0') {
+            char *line_end = strchr(cursor, '\n');
+            if (line_end == NULL) {
+                line_end = cursor + strlen(cursor);
+            }
+            char *line = strip_body_tabs(cursor, &delimiters[i]);
+            cursor = *line_end == '\n' ? line_end + 1 : line_end;
+            if (is_delimiter_line(line, line_end, &delimiters[i])) {
+                break;
+            }
+
+            // Lines are compacted in place only when leading tabs were removed
+            if (write != line) {
+                memmove(write, line, cursor - line);
+            }
+            write += cursor - line;
+        }
+
+        here_documents[i].body = body;
+        here_documents[i].length = write - body;
+        here_documents[i].expand = delimiters[i].expand;
+    }
+
+    total_here_documents = count;
+    *first_line_end = '\0';
+    return 0;
+}
+
+int next_here_document(struct HereDocument *here_document) {
+    if (next_here_document_index >= total_here_documents) {
+        return -1;
+    }
+    *here_document = here_documents[next_here_document_index++];
+    return 0;
+}
+
+int open_here_document(const char *data, size_t length) {
+    // Small bodies fit into a pipe at once, so writing them never blocks
+    if (length <= HERE_DOCUMENT_PIPE_LIMIT) {
+        int pipe_fds[2];
+        if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+            perror("Internal function pipe failed");
+            return -1;
+        }
+        if (length > 0 && write(pipe_fds[1], data, length) != (ssize_t)length) {
+            perror("Failed to write here-document");
+        }
+        close(pipe_fds[1]);
+        return pipe_fds[0];
+    }
+
+    // Large bodies are copied once into a sealed memory file the command reads as a regular file
+    int fd = memfd_create("gogishell-here-document", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        perror("Internal function memfd_create failed");
+        return -1;
+    }
+    size_t written = 0;
+    while (written < length) {
+        ssize_t bytes_written = write(fd, data + written, length - written);
+        if (bytes_written <= 0) {
+            perror("Failed to write here-document");
+            close(fd);
+            return -1;
+        }
+        written += bytes_written;
+    }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+static int save_fd(struct SavedFds *saved, int fd) {
+    for (int i = 0; i < saved->count; i++) {
+        if (saved->fds[i] == fd) {
+            return 0;
+        }
+    }
+    if (saved->count >= MAX_REDIRECTIONS) {
+        fprintf(stderr, "Too many redirections\n");
+        return -1;
+    }
+    saved->fds[saved->count] = fd;
+    saved->copies[saved->count] = fcntl(fd, F_DUPFD_CLOEXEC, 10); // -1 if fd wasn't open
+    saved->count++;
+    return 0;
+}
+
+int apply_redirections(struct Words *words, struct SavedFds *saved) {
+    // saved is NULL in children, otherwise the original descriptors are kept for restore_redirections()
+    if (saved != NULL) {
+        saved->count = 0;
+    }
+
+    for (int i = 0; i < words->num_redirections; i++) {
+        struct Redirection *redirection = &words->redirections[i];
+        int fd = -1;
+
+        if (saved != NULL && save_fd(saved, redirection->fd) == -1) {
+            return -1;
+        }
+
+        switch (redirection->type) {
+            case REDIRECT_OUTPUT:
+                fd = open(redirection->target, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+                if (fd == -1) {
+                    perror("Failed to open file for output redirection");
+                    return -1;
+                }
+                break;
+            case REDIRECT_APPEND:
+                fd = open(redirection->target, O_CREAT | O_WRONLY | O_APPEND, 0644);
+                if (fd == -1) {
+                    perror("Failed to open file for append output redirection");
+                    return -1;
+                }
+                break;
+            case REDIRECT_INPUT:
+                fd = open(redirection->target, O_RDONLY);
+                if (fd == -1) {
+                    perror("Failed to open file for input redirection");
+                    return -1;
+                }
+                break;
+            case REDIRECT_READ_WRITE:
+                fd = open(redirection->target, O_CREAT | O_RDWR, 0644);
+                if (fd == -1) {
+                    perror("Failed to open file for read-write redirection");
+                    return -1;
+                }
+                break;
+            case REDIRECT_HERE_DOCUMENT:
+                if (redirection->source_fd == -1) {
+                    return -1;
+                }
+                dup2(redirection->source_fd, redirection->fd);
+                continue;
+            case REDIRECT_DUPLICATE:
+                if (fcntl(redirection->source_fd, F_GETFD) == -1) {
+                    perror("Failed to duplicate file descriptor");
+                    return -1;
+                }
+                if (redirection->source_fd != redirection->fd) {
+                    dup2(redirection->source_fd, redirection->fd);
+                }
+                continue;
+            case REDIRECT_CLOSE:
+                close(redirection->fd);
+                continue;
+        }
+
+        if (fd != redirection->fd) {
+            dup2(fd, redirection->fd);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+void restore_redirections(struct SavedFds *saved) {
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = saved->count - 1; i >= 0; i--) {
+        if (saved->copies[i] != -1) {
+            dup2(saved->copies[i], saved->fds[i]);
+            close(saved->copies[i]);
+        } else {
+            close(saved->fds[i]);
+        }
+    }
+    saved->count = 0;
+}
+
+void handle_redirection(struct Words *words) {
+    // Children can't continue with a broken redirection table
+    if (apply_redirections(words, NULL) == -1) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Moves length bytes from a pipe to fd, falling back to read/write if fd doesn't support splice()
+static int drain_pipe(int pipe_fd, int fd, size_t length, int *use_copy) {
+    char buffer[4096];
+
+    while (length > 0) {
+        ssize_t moved;
+        if (!*use_copy) {
+            moved = splice(pipe_fd, NULL, fd, NULL, length, SPLICE_F_MOVE);
+            if (moved == -1 && errno == EINVAL) {
+                *use_copy = 1;
+                continue;
+            }
+        } else {
+            moved = read(pipe_fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+            if (moved > 0 && write(fd, buffer, moved) != moved) {
+                moved = -1;
+            }
+        }
+        if (moved <= 0) {
+            return -1;
+        }
+        length -= moved;
+    }
+    return 0;
+}
+
+static int copy_to_all(int in_fd, int out_fds[], int count) {
+    char buffer[FAN_OUT_CHUNK];
+    ssize_t bytes_read;
+
+    while ((bytes_read = read(in_fd, buffer, sizeof(buffer))) > 0) {
+        for (int i = 0; i < count; i++) {
+            if (write(out_fds[i], buffer, bytes_read) != bytes_read) {
+                perror("Failed to write fan-out output");
+                return -1;
+            }
+        }
+    }
+    // A pseudo-terminal reports EIO instead of the end of input once its terminal side is closed
+    return bytes_read == 0 || errno == EIO ? 0 : -1;
+}
+
+int fan_out(int in_fd, int out_fds[], int count) {
+    // Every output except the last gets the bytes through tee() into its own empty pipe, which
+    // always takes everything the input pipe holds. The last output consumes the input with splice().
+    struct stat st;
+    if (count == 0 || fstat(in_fd, &st) == -1 || !S_ISFIFO(st.st_mode)) {
+        return copy_to_all(in_fd, out_fds, count);
+    }
+
+    int (*pipes)[2] = calloc(count, sizeof(int[2]));
+    int *use_copy = calloc(count, sizeof(int));
+    if (pipes == NULL || use_copy == NULL) {
+        perror("Failed to allocate memory");
+        free(pipes);
+        free(use_copy);
+        return -1;
+    }
+
+    int result = 0;
+    for (int i = 0; i < count - 1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            perror("Internal function pipe failed");
+            count = i + 1;
+            result = -1;
+            break;
+        }
+    }
+
+    while (result == 0) {
+        ssize_t length;
+        if (count > 1) {
+            // The first tee() waits for data and decides how much is sent in this round
+            length = tee(in_fd, pipes[0][1], FAN_OUT_CHUNK, 0);
+            for (int i = 1; i < count - 1 && length > 0; i++) {
+                if (tee(in_fd, pipes[i][1], length, 0) != length) {
+                    length = -1;
+                }
+            }
+            for (int i = 0; i < count - 1 && length > 0; i++) {
+                if (drain_pipe(pipes[i][0], out_fds[i], length, &use_copy[i]) == -1) {
+                    length = -1;
+                }
+            }
+            if (length > 0 && drain_pipe(in_fd, out_fds[count - 1], length, &use_copy[count - 1]) == -1) {
+                length = -1;
+            }
+        } else {
+            length = splice(in_fd, NULL, out_fds[0], NULL, FAN_OUT_CHUNK, SPLICE_F_MOVE);
+            if (length == -1 && errno == EINVAL) {
+                result = copy_to_all(in_fd, out_fds, count);
+                break;
+            }
+        }
+
+        if (length == 0) {
+            break;
+        }
+        if (length < 0) {
+            perror("Failed to fan out input");
+            result = -1;
+        }
+    }
+
+    for (int i = 0; i < count - 1; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+    free(pipes);
+    free(use_copy);
+    return result;
+}
@@ -0,0 +1,671 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+
+#include "headers.h"
+
+// Results of running a list, break and continue unwind up to the innermost loop
+#define SCRIPT_NEXT 0
+#define SCRIPT_BREAK 1
+#define SCRIPT_CONTINUE 2
+#define SCRIPT_RETURN 3
+
+// Recursive descent over the script text, nodes are allocated as they are recognized
+struct ScriptParser {
+    const char *p;
+    char error[MAX_ARG_LENGTH * 2]; // First syntax error, empty if there is none
+    int incomplete;                 // The text ended inside a compound command, more lines may complete it
+};
+
+// Parsed scripts by text, so a script typed again or a loop in $(...) isn't parsed twice
+struct CachedScript {
+    char *text;
+    struct ScriptNode *script;
+    int running; // Nesting count, a running script is never evicted
+};
+
+static struct CachedScript script_cache[SCRIPT_CACHE_SIZE];
+
+static const char *const reserved_words[] = {"then", "elif", "else", "fi", "do", "done", "esac", "}", NULL};
+
+
+static struct ScriptNode *parse_list(struct ScriptParser *parser, const char *const terminators[]);
+
+static int is_word_end(char ch) {
+    return ch == '\0' || ch == ' ' || ch == '\t' || ch == '\n' || ch == ';';
+}
+
+static int keyword_at(const char *p, const char *keyword) {
+    size_t length = strlen(keyword);
+    return strncmp(p, keyword, length) == 0 && is_word_end(p[length]);
+}
+
+static void syntax_error(struct ScriptParser *parser, const char *message, const char *word) {
+    if (parser->error[0] != '\0') {
+        return;
+    }
+    // Running out of text is not an error yet, the next lines may still close the command
+    if (*parser->p == '\0') {
+        parser->incomplete = 1;
+    }
+    snprintf(parser->error, sizeof(parser->error), message, word);
+}
+
+static void skip_blanks(struct ScriptParser *parser) {
+    const char *p = parser->p;
+    while (1) {
+        if (*p == ' ' || *p == '\t') {
+            p++;
+        } else if (*p == '\\' && p[1] == '\n') {
+            p += 2;
+        } else if (*p == '#') {
+            p += strcspn(p, "\n");
+        } else {
+            break;
+        }
+    }
+    parser->p = p;
+}
+
+// Skips blanks, newlines and single ';', but never the ";;" ending a case item
+static void skip_separators(struct ScriptParser *parser) {
+    while (1) {
+        skip_blanks(parser);
+        if (*parser->p == '\n' || (*parser->p == ';' && parser->p[1] != ';')) {
+            parser->p++;
+        } else {
+            break;
+        }
+    }
+}
+
+// Returns the end of the text starting at p, which stops at an unquoted character of stops
+static const char *scan_text(const char *p, const char *stops) {
+    while (*p != '\0' && strchr(stops, *p) == NULL) {
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            p = skip_quoted(p);
+        } else if ((*p == '$' || *p == '<' || *p == '>') && p[1] == '(') {
+            const char *end = skip_substitution(p);
+            p = end != NULL ? end : p + strlen(p);
+        } else {
+            p++;
+        }
+    }
+    return p;
+}
+
+static char *copy_text(const char *start, const char *end) {
+    while (end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    char *text = strndup(start, end - start);
+    if (text == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    return text;
+}
+
+static struct ScriptNode *new_node(int type) {
+    struct ScriptNode *node = calloc(1, sizeof(struct ScriptNode));
+    if (node == NULL) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    node->type = type;
+    return node;
+}
+
+static int expect(struct ScriptParser *parser, const char *keyword) {
+    skip_separators(parser);
+    if (keyword_at(parser->p, keyword)) {
+        parser->p += strlen(keyword);
+        return 0;
+    }
+    syntax_error(parser, "expected '%s'", keyword);
+    return -1;
+}
+
+static int at_terminator(struct ScriptParser *parser, const char *const terminators[]) {
+    for (int i = 0; terminators[i] != NULL; i++) {
+        if (strcmp(terminators[i], ";;") == 0 ? strncmp(parser->p, ";;", 2) == 0 : keyword_at(parser->p, terminators[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// if LIST; then LIST; [elif LIST; then LIST;]... [else LIST;] fi
+static struct ScriptNode *parse_if(struct ScriptParser *parser) {
+    static const char *const then_words[] = {"then", NULL};
+    static const char *const branch_words[] = {"elif", "else", "fi", NULL};
+    static const char *const fi_words[] = {"fi", NULL};
+
+    struct ScriptNode *node = new_node(NODE_IF);
+    node->condition = parse_list(parser, then_words);
+    if (expect(parser, "then") == -1) {
+        return node;
+    }
+    node->body = parse_list(parser, branch_words);
+
+    // An elif is an if nested in the else branch, sharing the fi of the outer one
+    if (keyword_at(parser->p, "elif")) {
+        parser->p += strlen("elif");
+        node->otherwise = parse_if(parser);
+    } else if (keyword_at(parser->p, "else")) {
+        parser->p += strlen("else");
+        node->otherwise = parse_list(parser, fi_words);
+        expect(parser, "fi");
+    } else {
+        expect(parser, "fi");
+    }
+    return node;
+}
+
+// while|until LIST; do LIST; done
+static struct ScriptNode *parse_while(struct ScriptParser *parser, int type) {
+    static const char *const do_words[] = {"do", NULL};
+    static const char *const done_words[] = {"done", NULL};
+
+    struct ScriptNode *node = new_node(type);
+    node->condition = parse_list(parser, do_words);
+    if (expect(parser, "do") == 0) {
+        node->body = parse_list(parser, done_words);
+        expect(parser, "done");
+    }
+    return node;
+}
+
+// for NAME in WORDS; do LIST; done
+static struct ScriptNode *parse_for(struct ScriptParser *parser) {
+    static const char *const done_words[] = {"done", NULL};
+
+    struct ScriptNode *node = new_node(NODE_FOR);
+    skip_blanks(parser);
+    const char *name = parser->p;
+    const char *end = scan_text(name, " \t\n;");
+    if (!is_valid_variable_name(name, end - name)) {
+        syntax_error(parser, "expected a variable name after '%s'", "for");
+        return node;
+    }
+    node->name = copy_text(name, end);
+    parser->p = end;
+
+    skip_blanks(parser);
+    if (!keyword_at(parser->p, "in")) {
+        syntax_error(parser, "expected '%s'", "in");
+        return node;
+    }
+    parser->p += strlen("in");
+    end = scan_text(parser->p, ";\n");
+    node->text = copy_text(parser->p, end);
+    parser->p = end;
+
+    if (expect(parser, "do") == 0) {
+        node->body = parse_list(parser, done_words);
+        expect(parser, "done");
+    }
+    return node;
+}
+
+// case WORD in [(]PATTERN[|PATTERN]...) LIST;; ... esac
+static struct ScriptNode *parse_case(struct ScriptParser *parser) {
+    static const char *const item_words[] = {";;", "esac", NULL};
+
+    struct ScriptNode *node = new_node(NODE_CASE);
+    skip_blanks(parser);
+    const char *end = scan_text(parser->p, " \t\n;");
+    if (end == parser->p) {
+        syntax_error(parser, "expected a word after '%s'", "case");
+        return node;
+    }
+    node->text = copy_text(parser->p, end);
+    parser->p = end;
+    if (expect(parser, "in") == -1) {
+        return node;
+    }
+
+    // Items are chained through body, the commands of every item hang off its own body
+    struct ScriptNode **tail = &node->body;
+    while (1) {
+        skip_separators(parser);
+        if (keyword_at(parser->p, "esac")) {
+            parser->p += strlen("esac");
+            break;
+        }
+        if (*parser->p == '(') {
+            parser->p++;
+        }
+        end = scan_text(parser->p, ")\n;");
+        if (*end != ')') {
+            parser->p = end;
+            syntax_error(parser, "expected '%s' after a case pattern", ")");
+            break;
+        }
+        struct ScriptNode *item = new_node(NODE_CASE_ITEM);
+        item->text = copy_text(parser->p, end);
+        *tail = item;
+        tail = &item->next;
+
+        parser->p = end + 1;
+        item->body = parse_list(parser, item_words);
+        if (parser->error[0] != '\0') {
+            break;
+        }
+        if (strncmp(parser->p, ";;", 2) == 0) {
+            parser->p += 2;
+        } else if (*parser->p == '\0') {
+            syntax_error(parser, "expected '%s'", "esac");
+            break;
+        }
+    }
+    return node;
+}
+
+static int is_function_name_char(char ch) {
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '_' || ch == '-';
+}
+
+// Returns 1 if p starts with "name()", the short form of a function definition
+static int function_definition_at(const char *p) {
+    const char *end = p;
+    while (is_function_name_char(*end)) {
+        end++;
+    }
+    if (end == p) {
+        return 0;
+    }
+    end += strspn(end, " \t");
+    return end[0] == '(' && end[1] == ')';
+}
+
+// function NAME [()] { LIST; } or NAME() { LIST; }
+static struct ScriptNode *parse_function(struct ScriptParser *parser) {
+    static const char *const brace_words[] = {"}", NULL};
+
+    struct ScriptNode *node = new_node(NODE_FUNCTION);
+    skip_blanks(parser);
+    const char *name = parser->p;
+    const char *end = name;
+    while (is_function_name_char(*end)) {
+        end++;
+    }
+    if (end == name || end - name >= MAX_COMMAND_LENGTH || (*name >= '0' && *name <= '9')) {
+        parser->p = end;
+        syntax_error(parser, "expected a function name after '%s'", "function");
+        return node;
+    }
+    node->name = copy_text(name, end);
+    parser->p = end;
+
+    skip_blanks(parser);
+    if (parser->p[0] == '(' && parser->p[1] == ')') {
+        parser->p += 2;
+    }
+    skip_separators(parser);
+    if (*parser->p != '{') {
+        syntax_error(parser, "expected '%s'", "{");
+        return node;
+    }
+    parser->p++;
+
+    // The body is checked here, but kept as text: it is stored with the function and parsed again on its first call
+    const char *body = parser->p;
+    free_script(parse_list(parser, brace_words));
+    if (parser->error[0] != '\0') {
+        return node;
+    }
+    if (!keyword_at(parser->p, "}")) {
+        syntax_error(parser, "expected '%s'", "}");
+        return node;
+    }
+    node->text = copy_text(body, parser->p);
+    parser->p++;
+    return node;
+}
+
+static struct ScriptNode *parse_command(struct ScriptParser *parser) {
+    struct ScriptNode *node;
+
+    for (int i = 0; reserved_words[i] != NULL; i++) {
+        if (keyword_at(parser->p, reserved_words[i])) {
+            syntax_error(parser, "unexpected '%s'", reserved_words[i]);
+            return NULL;
+        }
+    }
+
+    if (keyword_at(parser->p, "if")) {
+        parser->p += strlen("if");
+        node = parse_if(parser);
+    } else if (keyword_at(parser->p, "while")) {
+        parser->p += strlen("while");
+        node = parse_while(parser, NODE_WHILE);
+    } else if (keyword_at(parser->p, "until")) {
+        parser->p += strlen("until");
+        node = parse_while(parser, NODE_UNTIL);
+    } else if (keyword_at(parser->p, "for")) {
+        parser->p += strlen("for");
+        node = parse_for(parser);
+    } else if (keyword_at(parser->p, "case")) {
+        parser->p += strlen("case");
+        node = parse_case(parser);
+    } else if (keyword_at(parser->p, "function") || function_definition_at(parser->p)) {
+        if (keyword_at(parser->p, "function")) {
+            parser->p += strlen("function");
+        }
+        node = parse_function(parser);
+    } else if (keyword_at(parser->p, "return")) {
+        // The optional exit code is kept as text and expanded when the return runs
+        parser->p += strlen("return");
+        const char *end = scan_text(parser->p, ";\n");
+        node = new_node(NODE_RETURN);
+        node->text = copy_text(parser->p, end);
+        parser->p = end;
+        return node;
+    } else if (keyword_at(parser->p, "break") || keyword_at(parser->p, "continue")) {
+        node = new_node(*parser->p == 'b' ? NODE_BREAK : NODE_CONTINUE);
+        parser->p += strlen(*parser->p == 'b' ? "break" : "continue");
+    } else {
+        // Anything else is a command line, run by execute_input() as if it was typed
+        const char *end = scan_text(parser->p, ";\n");
+        node = new_node(NODE_COMMAND);
+        node->text = copy_text(parser->p, end);
+        parser->p = end;
+        return node;
+    }
+
+    // Compound commands end with a separator, redirections or pipes after them aren't supported
+    skip_blanks(parser);
+    if (parser->error[0] == '\0' && *parser->p != '\0' && *parser->p != '\n' && *parser->p != ';') {
+        syntax_error(parser, "unexpected '%.16s' after a compound command", parser->p);
+    }
+    return node;
+}
+
+static struct ScriptNode *parse_list(struct ScriptParser *parser, const char *const terminators[]) {
+    struct ScriptNode *head = NULL;
+    struct ScriptNode **tail = &head;
+
+    while (parser->error[0] == '\0') {
+        skip_separators(parser);
+        if (*parser->p == '\0' || (terminators != NULL && at_terminator(parser, terminators))) {
+            break;
+        }
+        if (strncmp(parser->p, ";;", 2) == 0) {
+            syntax_error(parser, "unexpected '%s'", ";;");
+            break;
+        }
+        struct ScriptNode *node = parse_command(parser);
+        if (node == NULL) {
+            break;
+        }
+        *tail = node;
+        tail = &node->next;
+    }
+    return head;
+}
+
+void free_script(struct ScriptNode *node) {
+    while (node != NULL) {
+        struct ScriptNode *next = node->next;
+        free(node->text);
+        free(node->name);
+        free_script(node->condition);
+        free_script(node->body);
+        free_script(node->otherwise);
+        free(node);
+        node = next;
+    }
+}
+
+// Returns the parsed script, or NULL with the error (or the need for more lines) in parser
+static struct ScriptNode *parse_script(const char *text, struct ScriptParser *parser) {
+    parser->p = text;
+    parser->error[0] = '\0';
+    parser->incomplete = 0;
+
+    struct ScriptNode *script = parse_list(parser, NULL);
+    if (parser->error[0] != '\0') {
+        free_script(script);
+        return NULL;
+    }
+    return script;
+}
+
+struct ScriptNode *compile_script(const char *text) {
+    struct ScriptParser parser;
+    struct ScriptNode *script = parse_script(text, &parser);
+    if (parser.error[0] != '\0') {
+        fprintf(stderr, "Syntax error: %s\n", parser.error);
+    }
+    return script;
+}
+
+int is_script(const char *input) {
+    // Either control flow, or several commands separated by ';' on the command line
+    const char *start = input + strspn(input, " \t");
+    for (int i = 0; reserved_words[i] != NULL; i++) {
+        if (keyword_at(start, reserved_words[i])) {
+            return 1; // Reported as a syntax error by the parser
+        }
+    }
+    return keyword_at(start, "if") || keyword_at(start, "for") || keyword_at(start, "while") ||
+           keyword_at(start, "until") || keyword_at(start, "case") || keyword_at(start, "function") ||
+           keyword_at(start, "return") || function_definition_at(start) || *scan_text(start, ";\n") == ';';
+}
+
+int script_complete(const char *input) {
+    if (!is_script(input)) {
+        return 1;
+    }
+    struct ScriptParser parser;
+    free_script(parse_script(input, &parser));
+    return !parser.incomplete;
+}
+
+static int run_list(struct ScriptNode *node);
+
+static void run_command(struct ScriptNode *node) {
+    // execute_input() cuts its input in place, the cached text is kept intact
+    char *line = strdup(node->text);
+    if (line == NULL) {
+        perror("Failed to allocate memory");
+        last_status = 1;
+        return;
+    }
+    execute_input(line);
+    free(line);
+}
+
+static int run_for(struct ScriptNode *node) {
+    struct Words words;
+    if (parse_input(node->text, &words) == -1) {
+        last_status = 2;
+        return SCRIPT_NEXT;
+    }
+
+    last_status = 0;
+    int result = SCRIPT_NEXT;
+    for (int i = 0; words.argv[i] != NULL; i++) {
+        set_variable(node->name, words.argv[i]);
+        result = run_list(node->body);
+        if (result == SCRIPT_BREAK || result == SCRIPT_RETURN) {
+            break;
+        }
+    }
+    free_words(&words);
+    return result == SCRIPT_RETURN ? result : SCRIPT_NEXT;
+}
+
+static int run_while(struct ScriptNode *node) {
+    int status = 0;
+    while (1) {
+        run_list(node->condition);
+        if ((last_status == 0) != (node->type == NODE_WHILE)) {
+            break;
+        }
+        int result = run_list(node->body);
+        status = last_status;
+        if (result == SCRIPT_RETURN) {
+            return result;
+        }
+        if (result == SCRIPT_BREAK) {
+            break;
+        }
+    }
+    // A loop is as successful as its last body, or 0 if the body never ran
+    last_status = status;
+    return SCRIPT_NEXT;
+}
+
+// Returns 1 if one of the '|'-separated patterns matches the word
+static int case_item_matches(const char *patterns, const char *word) {
+    const char *start = patterns;
+    while (1) {
+        const char *end = scan_text(start, "|");
+        char pattern_text[MAX_INPUT_LENGTH];
+        snprintf(pattern_text, sizeof(pattern_text), "%.*s", (int)(end - start), start);
+
+        // Patterns are expanded like words, the glob characters in them are matched by fnmatch()
+        struct Words pattern;
+        if (parse_input(pattern_text, &pattern) == 0) {
+            int matched = fnmatch(pattern.argv[0] != NULL ? pattern.argv[0] : "", word, 0) == 0;
+            free_words(&pattern);
+            if (matched) {
+                return 1;
+            }
+        }
+        if (*end == '\0') {
+            return 0;
+        }
+        start = end + 1;
+    }
+}
+
+static int run_case(struct ScriptNode *node) {
+    struct Words words;
+    if (parse_input(node->text, &words) == -1) {
+        last_status = 2;
+        return SCRIPT_NEXT;
+    }
+    const char *word = words.argv[0] != NULL ? words.argv[0] : "";
+
+    last_status = 0;
+    int result = SCRIPT_NEXT;
+    for (struct ScriptNode *item = node->body; item != NULL; item = item->next) {
+        if (case_item_matches(item->text, word)) {
+            result = run_list(item->body);
+            break;
+        }
+    }
+    free_words(&words);
+    return result;
+}
+
+static int run_return(struct ScriptNode *node) {
+    // Without an argument the function returns the status of its last command
+    if (node->text[0] != '\0') {
+        struct Words words;
+        if (parse_input(node->text, &words) == -1) {
+            last_status = 2;
+        } else {
+            last_status = words.argv[0] != NULL ? atoi(words.argv[0]) & 255 : last_status;
+            free_words(&words);
+        }
+    }
+    return SCRIPT_RETURN;
+}
+
+static int run_list(struct ScriptNode *node) {
+    for (; node != NULL; node = node->next) {
+        int result = SCRIPT_NEXT;
+        switch (node->type) {
+            case NODE_COMMAND:
+                run_command(node);
+                break;
+            case NODE_IF:
+                run_list(node->condition);
+                if (last_status == 0) {
+                    result = run_list(node->body);
+                } else if (node->otherwise != NULL) {
+                    result = run_list(node->otherwise);
+                } else {
+                    last_status = 0;
+                }
+                break;
+            case NODE_WHILE:
+            case NODE_UNTIL:
+                result = run_while(node);
+                break;
+            case NODE_FOR:
+                result = run_for(node);
+                break;
+            case NODE_CASE:
+                result = run_case(node);
+                break;
+            case NODE_FUNCTION:
+                last_status = 0;
+                define_function(node->name, node->text);
+                break;
+            case NODE_RETURN:
+                return run_return(node);
+            case NODE_BREAK:
+                last_status = 0;
+                return SCRIPT_BREAK;
+            case NODE_CONTINUE:
+                last_status = 0;
+                return SCRIPT_CONTINUE;
+        }
+        if (result != SCRIPT_NEXT) {
+            return result;
+        }
+    }
+    return SCRIPT_NEXT;
+}
+
+void run_script_tree(struct ScriptNode *script) {
+    run_list(script);
+}
+
+void run_script(const char *text) {
+    // Direct-mapped cache, a slot holds the last script parsed into it
+    struct CachedScript *cached = &script_cache[hash_bytes(text, strlen(text)) % SCRIPT_CACHE_SIZE];
+    struct ScriptNode *script;
+
+    if (cached->text != NULL && strcmp(cached->text, text) == 0) {
+        script = cached->script;
+    } else {
+        long long trace_start = trace_begin();
+        struct ScriptParser parser;
+        script = parse_script(text, &parser);
+        trace_end("script parse", trace_start);
+        if (script == NULL) {
+            fprintf(stderr, "Syntax error: %s\n", parser.error);
+            last_status = 2;
+            return;
+        }
+
+        if (cached->running > 0) {
+            // The slot is busy with an outer script, this one runs uncached
+            run_list(script);
+            free_script(script);
+            return;
+        }
+        free(cached->text);
+        free_script(cached->script);
+        cached->text = strdup(text);
+        cached->script = cached->text != NULL ? script : NULL;
+        if (cached->text == NULL) {
+            run_list(script);
+            free_script(script);
+            return;
+        }
+    }
+
+    cached->running++;
+    run_list(script);
+    cached->running--;
+}
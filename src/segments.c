@@ -0,0 +1,837 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "headers.h"
+
+// History is kept in two parts: the hot .history, appended as text, and older segments in
+// .history_segments. A segment stores every distinct command once in dictionary blocks and the
+// history as command ids in sequence blocks, all blocks compressed one by one, so an entry is read
+// by decompressing two blocks. Segments are named after their first history number and keep the
+// numbering of the entries, so numbers never change when history moves between the parts.
+#define SEGMENT_MAGIC "GHS1"
+#define SEGMENT_NAME_FORMAT "%010u.seg"
+#define SEGMENT_NAME_LENGTH 14
+#define SEGMENT_IDS_PER_BLOCK 4096
+#define SEGMENT_COMMANDS_PER_BLOCK 256
+#define DICTIONARY_CACHE_SLOTS 16
+#define ROTATING_PREFIX ".rotating-" // .history being moved into a segment, followed by its first number
+#define APPEND_LOCK "append.lock"     // Shared by shells appending to .history, exclusive while it is moved
+#define COMPACT_LOCK "compact.lock"   // Held by the one process compacting
+
+// Trailer at the end of a segment file, after its blocks and their index
+struct SegmentTrailer {
+    unsigned int first;    // History number of the first entry
+    unsigned int count;    // Entries
+    unsigned int distinct; // Distinct commands
+    unsigned int blocks;   // Sequence blocks of command ids followed by dictionary blocks of commands
+    char magic[4];
+};
+
+// Index entry of a block, a block whose compressed_length equals raw_length is stored as it is
+struct SegmentBlock {
+    unsigned long long offset;
+    unsigned int compressed_length;
+    unsigned int raw_length;
+};
+
+struct HistorySegment {
+    char name[SEGMENT_NAME_LENGTH + 1];
+    struct SegmentTrailer trailer;
+    off_t index_offset;
+    off_t size;
+};
+
+// A decompressed block; dictionary blocks have their commands null-terminated and indexed
+struct CachedBlock {
+    char name[SEGMENT_NAME_LENGTH + 1];
+    unsigned int count; // Tells a merged segment from the one it replaced under the same name
+    int block;          // -1 if the slot is empty
+    unsigned char *data;
+    unsigned int starts[SEGMENT_COMMANDS_PER_BLOCK];
+};
+
+// Builds a segment file from entries given in order
+struct SegmentWriter {
+    FILE *file;
+    char temporary[MAX_PATH_LENGTH + 32];
+    unsigned int first;
+    unsigned int count;
+    unsigned int ids[SEGMENT_IDS_PER_BLOCK];
+    int pending_ids;
+    char **commands;       // Distinct commands in the order of their ids
+    unsigned int distinct;
+    unsigned int commands_capacity;
+    unsigned int *slots;   // Open-addressing table of ids + 1 by command, 0 is empty
+    unsigned int slots_capacity;
+    struct SegmentBlock *blocks;
+    unsigned int total_blocks;
+    unsigned int blocks_capacity;
+    unsigned long long offset;
+    int failed;
+};
+
+static struct HistorySegment *segments = NULL;
+static int total_segments = 0;
+static int segments_capacity = 0;
+static unsigned int archived_end = 0;       // Number of the last entry outside .history
+static char rotating_name[64] = "";         // .history being moved, if its entries aren't in a segment yet
+static unsigned int rotating_first = 0;
+static int segments_loaded = 0;
+static struct timespec loaded_mtime, loaded_ctime;
+static int compaction_requested_at = 0;
+
+static struct CachedBlock sequence_cache = {.block = -1};
+static struct CachedBlock dictionary_cache[DICTIONARY_CACHE_SLOTS];
+static int dictionary_cache_ready = 0;
+
+
+static int history_hot_limit() {
+    const char *value = get_variable(HISTORY_HOT_VARIABLE);
+    if (value != NULL && atoi(value) > 0) {
+        return atoi(value);
+    }
+    return HISTORY_HOT_LIMIT;
+}
+
+static void segments_path(char *path, size_t size, const char *name) {
+    snprintf(path, size, "%.*s/%s", MAX_PATH_LENGTH, history_segments_dir, name);
+}
+
+static unsigned int sequence_blocks(const struct SegmentTrailer *trailer) {
+    return (trailer->count + SEGMENT_IDS_PER_BLOCK - 1) / SEGMENT_IDS_PER_BLOCK;
+}
+
+// Takes one of the lock files of the segments, returns the descriptor holding it or -1
+static int lock_segments(const char *name, int operation) {
+    char path[MAX_PATH_LENGTH + 32];
+    segments_path(path, sizeof(path), name);
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == ENOENT) {
+        mkdir(history_segments_dir, 0700);
+        fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+    // Every lock is taken on a descriptor of its own, forked processes never share one
+    while (flock(fd, operation) == -1) {
+        if (errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+int lock_history_append() {
+    return lock_segments(APPEND_LOCK, LOCK_SH);
+}
+
+void unlock_history_append(int lock_fd) {
+    if (lock_fd != -1) {
+        close(lock_fd);
+    }
+}
+
+static long count_lines(FILE *file) {
+    char chunk[FAN_OUT_CHUNK];
+    long lines = 0;
+    size_t length;
+    while ((length = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        for (char *p = chunk; (p = memchr(p, '\n', chunk + length - p)) != NULL; p++) {
+            lines++;
+        }
+    }
+    return lines;
+}
+
+static long count_file_lines(const char *path) {
+    FILE *file = open_cache_file(path, "r");
+    if (file == NULL) {
+        return 0;
+    }
+    long lines = count_lines(file);
+    fclose(file);
+    return lines;
+}
+
+static int read_segment_trailer(const char *name, struct HistorySegment *segment) {
+    char path[MAX_PATH_LENGTH + 32];
+    segments_path(path, sizeof(path), name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    int valid = fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct SegmentTrailer) &&
+                pread(fd, &segment->trailer, sizeof(segment->trailer), st.st_size - sizeof(segment->trailer)) == sizeof(segment->trailer) &&
+                memcmp(segment->trailer.magic, SEGMENT_MAGIC, 4) == 0 && segment->trailer.count > 0;
+    close(fd);
+    if (!valid) {
+        return -1;
+    }
+    segment->size = st.st_size;
+    segment->index_offset = st.st_size - sizeof(segment->trailer) - (off_t)segment->trailer.blocks * sizeof(struct SegmentBlock);
+    if (segment->index_offset < 0) {
+        return -1;
+    }
+    snprintf(segment->name, sizeof(segment->name), "%s", name);
+    return 0;
+}
+
+static int compare_segments(const void *a, const void *b) {
+    unsigned int first_a = ((const struct HistorySegment *)a)->trailer.first;
+    unsigned int first_b = ((const struct HistorySegment *)b)->trailer.first;
+    return (first_a > first_b) - (first_a < first_b);
+}
+
+static unsigned int segment_end(const struct HistorySegment *segment) {
+    return segment->trailer.first + segment->trailer.count - 1;
+}
+
+// Lists the segments again if the directory changed since they were last listed
+static void load_history_segments() {
+    struct stat st;
+    if (stat(history_segments_dir, &st) == -1) {
+        total_segments = 0;
+        archived_end = 0;
+        rotating_name[0] = '\0';
+        segments_loaded = 0;
+        return;
+    }
+    if (segments_loaded && st.st_mtim.tv_sec == loaded_mtime.tv_sec && st.st_mtim.tv_nsec == loaded_mtime.tv_nsec &&
+        st.st_ctim.tv_sec == loaded_ctime.tv_sec && st.st_ctim.tv_nsec == loaded_ctime.tv_nsec) {
+        return;
+    }
+
+    DIR *dir = opendir(history_segments_dir);
+    if (dir == NULL) {
+        return;
+    }
+    total_segments = 0;
+    rotating_name[0] = '\0';
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+        if (strncmp(name, ROTATING_PREFIX, strlen(ROTATING_PREFIX)) == 0) {
+            snprintf(rotating_name, sizeof(rotating_name), "%.63s", name);
+            rotating_first = (unsigned int)strtoul(name + strlen(ROTATING_PREFIX), NULL, 10);
+            continue;
+        }
+        if (strlen(name) != SEGMENT_NAME_LENGTH || strspn(name, "0123456789") != 10 || strcmp(name + 10, ".seg") != 0) {
+            continue;
+        }
+        if (total_segments == segments_capacity) {
+            int capacity = segments_capacity == 0 ? 16 : segments_capacity * 2;
+            struct HistorySegment *grown = realloc(segments, capacity * sizeof(struct HistorySegment));
+            if (grown == NULL) {
+                break;
+            }
+            segments = grown;
+            segments_capacity = capacity;
+        }
+        if (read_segment_trailer(name, &segments[total_segments]) == 0) {
+            total_segments++;
+        }
+    }
+    closedir(dir);
+
+    // A merged segment replaces the first of its parts before the others are removed, so a part
+    // still covered by an earlier segment is left out
+    if (total_segments > 1) {
+        qsort(segments, total_segments, sizeof(struct HistorySegment), compare_segments);
+    }
+    int kept = 0;
+    archived_end = 0;
+    for (int i = 0; i < total_segments; i++) {
+        if (kept > 0 && segments[i].trailer.first <= archived_end) {
+            continue;
+        }
+        segments[kept++] = segments[i];
+        archived_end = segment_end(&segments[i]);
+    }
+    total_segments = kept;
+
+    if (rotating_name[0] != '\0') {
+        if (rotating_first == archived_end + 1) {
+            char path[MAX_PATH_LENGTH + 80];
+            segments_path(path, sizeof(path), rotating_name);
+            archived_end += count_file_lines(path);
+        } else {
+            rotating_name[0] = '\0'; // Its segment is written already
+        }
+    }
+
+    segments_loaded = 1;
+    loaded_mtime = st.st_mtim;
+    loaded_ctime = st.st_ctim;
+}
+
+// Reads block of segment into cache, returns its data or NULL
+static unsigned char *load_block(const struct HistorySegment *segment, int block, struct CachedBlock *cache) {
+    if (cache->block == block && cache->count == segment->trailer.count && strcmp(cache->name, segment->name) == 0) {
+        return cache->data;
+    }
+
+    char path[MAX_PATH_LENGTH + 32];
+    segments_path(path, sizeof(path), segment->name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    // A segment replaced by a merged one since it was listed is not read
+    struct stat st;
+    struct SegmentBlock index;
+    unsigned char *stored = NULL, *data = NULL;
+    if (fstat(fd, &st) == -1 || st.st_size != segment->size ||
+        pread(fd, &index, sizeof(index), segment->index_offset + (off_t)block * sizeof(index)) != sizeof(index) ||
+        (stored = malloc(index.compressed_length + 1)) == NULL || (data = malloc(index.raw_length + 1)) == NULL ||
+        pread(fd, stored, index.compressed_length, index.offset) != (ssize_t)index.compressed_length) {
+        close(fd);
+        free(stored);
+        free(data);
+        return NULL;
+    }
+    close(fd);
+
+    if (index.compressed_length == index.raw_length) {
+        memcpy(data, stored, index.raw_length);
+    } else if (decompress_block(stored, index.compressed_length, data, index.raw_length) == -1) {
+        fprintf(stderr, "history: %s: block %d is corrupted\n", segment->name, block);
+        free(stored);
+        free(data);
+        return NULL;
+    }
+    free(stored);
+    data[index.raw_length] = '\0';
+
+    // Commands of a dictionary block are separated by newlines
+    if ((unsigned int)block >= sequence_blocks(&segment->trailer)) {
+        unsigned int command = 0;
+        cache->starts[command++] = 0;
+        for (unsigned int i = 0; i < index.raw_length; i++) {
+            if (data[i] == '\n') {
+                data[i] = '\0';
+                if (command < SEGMENT_COMMANDS_PER_BLOCK) {
+                    cache->starts[command++] = i + 1;
+                }
+            }
+        }
+    }
+
+    free(cache->data);
+    cache->data = data;
+    cache->block = block;
+    cache->count = segment->trailer.count;
+    snprintf(cache->name, sizeof(cache->name), "%s", segment->name);
+    return data;
+}
+
+// Returns the command of entry number of segment, it stays valid until the next lookup
+static const char *segment_entry(const struct HistorySegment *segment, unsigned int number) {
+    unsigned int position = number - segment->trailer.first;
+    unsigned int *ids = (unsigned int *)load_block(segment, position / SEGMENT_IDS_PER_BLOCK, &sequence_cache);
+    if (ids == NULL) {
+        return NULL;
+    }
+    unsigned int id = ids[position % SEGMENT_IDS_PER_BLOCK];
+    if (id >= segment->trailer.distinct) {
+        return NULL;
+    }
+
+    if (!dictionary_cache_ready) {
+        for (int i = 0; i < DICTIONARY_CACHE_SLOTS; i++) {
+            dictionary_cache[i].block = -1;
+        }
+        dictionary_cache_ready = 1;
+    }
+    int block = sequence_blocks(&segment->trailer) + id / SEGMENT_COMMANDS_PER_BLOCK;
+    struct CachedBlock *cache = &dictionary_cache[block % DICTIONARY_CACHE_SLOTS];
+    unsigned char *data = load_block(segment, block, cache);
+    if (data == NULL) {
+        return NULL;
+    }
+    return (const char *)data + cache->starts[id % SEGMENT_COMMANDS_PER_BLOCK];
+}
+
+static struct HistorySegment *find_segment(unsigned int number) {
+    int low = 0, high = total_segments - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (number < segments[middle].trailer.first) {
+            high = middle - 1;
+        } else if (number > segment_end(&segments[middle])) {
+            low = middle + 1;
+        } else {
+            return &segments[middle];
+        }
+    }
+    return NULL;
+}
+
+// Returns line number (from 1) of a text file without its newline, the caller frees it
+static char *read_text_line(const char *path, long number) {
+    FILE *file = open_cache_file(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    long current = 0;
+    while (getline(&line, &capacity, file) != -1) {
+        if (++current == number) {
+            fclose(file);
+            line[strcspn(line, "\n")] = '\0';
+            return line;
+        }
+    }
+    free(line);
+    fclose(file);
+    return NULL;
+}
+
+static char *find_history_entry(int number) {
+    load_history_segments();
+    if ((unsigned int)number > archived_end) {
+        return read_text_line(history_file, number - archived_end);
+    }
+    if (rotating_name[0] != '\0' && (unsigned int)number >= rotating_first) {
+        char path[MAX_PATH_LENGTH + 80];
+        segments_path(path, sizeof(path), rotating_name);
+        return read_text_line(path, number - rotating_first + 1);
+    }
+    struct HistorySegment *segment = find_segment(number);
+    const char *command = segment != NULL ? segment_entry(segment, number) : NULL;
+    return command != NULL ? strdup(command) : NULL;
+}
+
+char *read_history_entry(int number) {
+    if (number <= 0) {
+        return NULL;
+    }
+    char *command = find_history_entry(number);
+    if (command == NULL && segments_loaded) {
+        // The entry may just have moved into a segment
+        segments_loaded = 0;
+        command = find_history_entry(number);
+    }
+    return command;
+}
+
+int count_history_entries() {
+    load_history_segments();
+    return archived_end + count_file_lines(history_file);
+}
+
+// Prints the lines of a text part of history from number on, first being the number of its first line
+static void print_text_entries(const char *path, unsigned int first, unsigned int from) {
+    FILE *file = open_cache_file(path, "r");
+    if (file == NULL) {
+        return;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned int number = first;
+    while (getline(&line, &capacity, file) != -1) {
+        if (number >= from) {
+            printf("%u %s", number, line);
+        }
+        number++;
+    }
+    free(line);
+    fclose(file);
+}
+
+void print_history_entries(int from) {
+    load_history_segments();
+    unsigned int start = from > 0 ? (unsigned int)from : 1;
+    for (int i = 0; i < total_segments; i++) {
+        unsigned int number = segments[i].trailer.first > start ? segments[i].trailer.first : start;
+        for (; number <= segment_end(&segments[i]); number++) {
+            const char *command = segment_entry(&segments[i], number);
+            if (command == NULL) {
+                break;
+            }
+            printf("%u %s\n", number, command);
+        }
+    }
+    unsigned int hot_first = archived_end + 1;
+    if (rotating_name[0] != '\0') {
+        char path[MAX_PATH_LENGTH + 80];
+        segments_path(path, sizeof(path), rotating_name);
+        print_text_entries(path, rotating_first, start);
+    }
+    print_text_entries(history_file, hot_first, start);
+}
+
+static int begin_segment(struct SegmentWriter *writer, unsigned int first) {
+    memset(writer, 0, sizeof(*writer));
+    writer->first = first;
+    snprintf(writer->temporary, sizeof(writer->temporary), "%.*s/.writing-%d", MAX_PATH_LENGTH, history_segments_dir, (int)getpid());
+    writer->file = fopen(writer->temporary, "w");
+    return writer->file != NULL ? 0 : -1;
+}
+
+static void write_block(struct SegmentWriter *writer, const unsigned char *data, unsigned int length) {
+    if (writer->total_blocks == writer->blocks_capacity) {
+        unsigned int capacity = writer->blocks_capacity == 0 ? 64 : writer->blocks_capacity * 2;
+        struct SegmentBlock *grown = realloc(writer->blocks, capacity * sizeof(struct SegmentBlock));
+        if (grown == NULL) {
+            writer->failed = 1;
+            return;
+        }
+        writer->blocks = grown;
+        writer->blocks_capacity = capacity;
+    }
+    size_t capacity = length + length / 255 + 16;
+    unsigned char *compressed = malloc(capacity);
+    size_t compressed_length = compressed != NULL ? compress_block(data, length, compressed, capacity) : 0;
+    if (compressed_length == 0 || compressed_length >= length) {
+        compressed_length = length; // Stored as it is
+    }
+    if (fwrite(compressed_length == length ? data : compressed, 1, compressed_length, writer->file) != compressed_length) {
+        writer->failed = 1;
+    }
+    free(compressed);
+
+    struct SegmentBlock *block = &writer->blocks[writer->total_blocks++];
+    block->offset = writer->offset;
+    block->compressed_length = compressed_length;
+    block->raw_length = length;
+    writer->offset += compressed_length;
+}
+
+static unsigned int command_id(struct SegmentWriter *writer, const char *command) {
+    if (writer->distinct * 2 >= writer->slots_capacity) {
+        unsigned int capacity = writer->slots_capacity == 0 ? 1024 : writer->slots_capacity * 2;
+        unsigned int *slots = calloc(capacity, sizeof(unsigned int));
+        if (slots == NULL) {
+            writer->failed = 1;
+            return 0;
+        }
+        for (unsigned int id = 0; id < writer->distinct; id++) {
+            unsigned int slot = hash_bytes(writer->commands[id], strlen(writer->commands[id])) & (capacity - 1);
+            while (slots[slot] != 0) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            slots[slot] = id + 1;
+        }
+        free(writer->slots);
+        writer->slots = slots;
+        writer->slots_capacity = capacity;
+    }
+
+    unsigned int slot = hash_bytes(command, strlen(command)) & (writer->slots_capacity - 1);
+    while (writer->slots[slot] != 0) {
+        if (strcmp(writer->commands[writer->slots[slot] - 1], command) == 0) {
+            return writer->slots[slot] - 1;
+        }
+        slot = (slot + 1) & (writer->slots_capacity - 1);
+    }
+
+    if (writer->distinct == writer->commands_capacity) {
+        unsigned int capacity = writer->commands_capacity == 0 ? 1024 : writer->commands_capacity * 2;
+        char **grown = realloc(writer->commands, capacity * sizeof(char *));
+        if (grown == NULL) {
+            writer->failed = 1;
+            return 0;
+        }
+        writer->commands = grown;
+        writer->commands_capacity = capacity;
+    }
+    char *copy = strdup(command);
+    if (copy == NULL) {
+        writer->failed = 1;
+        return 0;
+    }
+    writer->commands[writer->distinct] = copy;
+    writer->slots[slot] = writer->distinct + 1;
+    return writer->distinct++;
+}
+
+static void add_segment_entry(struct SegmentWriter *writer, const char *command) {
+    writer->ids[writer->pending_ids++] = command_id(writer, command);
+    writer->count++;
+    if (writer->pending_ids == SEGMENT_IDS_PER_BLOCK) {
+        write_block(writer, (const unsigned char *)writer->ids, sizeof(writer->ids));
+        writer->pending_ids = 0;
+    }
+}
+
+static void free_segment_writer(struct SegmentWriter *writer) {
+    for (unsigned int id = 0; id < writer->distinct; id++) {
+        free(writer->commands[id]);
+    }
+    free(writer->commands);
+    free(writer->slots);
+    free(writer->blocks);
+}
+
+// Writes the dictionary and the index, the segment then replaces the one named after its first entry
+static int finish_segment(struct SegmentWriter *writer) {
+    if (writer->pending_ids > 0) {
+        write_block(writer, (const unsigned char *)writer->ids, writer->pending_ids * sizeof(unsigned int));
+    }
+    for (unsigned int id = 0; id < writer->distinct; id += SEGMENT_COMMANDS_PER_BLOCK) {
+        struct Buffer block = {0};
+        for (unsigned int i = id; i < writer->distinct && i < id + SEGMENT_COMMANDS_PER_BLOCK; i++) {
+            buffer_append(&block, writer->commands[i], strlen(writer->commands[i]));
+            buffer_append_char(&block, '\n');
+        }
+        write_block(writer, (const unsigned char *)block.data, block.length);
+        buffer_free(&block);
+    }
+
+    struct SegmentTrailer trailer = {writer->first, writer->count, writer->distinct, writer->total_blocks, {0}};
+    memcpy(trailer.magic, SEGMENT_MAGIC, sizeof(trailer.magic));
+    if (fwrite(writer->blocks, sizeof(struct SegmentBlock), writer->total_blocks, writer->file) != writer->total_blocks ||
+        fwrite(&trailer, sizeof(trailer), 1, writer->file) != 1 || fflush(writer->file) != 0 || fsync(fileno(writer->file)) == -1) {
+        writer->failed = 1;
+    }
+    fclose(writer->file);
+
+    char path[MAX_PATH_LENGTH + 32], name[SEGMENT_NAME_LENGTH + 1];
+    snprintf(name, sizeof(name), SEGMENT_NAME_FORMAT, writer->first);
+    segments_path(path, sizeof(path), name);
+    int failed = writer->failed || writer->count == 0 || rename(writer->temporary, path) == -1;
+    if (failed) {
+        unlink(writer->temporary);
+    }
+    free_segment_writer(writer);
+    return failed ? -1 : 0;
+}
+
+// Turns a text part of history into a segment
+static int write_text_segment(const char *path, unsigned int first) {
+    FILE *file = open_cache_file(path, "r");
+    if (file == NULL) {
+        return -1;
+    }
+    struct SegmentWriter *writer = malloc(sizeof(struct SegmentWriter));
+    if (writer == NULL || begin_segment(writer, first) == -1) {
+        free(writer);
+        fclose(file);
+        return -1;
+    }
+    char *line = NULL;
+    size_t capacity = 0;
+    while (getline(&line, &capacity, file) != -1) {
+        line[strcspn(line, "\n")] = '\0';
+        add_segment_entry(writer, line);
+    }
+    free(line);
+    fclose(file);
+    // An empty part leaves no segment behind
+    int result = writer->count > 0 ? finish_segment(writer) : 0;
+    if (writer->count == 0) {
+        fclose(writer->file);
+        unlink(writer->temporary);
+        free_segment_writer(writer);
+    }
+    free(writer);
+    return result;
+}
+
+// Merges count segments starting at index into one, named after the first of them
+static int merge_segments(int index, int count) {
+    struct SegmentWriter *writer = malloc(sizeof(struct SegmentWriter));
+    if (writer == NULL || begin_segment(writer, segments[index].trailer.first) == -1) {
+        free(writer);
+        return -1;
+    }
+    for (int i = index; i < index + count && !writer->failed; i++) {
+        for (unsigned int number = segments[i].trailer.first; number <= segment_end(&segments[i]); number++) {
+            const char *command = segment_entry(&segments[i], number);
+            if (command == NULL) {
+                writer->failed = 1;
+                break;
+            }
+            add_segment_entry(writer, command);
+        }
+    }
+    if (finish_segment(writer) == -1) {
+        free(writer);
+        return -1;
+    }
+    free(writer);
+
+    for (int i = index + 1; i < index + count; i++) {
+        char path[MAX_PATH_LENGTH + 32];
+        segments_path(path, sizeof(path), segments[i].name);
+        unlink(path);
+    }
+    return 0;
+}
+
+// Size class of a segment: entries below HISTORY_MERGE_FANOUT times the hot limit are class 0,
+// each class up holds HISTORY_MERGE_FANOUT times more
+static int size_class(unsigned int count) {
+    int class = 0;
+    for (long long bound = (long long)history_hot_limit() * HISTORY_MERGE_FANOUT; count >= bound; bound *= HISTORY_MERGE_FANOUT) {
+        class++;
+    }
+    return class;
+}
+
+int compact_history(int full) {
+    int compact_fd = lock_segments(COMPACT_LOCK, full ? LOCK_EX : LOCK_EX | LOCK_NB);
+    if (compact_fd == -1) {
+        return -1;
+    }
+    segments_loaded = 0;
+    load_history_segments();
+    int result = 0;
+
+    // A move interrupted before its segment was written is finished first
+    if (rotating_name[0] != '\0') {
+        char path[MAX_PATH_LENGTH + 80];
+        segments_path(path, sizeof(path), rotating_name);
+        if (write_text_segment(path, rotating_first) == 0) {
+            unlink(path);
+        } else {
+            result = -1;
+        }
+        segments_loaded = 0;
+        load_history_segments();
+    }
+
+    // .history is renamed while no shell is appending to it, later appends create it again
+    long hot = count_file_lines(history_file);
+    if (result == 0 && hot > 0 && (full || hot >= history_hot_limit())) {
+        char name[64], path[MAX_PATH_LENGTH + 80];
+        snprintf(name, sizeof(name), ROTATING_PREFIX "%u", archived_end + 1);
+        segments_path(path, sizeof(path), name);
+        int append_fd = lock_segments(APPEND_LOCK, LOCK_EX);
+        int renamed = append_fd != -1 && rename(history_file, path) == 0;
+        unlock_history_append(append_fd);
+        if (renamed && write_text_segment(path, archived_end + 1) == 0) {
+            unlink(path);
+        } else {
+            result = -1;
+        }
+        segments_loaded = 0;
+        load_history_segments();
+    }
+
+    // The newest segments of one size class are merged until every class has fewer of them
+    while (result == 0 && total_segments > 1) {
+        int first = total_segments - HISTORY_MERGE_FANOUT;
+        if (full) {
+            first = 0;
+        } else {
+            if (first < 0) {
+                break;
+            }
+            int class = size_class(segments[first].trailer.count);
+            int same = 1;
+            for (int i = first + 1; i < total_segments; i++) {
+                same = same && size_class(segments[i].trailer.count) == class;
+            }
+            if (!same) {
+                break;
+            }
+        }
+        result = merge_segments(first, total_segments - first);
+        segments_loaded = 0;
+        load_history_segments();
+        if (full) {
+            break;
+        }
+    }
+
+    close(compact_fd);
+    return result;
+}
+
+void compact_history_in_background() {
+    // Shells only count their own entries, so the segments are checked before compacting
+    int limit = history_hot_limit();
+    if (total_commands - (int)archived_end < limit || total_commands - compaction_requested_at < limit / 4) {
+        return;
+    }
+    load_history_segments();
+    if (total_commands - (int)archived_end < limit) {
+        return;
+    }
+    compaction_requested_at = total_commands;
+
+    // The compacting process is orphaned at once, so nobody has to wait for it
+    pid_t pid = counted_fork();
+    if (pid == 0) {
+        if (fork() == 0) {
+            int null_fd = open("/dev/null", O_RDWR);
+            for (int i = 0; i < 3; i++) {
+                dup2(null_fd, i);
+            }
+            compact_history(0);
+        }
+        _exit(EXIT_SUCCESS);
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+int clear_history() {
+    int compact_fd = lock_segments(COMPACT_LOCK, LOCK_EX);
+    int append_fd = lock_segments(APPEND_LOCK, LOCK_EX);
+    segments_loaded = 0;
+    load_history_segments();
+
+    int result = 0;
+    for (int i = 0; i < total_segments; i++) {
+        char path[MAX_PATH_LENGTH + 32];
+        segments_path(path, sizeof(path), segments[i].name);
+        unlink(path);
+    }
+    if (rotating_name[0] != '\0') {
+        char path[MAX_PATH_LENGTH + 80];
+        segments_path(path, sizeof(path), rotating_name);
+        unlink(path);
+    }
+    FILE *file = open_cache_file(history_file, "w");
+    if (file == NULL) {
+        result = -1;
+    } else {
+        fclose(file);
+    }
+    segments_loaded = 0;
+    archived_end = 0;
+    total_segments = 0;
+    compaction_requested_at = 0;
+
+    unlock_history_append(append_fd);
+    if (compact_fd != -1) {
+        close(compact_fd);
+    }
+    return result;
+}
+
+void print_history_segments() {
+    load_history_segments();
+    printf("%10s %10s %10s %10s %12s  %s\n", "first", "last", "entries", "distinct", "bytes", "part");
+    long long total_bytes = 0;
+    for (int i = 0; i < total_segments; i++) {
+        const struct SegmentTrailer *trailer = &segments[i].trailer;
+        printf("%10u %10u %10u %10u %12lld  %s\n", trailer->first, segment_end(&segments[i]), trailer->count, trailer->distinct,
+               (long long)segments[i].size, segments[i].name);
+        total_bytes += segments[i].size;
+    }
+
+    struct stat st;
+    long hot = count_file_lines(history_file);
+    if (hot > 0 && stat(history_file, &st) == 0) {
+        printf("%10u %10u %10ld %10s %12lld  %s\n", archived_end + 1, archived_end + (unsigned int)hot, hot, "-", (long long)st.st_size,
+               ".history");
+        total_bytes += st.st_size;
+    }
+    printf("%lld bytes on disk for %u entries\n", total_bytes, archived_end + (unsigned int)hot);
+}
@@ -0,0 +1,547 @@
+#define _GNU_SOURCE // For accept4(), MSG_CMSG_CLOEXEC and struct ucred
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "headers.h"
+
+#define SERVER_SESSION 'S'
+#define SERVER_STOP 'Q'
+
+extern char **environ;
+
+// First message of a connection, a session request carries the terminal descriptors along
+struct ServerRequest {
+    char kind;                  // SERVER_SESSION or SERVER_STOP, a client asking for a session gave its terminal up
+    unsigned int length;        // Bytes of "cwd\0NAME=value\0...\0" following the message
+};
+
+// A session forked by the server, it reports changes of the cache through notify_fd
+struct ServedSession {
+    pid_t pid;
+    int notify_fd;
+};
+
+static int listen_fd = -1;
+static struct ServedSession served_sessions[MAX_SERVER_SESSIONS];
+static int total_served_sessions = 0;
+
+static int session_connection = -1; // In a session, the connection of its client
+static int session_notify_fd = -1;  // In a session, the pipe read by the server
+static int notified_total_commands = 0;
+
+static volatile sig_atomic_t pending_signal = 0;
+
+
+static void wake_server(int signal_number) {
+    (void)signal_number; // Only interrupts poll(), exited sessions are reaped in the loop
+}
+
+static void record_signal(int signal_number) {
+    pending_signal = signal_number;
+}
+
+static int connect_to_server() {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(server_socket_file) >= sizeof(address.sun_path)) {
+        return -1;
+    }
+    strcpy(address.sun_path, server_socket_file);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int send_request(int fd, const struct ServerRequest *request, const int *fds, int count) {
+    struct iovec part = {(void *)request, sizeof(*request)};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    if (count > 0) {
+        memset(control, 0, sizeof(control));
+        message.msg_control = control;
+        message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds, count * sizeof(int));
+    }
+    return sendmsg(fd, &message, MSG_NOSIGNAL) == (ssize_t)sizeof(*request) ? 0 : -1;
+}
+
+// Reads the request and the terminal descriptors, fds are -1 if none came along
+static int receive_request(int fd, struct ServerRequest *request, int fds[3]) {
+    struct iovec part = {request, sizeof(*request)};
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    fds[0] = fds[1] = fds[2] = -1;
+    ssize_t length;
+    do {
+        length = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    } while (length == -1 && errno == EINTR);
+    if (length != (ssize_t)sizeof(*request)) {
+        return -1;
+    }
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header != NULL && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS &&
+        header->cmsg_len == CMSG_LEN(3 * sizeof(int))) {
+        memcpy(fds, CMSG_DATA(header), 3 * sizeof(int));
+    }
+    return 0;
+}
+
+static int read_fully(int fd, char *data, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t bytes_read = read(fd, data + done, length - done);
+        if (bytes_read <= 0) {
+            if (bytes_read == -1 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        done += bytes_read;
+    }
+    return 0;
+}
+
+// Turns the forked child into the session of the client: its terminal, directory and variables
+static void become_session(int connection, int notify_fd, const struct ServerRequest *request, int fds[3]) {
+    char *payload = malloc(request->length + 1);
+    if (payload == NULL || read_fully(connection, payload, request->length) == -1) {
+        exit(EXIT_FAILURE);
+    }
+    payload[request->length] = '\0';
+
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+
+    // With the terminal taken over, Ctrl-C and /dev/tty work as in a shell started directly
+    setsid();
+    ioctl(STDIN_FILENO, TIOCSCTTY, 0);
+
+    // "cwd\0" is followed by the environment of the client, which stays in payload for good
+    char *cwd = payload;
+    int count = 0;
+    for (char *entry = cwd + strlen(cwd) + 1; entry < payload + request->length && *entry != '\0'; entry += strlen(entry) + 1) {
+        count++;
+    }
+    char **client_environment = malloc((count + 1) * sizeof(char *));
+    if (client_environment == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    count = 0;
+    for (char *entry = cwd + strlen(cwd) + 1; entry < payload + request->length && *entry != '\0'; entry += strlen(entry) + 1) {
+        client_environment[count++] = entry;
+    }
+    client_environment[count] = NULL;
+    environ = client_environment;
+    initialize_variables();
+    if (chdir(cwd) == -1) {
+        perror(cwd);
+    }
+
+    session_connection = connection;
+    session_notify_fd = notify_fd;
+    notified_total_commands = total_commands;
+    cache_files_written = 0;
+    cache_files_truncated = 0;
+    dprintf(session_connection, "P %d\n", (int)getpid());
+
+    printf("Welcome to GoGiShell!\n");
+    printf("Please read the GoGiShell manual by printing 'help'\n");
+    printf("\n");
+}
+
+// Returns 1 in the forked session, 0 in the server
+static int accept_session(int connection) {
+    // A session runs with the rights of the server, so only its own user may attach or stop it
+    struct ucred peer;
+    socklen_t peer_length = sizeof(peer);
+    if (getsockopt(connection, SOL_SOCKET, SO_PEERCRED, &peer, &peer_length) == -1 || peer.uid != getuid()) {
+        close(connection);
+        return 0;
+    }
+
+    struct ServerRequest request;
+    int fds[3];
+    if (receive_request(connection, &request, fds) == -1) {
+        close(connection);
+        return 0;
+    }
+    if (request.kind == SERVER_STOP) {
+        unlink(server_socket_file);
+        close(connection); // The client waits for this
+        exit(EXIT_SUCCESS);
+    }
+    if (request.kind != SERVER_SESSION || fds[0] == -1 || total_served_sessions == MAX_SERVER_SESSIONS) {
+        for (int i = 0; i < 3; i++) {
+            if (fds[i] != -1) {
+                close(fds[i]);
+            }
+        }
+        close(connection);
+        return 0;
+    }
+
+    int notify_fds[2];
+    if (pipe2(notify_fds, O_CLOEXEC) == -1) {
+        perror("Internal function pipe failed");
+        notify_fds[0] = notify_fds[1] = -1;
+    }
+    pid_t pid = counted_fork();
+    if (pid == 0) {
+        // The session keeps nothing of the server but its state
+        signal(SIGCHLD, SIG_DFL);
+        close(listen_fd);
+        for (int i = 0; i < total_served_sessions; i++) {
+            close(served_sessions[i].notify_fd);
+        }
+        if (notify_fds[0] != -1) {
+            close(notify_fds[0]);
+        }
+        become_session(connection, notify_fds[1], &request, fds);
+        return 1;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        close(fds[i]);
+    }
+    close(connection);
+    if (notify_fds[1] != -1) {
+        close(notify_fds[1]);
+    }
+    if (pid > 0 && notify_fds[0] != -1) {
+        served_sessions[total_served_sessions].pid = pid;
+        served_sessions[total_served_sessions].notify_fd = notify_fds[0];
+        total_served_sessions++;
+    } else if (notify_fds[0] != -1) {
+        close(notify_fds[0]);
+    }
+    return 0;
+}
+
+// Applies the changes a session made, so the next sessions start with them without reading the files
+static void apply_notification(const char *line) {
+    int value;
+    if (sscanf(line, "history =%d", &value) == 1) {
+        total_commands = value;
+    } else if (sscanf(line, "history +%d", &value) == 1) {
+        total_commands += value;
+    } else if (strcmp(line, "abbreviations") == 0) {
+        get_total_abbreviations();
+    } else if (strcmp(line, "functions") == 0) {
+        reload_functions();
+    }
+}
+
+// Returns -1 once the session has exited
+static int read_notifications(int fd) {
+    char buffer[4096];
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    if (length <= 0) {
+        return length == -1 && errno == EINTR ? 0 : -1;
+    }
+    // Every notification is a single write() shorter than PIPE_BUF, so lines never split
+    buffer[length] = '\0';
+    for (char *line = strtok(buffer, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+        apply_notification(line);
+    }
+    return 0;
+}
+
+// Runs until a stop request, returns only in the forked sessions
+static void serve_sessions() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wake_server;
+    action.sa_flags = SA_RESTART; // poll() still returns early, reading a request does not
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGCHLD, &action, NULL);
+
+    struct pollfd pollfds[MAX_SERVER_SESSIONS + 1];
+    while (1) {
+        while (waitpid(-1, NULL, WNOHANG) > 0) {
+        }
+        pollfds[0].fd = listen_fd;
+        pollfds[0].events = POLLIN;
+        for (int i = 0; i < total_served_sessions; i++) {
+            pollfds[i + 1].fd = served_sessions[i].notify_fd;
+            pollfds[i + 1].events = POLLIN;
+        }
+        if (poll(pollfds, total_served_sessions + 1, -1) == -1) {
+            continue;
+        }
+
+        for (int i = total_served_sessions - 1; i >= 0; i--) {
+            if (pollfds[i + 1].revents != 0 && read_notifications(served_sessions[i].notify_fd) == -1) {
+                close(served_sessions[i].notify_fd);
+                served_sessions[i] = served_sessions[--total_served_sessions];
+            }
+        }
+        if (pollfds[0].revents & POLLIN) {
+            int connection = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (connection != -1 && accept_session(connection)) {
+                return;
+            }
+        }
+    }
+}
+
+void start_server() {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(server_socket_file) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Server socket path is too long: %s\n", server_socket_file);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, server_socket_file);
+
+    // A socket left behind by a server that died is replaced, a running server is not
+    int probe = connect_to_server();
+    if (probe != -1) {
+        close(probe);
+        fprintf(stderr, "GoGiShell server is already running for %s\n", cache_dir);
+        exit(EXIT_FAILURE);
+    }
+    unlink(server_socket_file);
+
+    // Other users can't even connect, the socket is created with mode 0600
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t previous_umask = umask(0077);
+    int bound = listen_fd != -1 && bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == 0;
+    umask(previous_umask);
+    if (!bound || listen(listen_fd, 64) == -1) {
+        perror("Failed to create the server socket");
+        exit(EXIT_FAILURE);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("Internal function fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if (pid > 0) {
+        printf("GoGiShell server started with pid %d, new shells attach through %s\n", (int)pid, server_socket_file);
+        exit(EXIT_SUCCESS);
+    }
+
+    // Detached from the terminal it was started in
+    setsid();
+    if (chdir("/") == -1) {
+        perror("Internal function chdir failed");
+    }
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+    }
+    serve_sessions();
+}
+
+int stop_server() {
+    int fd = connect_to_server();
+    if (fd == -1) {
+        printf("GoGiShell server is not running\n");
+        return 1;
+    }
+    struct ServerRequest request = {SERVER_STOP, 0};
+    char ch;
+    if (send_request(fd, &request, NULL, 0) == -1 || read(fd, &ch, 1) != 0) {
+        perror("Failed to stop the server");
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    printf("GoGiShell server stopped\n");
+    return 0;
+}
+
+// Takes the terminal back after the server turned the session down, the shell starts on its own then
+static void reclaim_terminal(const struct sigaction *previous_actions, const int *signals, size_t total_signals) {
+    ioctl(STDIN_FILENO, TIOCSCTTY, 0);
+    for (size_t i = 0; i < total_signals; i++) {
+        sigaction(signals[i], &previous_actions[i], NULL);
+    }
+}
+
+int attach_to_server(int *exit_code) {
+    // Only a session leader can hand its controlling terminal over. A session without one can't
+    // open /dev/tty, which less, sudo or ssh need, so any other shell starts on its own
+    struct termios original_termios;
+    if (tcgetattr(STDIN_FILENO, &original_termios) == -1 || getsid(0) != getpid()) {
+        return -1;
+    }
+    int fd = connect_to_server();
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct Buffer payload = {0};
+    char cwd[MAX_PATH_LENGTH];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "/");
+    }
+    buffer_append(&payload, cwd, strlen(cwd) + 1);
+    for (char **entry = environ; *entry != NULL; entry++) {
+        buffer_append(&payload, *entry, strlen(*entry) + 1);
+    }
+    buffer_append_char(&payload, '\0');
+
+    // Giving the terminal up hangs up its foreground process group, this process included.
+    // Signals of the terminal reach only this process afterwards, they are forwarded to the session
+    int forwarded_signals[] = {SIGINT, SIGQUIT, SIGTERM, SIGHUP, SIGWINCH, SIGTSTP, SIGCONT};
+    size_t total_signals = sizeof(forwarded_signals) / sizeof(forwarded_signals[0]);
+    struct sigaction previous_actions[sizeof(forwarded_signals) / sizeof(forwarded_signals[0])];
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = record_signal;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < total_signals; i++) {
+        sigaction(forwarded_signals[i], &action, &previous_actions[i]);
+    }
+    if (ioctl(STDIN_FILENO, TIOCNOTTY) == -1) {
+        for (size_t i = 0; i < total_signals; i++) {
+            sigaction(forwarded_signals[i], &previous_actions[i], NULL);
+        }
+        buffer_free(&payload);
+        close(fd);
+        return -1;
+    }
+    pending_signal = 0;
+
+    struct ServerRequest request = {SERVER_SESSION, payload.length};
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    if (send_request(fd, &request, fds, 3) == -1 || write(fd, payload.data, payload.length) != (ssize_t)payload.length) {
+        buffer_free(&payload);
+        close(fd);
+        reclaim_terminal(previous_actions, forwarded_signals, total_signals);
+        return -1;
+    }
+    buffer_free(&payload);
+
+    pid_t session = -1;
+    int last_signal = 0;
+    *exit_code = -1;
+    char line[64];
+    size_t length = 0;
+    while (*exit_code == -1) {
+        if (pending_signal != 0) {
+            int signal_number = pending_signal;
+            pending_signal = 0;
+            if (session > 0 && signal_number == SIGTSTP) {
+                // The whole session stops together with this process, and continues with it
+                kill(-session, SIGSTOP);
+                raise(SIGSTOP);
+            } else if (session > 0) {
+                kill(-session, signal_number);
+                last_signal = signal_number != SIGWINCH && signal_number != SIGCONT ? signal_number : last_signal;
+            }
+        }
+
+        char ch;
+        ssize_t bytes_read = read(fd, &ch, 1);
+        if (bytes_read == -1 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0 && session == -1) {
+            // Turned down before a session was forked, e.g. with MAX_SERVER_SESSIONS of them running
+            close(fd);
+            reclaim_terminal(previous_actions, forwarded_signals, total_signals);
+            return -1;
+        }
+        if (bytes_read <= 0) {
+            // The session died without saying goodbye, e.g. killed by a signal
+            *exit_code = last_signal != 0 ? 128 + last_signal : 1;
+            break;
+        }
+        if (ch != '\n' && length < sizeof(line) - 1) {
+            line[length++] = ch;
+            continue;
+        }
+        line[length] = '\0';
+        length = 0;
+        int value;
+        if (sscanf(line, "P %d", &value) == 1) {
+            session = value;
+        } else if (sscanf(line, "X %d", &value) == 1) {
+            *exit_code = value;
+        }
+    }
+    close(fd);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &original_termios);
+    return 0;
+}
+
+void notify_server() {
+    if (session_notify_fd == -1) {
+        return;
+    }
+    char message[256];
+    int length = 0;
+    if (cache_files_truncated & (1 << CACHE_HISTORY)) {
+        length += snprintf(message + length, sizeof(message) - length, "history =%d\n", total_commands);
+    } else if (total_commands != notified_total_commands) {
+        length += snprintf(message + length, sizeof(message) - length, "history +%d\n", total_commands - notified_total_commands);
+    }
+    if (cache_files_written & (1 << CACHE_ABBREVIATION)) {
+        length += snprintf(message + length, sizeof(message) - length, "abbreviations\n");
+    }
+    if (cache_files_written & (1 << CACHE_FUNCTIONS)) {
+        length += snprintf(message + length, sizeof(message) - length, "functions\n");
+    }
+    if (length > 0 && write(session_notify_fd, message, length) != length) {
+        close(session_notify_fd);
+        session_notify_fd = -1;
+    }
+    notified_total_commands = total_commands;
+    cache_files_written = 0;
+    cache_files_truncated = 0;
+}
+
+void finish_session(int exit_code) {
+    if (session_connection == -1) {
+        return;
+    }
+    fflush(stdout);
+    dprintf(session_connection, "X %d\n", exit_code);
+    close(session_connection);
+    session_connection = -1;
+}
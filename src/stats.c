@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "headers.h"
+
+// Resources of every child reaped by wait_for_child(), summed up (max RSS is the maximum)
+static struct rusage children_usage;
+
+
+static void add_usage(struct rusage *total, const struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+pid_t wait_for_child_usage(pid_t pid, int *status, struct rusage *usage) {
+    // usage, if not NULL, receives the resources of this child alone
+    struct rusage local_usage;
+    int local_status;
+
+    if (usage == NULL) {
+        usage = &local_usage;
+    }
+    pid_t result = wait4(pid, status != NULL ? status : &local_status, 0, usage);
+    if (result > 0) {
+        add_usage(&children_usage, usage);
+    }
+    return result;
+}
+
+pid_t wait_for_child(pid_t pid, int *status) {
+    return wait_for_child_usage(pid, status, NULL);
+}
+
+void begin_command_stats(struct CommandStats *stats) {
+    clock_gettime(CLOCK_MONOTONIC, &stats->start);
+    stats->started_at = time(NULL);
+    getrusage(RUSAGE_SELF, &stats->start_self);
+    stats->start_children = children_usage;
+
+    // Max RSS can't be subtracted, so it restarts for this command and is merged back at the end
+    stats->outer_maxrss = children_usage.ru_maxrss;
+    children_usage.ru_maxrss = 0;
+}
+
+void end_command_stats(struct CommandStats *stats) {
+    struct timespec end;
+    struct rusage self;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &self);
+
+    stats->wall_ns = (long long)(end.tv_sec - stats->start.tv_sec) * 1000000000LL + (end.tv_nsec - stats->start.tv_nsec);
+    stats->exit_code = last_status;
+
+    // Children reaped during the command plus the work done inside the shell itself (builtins)
+    struct rusage *usage = &stats->usage;
+    memset(usage, 0, sizeof(*usage));
+    timersub(&children_usage.ru_utime, &stats->start_children.ru_utime, &usage->ru_utime);
+    timersub(&children_usage.ru_stime, &stats->start_children.ru_stime, &usage->ru_stime);
+    usage->ru_nvcsw = children_usage.ru_nvcsw - stats->start_children.ru_nvcsw;
+    usage->ru_nivcsw = children_usage.ru_nivcsw - stats->start_children.ru_nivcsw;
+    usage->ru_maxrss = children_usage.ru_maxrss;
+
+    struct timeval self_time;
+    timersub(&self.ru_utime, &stats->start_self.ru_utime, &self_time);
+    timeradd(&usage->ru_utime, &self_time, &usage->ru_utime);
+    timersub(&self.ru_stime, &stats->start_self.ru_stime, &self_time);
+    timeradd(&usage->ru_stime, &self_time, &usage->ru_stime);
+    usage->ru_nvcsw += self.ru_nvcsw - stats->start_self.ru_nvcsw;
+    usage->ru_nivcsw += self.ru_nivcsw - stats->start_self.ru_nivcsw;
+
+    if (stats->outer_maxrss > children_usage.ru_maxrss) {
+        children_usage.ru_maxrss = stats->outer_maxrss;
+    }
+}
+
+static long timeval_to_us(const struct timeval *tv) {
+    return tv->tv_sec * 1000000L + tv->tv_usec;
+}
+
+void print_command_stats(const struct CommandStats *stats) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "real\t%.3fs\n", stats->wall_ns / 1e9);
+    fprintf(stderr, "user\t%.3fs\n", timeval_to_us(&stats->usage.ru_utime) / 1e6);
+    fprintf(stderr, "sys\t%.3fs\n", timeval_to_us(&stats->usage.ru_stime) / 1e6);
+    fprintf(stderr, "maxrss\t%ld KB\n", stats->usage.ru_maxrss);
+    fprintf(stderr, "ctxsw\t%ld voluntary, %ld involuntary\n", stats->usage.ru_nvcsw, stats->usage.ru_nivcsw);
+    fprintf(stderr, "exit\t%d\n", stats->exit_code);
+}
+
+void fulfil_history_stats_file(const char *command, const struct CommandStats *stats) {
+    FILE *file = open_cache_file(history_stats_file, "a");
+    if (file == NULL) {
+        perror("Failed to create or open .history_stats");
+        return;
+    }
+
+    char cwd[MAX_PATH_LENGTH];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "?");
+    }
+
+    // history number, start time, wall ns, user us, sys us, max RSS KB, voluntary and involuntary
+    // context switches, exit code, directory and the command itself, separated by tabs
+    fprintf(file, "%d\t%ld\t%lld\t%ld\t%ld\t%ld\t%ld\t%ld\t%d\t%s\t%.*s\n",
+            total_commands, (long)stats->started_at, stats->wall_ns,
+            timeval_to_us(&stats->usage.ru_utime), timeval_to_us(&stats->usage.ru_stime),
+            stats->usage.ru_maxrss, stats->usage.ru_nvcsw, stats->usage.ru_nivcsw,
+            stats->exit_code, cwd, (int)strcspn(command, "\n"), command);
+    fclose(file);
+}
+
+// One parsed line of .history_stats
+struct HistoryStat {
+    int number;
+    long started_at;
+    long long wall_ns;
+    long user_us;
+    long sys_us;
+    long maxrss;
+    int exit_code;
+    char *cwd;
+    char *command;
+};
+
+static int parse_history_stat(char *line, struct HistoryStat *stat) {
+    long nvcsw, nivcsw;
+    int consumed = 0;
+
+    if (sscanf(line, "%d\t%ld\t%lld\t%ld\t%ld\t%ld\t%ld\t%ld\t%d\t%n", &stat->number, &stat->started_at, &stat->wall_ns,
+               &stat->user_us, &stat->sys_us, &stat->maxrss, &nvcsw, &nivcsw, &stat->exit_code, &consumed) != 9 ||
+        consumed == 0) {
+        return -1;
+    }
+
+    stat->cwd = line + consumed;
+    char *tab = strchr(stat->cwd, '\t');
+    if (tab == NULL) {
+        return -1;
+    }
+    *tab = '\0';
+    stat->command = tab + 1;
+    stat->command[strcspn(stat->command, "\n")] = '\0';
+    return 0;
+}
+
+static long parse_age(const char *text) {
+    // "30m", "24h", "7d" or plain seconds; -1 if malformed
+    char *end;
+    long value = strtol(text, &end, 10);
+    if (end == text || value < 0) {
+        return -1;
+    }
+    if (*end == '\0' || strcmp(end, "s") == 0) {
+        return value;
+    }
+    if (strcmp(end, "m") == 0) {
+        return value * 60;
+    }
+    if (strcmp(end, "h") == 0) {
+        return value * 3600;
+    }
+    if (strcmp(end, "d") == 0) {
+        return value * 86400;
+    }
+    if (strcmp(end, "w") == 0) {
+        return value * 604800;
+    }
+    return -1;
+}
+
+static int compare_stats_by_wall(const void *a, const void *b) {
+    long long wall_a = ((const struct HistoryStat *)a)->wall_ns;
+    long long wall_b = ((const struct HistoryStat *)b)->wall_ns;
+    return (wall_a < wall_b) - (wall_a > wall_b); // Descending order
+}
+
+static int compare_walls(const void *a, const void *b) {
+    long long wall_a = *(const long long *)a;
+    long long wall_b = *(const long long *)b;
+    return (wall_a < wall_b) - (wall_a > wall_b); // Descending order
+}
+
+static long long percentile(const long long *sorted_descending, int count, int p) {
+    // Nearest-rank percentile of wall times sorted in descending order
+    int rank = (p * count + 99) / 100;
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted_descending[count - rank];
+}
+
+static void print_hstat_usage() {
+    printf("Usage: hstat [-s <age>] [-c]\n\thstat slowest [<count>] [-s <age>] [-c]\n\thstat <command> [-s <age>] [-c]\n");
+    printf("\t<age> is like 30m, 24h or 7d, -c keeps only commands run in the current directory\n");
+}
+
+void hstat(char *args[]) {
+    long max_age = -1;
+    int current_directory_only = 0;
+    int slowest = 0;
+    long slowest_count = 20;
+    char command[MAX_INPUT_LENGTH] = "";
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-s") == 0) {
+            if (args[i + 1] == NULL || (max_age = parse_age(args[i + 1])) == -1) {
+                print_hstat_usage();
+                last_status = 1;
+                return;
+            }
+            i++;
+        } else if (strcmp(args[i], "-c") == 0) {
+            current_directory_only = 1;
+        } else if (i == 1 && strcmp(args[i], "slowest") == 0) {
+            slowest = 1;
+            if (args[i + 1] != NULL && args[i + 1][0] != '-') {
+                slowest_count = strtol(args[++i], NULL, 10);
+                if (slowest_count <= 0) {
+                    print_hstat_usage();
+                    last_status = 1;
+                    return;
+                }
+            }
+        } else if (!slowest) {
+            // The remaining words form the command line to look for
+            if (command[0] != '\0') {
+                strncat(command, " ", sizeof(command) - strlen(command) - 1);
+            }
+            strncat(command, args[i], sizeof(command) - strlen(command) - 1);
+        } else {
+            print_hstat_usage();
+            last_status = 1;
+            return;
+        }
+    }
+
+    FILE *file = open_cache_file(history_stats_file, "r");
+    if (file == NULL) {
+        printf("No statistics recorded yet.\n");
+        return;
+    }
+
+    char cwd[MAX_PATH_LENGTH];
+    if (current_directory_only && getcwd(cwd, sizeof(cwd)) == NULL) {
+        perror("Internal function getcwd failed");
+        fclose(file);
+        return;
+    }
+    time_t now = time(NULL);
+
+    // The file is streamed: the summary keeps only the wall time of every matching run,
+    // slowest only the slowest runs seen so far
+    struct HistoryStat *stats = NULL;
+    long long *walls = NULL;
+    int count = 0, capacity = 0, kept = 0;
+    long long total_wall = 0;
+    long total_user = 0, total_sys = 0, max_rss = 0;
+    int failures = 0;
+    char line[MAX_INPUT_LENGTH + MAX_PATH_LENGTH + 128];
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        struct HistoryStat stat;
+        if (parse_history_stat(line, &stat) == -1) {
+            continue;
+        }
+        if (max_age != -1 && now - stat.started_at > max_age) {
+            continue;
+        }
+        if (current_directory_only && strcmp(stat.cwd, cwd) != 0) {
+            continue;
+        }
+        if (command[0] != '\0' && strcmp(stat.command, command) != 0) {
+            continue;
+        }
+
+        if (slowest) {
+            // Once slowest_count runs are kept, a slower run replaces the fastest of them
+            int slot = kept;
+            if (kept == slowest_count) {
+                slot = 0;
+                for (int i = 1; i < kept; i++) {
+                    if (stats[i].wall_ns < stats[slot].wall_ns) {
+                        slot = i;
+                    }
+                }
+                if (stats[slot].wall_ns >= stat.wall_ns) {
+                    count++;
+                    continue;
+                }
+                free(stats[slot].cwd);
+                free(stats[slot].command);
+            } else if (kept == capacity) {
+                capacity = capacity == 0 ? 32 : capacity * 2;
+                struct HistoryStat *grown = realloc(stats, capacity * sizeof(struct HistoryStat));
+                if (grown == NULL) {
+                    perror("Failed to allocate memory");
+                    break;
+                }
+                stats = grown;
+            }
+            stat.cwd = strdup(stat.cwd);
+            stat.command = strdup(stat.command);
+            stats[slot] = stat;
+            kept += slot == kept;
+        } else {
+            if (count == capacity) {
+                capacity = capacity == 0 ? 256 : capacity * 2;
+                long long *grown = realloc(walls, capacity * sizeof(long long));
+                if (grown == NULL) {
+                    perror("Failed to allocate memory");
+                    break;
+                }
+                walls = grown;
+            }
+            walls[count] = stat.wall_ns;
+            total_wall += stat.wall_ns;
+            total_user += stat.user_us;
+            total_sys += stat.sys_us;
+            if (stat.maxrss > max_rss) {
+                max_rss = stat.maxrss;
+            }
+            if (stat.exit_code != 0) {
+                failures++;
+            }
+        }
+        count++;
+    }
+    fclose(file);
+
+    if (count == 0) {
+        printf("No matching commands.\n");
+        return;
+    }
+
+    if (slowest) {
+        qsort(stats, kept, sizeof(struct HistoryStat), compare_stats_by_wall);
+        for (int i = 0; i < kept; i++) {
+            printf("%10.3fs  %5d  [%d]  %s  (%s)\n", stats[i].wall_ns / 1e9, stats[i].number, stats[i].exit_code,
+                   stats[i].command, stats[i].cwd);
+        }
+    } else {
+        qsort(walls, count, sizeof(long long), compare_walls);
+        printf("runs\t%d (%d failed)\n", count, failures);
+        printf("mean\t%.3fs\n", total_wall / 1e9 / count);
+        printf("p50\t%.3fs\n", percentile(walls, count, 50) / 1e9);
+        printf("p95\t%.3fs\n", percentile(walls, count, 95) / 1e9);
+        printf("p99\t%.3fs\n", percentile(walls, count, 99) / 1e9);
+        printf("max\t%.3fs\n", walls[0] / 1e9);
+        printf("user\t%.3fs mean\n", total_user / 1e6 / count);
+        printf("sys\t%.3fs mean\n", total_sys / 1e6 / count);
+        printf("maxrss\t%ld KB\n", max_rss);
+        free(walls);
+    }
+
+    for (int i = 0; i < kept; i++) {
+        free(stats[i].cwd);
+        free(stats[i].command);
+    }
+    free(stats);
+}
@@ -0,0 +1,239 @@
+#define _GNU_SOURCE // For memfd_create()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "headers.h"
+
+
+const char *skip_substitution(const char *p) {
+    // p points to "$(", returns the position right after the matching ')' or NULL
+    int depth = 0;
+
+    p++;
+    while (*p != '\0') {
+        if (*p == '\\' && p[1] != '\0') {
+            p += 2;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            p = skip_quoted(p);
+        } else if (*p == '(') {
+            depth++;
+            p++;
+        } else if (*p == ')') {
+            depth--;
+            p++;
+            if (depth == 0) {
+                return p;
+            }
+        } else {
+            p++;
+        }
+    }
+    return NULL;
+}
+
+void free_capture(struct Capture *capture) {
+    if (capture->mapped_length != 0) {
+        munmap(capture->data, capture->mapped_length);
+    } else {
+        free(capture->data);
+    }
+    capture->data = NULL;
+    capture->length = 0;
+    capture->mapped_length = 0;
+}
+
+// Maps the whole memfd privately, so words can be cut in place without copying the output
+static void map_capture(int fd, struct Capture *capture) {
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size <= 0) {
+        return;
+    }
+
+    // One extra byte keeps room for the terminating '\0' of the last word
+    if (ftruncate(fd, size + 1) == -1) {
+        perror("Internal function ftruncate failed");
+        return;
+    }
+    void *data = mmap(NULL, size + 1, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        perror("Internal function mmap failed");
+        return;
+    }
+    capture->data = data;
+    capture->length = size;
+    capture->mapped_length = size + 1;
+}
+
+// Returns the GoGiShell command the input consists of, if it can run inside the shell process
+static struct Command *find_capturable_command(const char *command) {
+    const char *start = command;
+    while (*start == ' ' || *start == '\t' || *start == '\n') {
+        start++;
+    }
+    size_t length = strcspn(start, " \t\n");
+
+    // Anything more than plain words (pipes, quotes, redirections, expansions) goes to a child
+    if (strpbrk(start, "|<>;'\"`$\\") != NULL) {
+        return NULL;
+    }
+    struct Command *gogi_command = find_gogi_command(start, length);
+    if (gogi_command == NULL || !gogi_command->capturable) {
+        return NULL;
+    }
+    return gogi_command;
+}
+
+static int capture_builtin(struct Command *gogi_command, const char *command, struct Capture *capture) {
+    int fd = memfd_create("gogishell-capture", MFD_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+
+    struct Words words;
+    if (parse_input(command, &words) == -1) {
+        close(fd);
+        last_status = 2;
+        return 0;
+    }
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (saved_stdout == -1) {
+        perror("Internal function dup failed");
+        free_words(&words);
+        close(fd);
+        return -1;
+    }
+    dup2(fd, STDOUT_FILENO);
+
+    last_status = 0;
+    gogi_command->function(words.argv);
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    free_words(&words);
+
+    map_capture(fd, capture);
+    close(fd);
+    return 0;
+}
+
+int capture_command(const char *command, struct Capture *capture) {
+    capture->data = NULL;
+    capture->length = 0;
+    capture->mapped_length = 0;
+
+    // Builtins such as history or home are evaluated without forking
+    struct Command *gogi_command = find_capturable_command(command);
+    if (gogi_command != NULL && capture_builtin(gogi_command, command, capture) == 0) {
+        return 0;
+    }
+
+    int pipe_fds[2];
+    if (pipe(pipe_fds) == -1) {
+        perror("Internal function pipe failed");
+        return -1;
+    }
+
+    fflush(stdout);
+    pid_t pid = counted_fork();
+    if (pid == 0) {
+        close(pipe_fds[0]);
+        dup2(pipe_fds[1], STDOUT_FILENO);
+        close(pipe_fds[1]);
+
+        char *line = strdup(command);
+        if (line == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        execute_input(line);
+        fflush(stdout);
+        exit(last_status);
+    } else if (pid < 0) {
+        perror("Internal function fork failed");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+    close(pipe_fds[1]);
+
+    // Read straight into the spare capacity of the buffer, it is handed over as is
+    struct Buffer output = {NULL, 0, 0};
+    while (1) {
+        buffer_reserve(&output, 4096);
+        ssize_t bytes_read = read(pipe_fds[0], output.data + output.length, output.capacity - output.length - 1);
+        if (bytes_read <= 0) {
+            break;
+        }
+        output.length += bytes_read;
+    }
+    output.data[output.length] = '\0';
+    close(pipe_fds[0]);
+
+    int status;
+    if (wait_for_child(pid, &status) == -1) {
+        perror("Internal function waitpid failed");
+    } else {
+        last_status = status_to_exit_code(status);
+    }
+
+    capture->data = output.data;
+    capture->length = output.length;
+    return 0;
+}
+
+int start_process_substitution(const char *command, int output, pid_t *pid) {
+    // Returns the shell's end of the pipe; it stays close-on-exec until passed to a command
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        perror("Internal function pipe failed");
+        return -1;
+    }
+
+    fflush(stdout);
+    *pid = counted_fork();
+    if (*pid == 0) {
+        // <(command) writes into the pipe, >(command) reads from it
+        if (output) {
+            dup2(pipe_fds[0], STDIN_FILENO);
+        } else {
+            dup2(pipe_fds[1], STDOUT_FILENO);
+        }
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+
+        char *line = strdup(command);
+        if (line == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        execute_input(line);
+        fflush(stdout);
+        exit(last_status);
+    } else if (*pid < 0) {
+        perror("Internal function fork failed");
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return -1;
+    }
+
+    if (output) {
+        close(pipe_fds[0]);
+        return pipe_fds[1];
+    }
+    close(pipe_fds[1]);
+    return pipe_fds[0];
+}
+
+void pass_process_substitutions(struct Words *words) {
+    // Called in the child right before exec, so /dev/fd/N stays valid in the new program
+    for (int i = 0; i < words->num_process_substitutions; i++) {
+        fcntl(words->process_substitutions[i].fd, F_SETFD, 0);
+    }
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "headers.h"
+
+// One finished phase; the name is copied, a function it names may be unset before the dump
+struct TraceEvent {
+    char name[TRACE_NAME_LENGTH];
+    long long start_ns;
+    long long duration_ns;
+};
+
+int tracing = 0;
+
+static struct TraceEvent *trace_ring = NULL;
+static size_t trace_next = 0;      // Slot the next event is written to
+static size_t trace_recorded = 0;  // Events recorded since the ring was allocated, may exceed its size
+
+
+long long trace_begin() {
+    // 0 means the phase isn't traced, so trace_end() stays a single comparison when tracing is off
+    return tracing ? monotonic_ns() : 0;
+}
+
+void trace_end(const char *name, long long start_ns) {
+    if (start_ns == 0 || !tracing) {
+        return;
+    }
+    struct TraceEvent *event = &trace_ring[trace_next];
+    snprintf(event->name, sizeof(event->name), "%s", name);
+    event->start_ns = start_ns;
+    event->duration_ns = monotonic_ns() - start_ns;
+
+    trace_next = (trace_next + 1) % TRACE_RING_SIZE;
+    trace_recorded++;
+}
+
+static void print_trace_usage() {
+    printf("Usage: trace on|off|dump <file>\n");
+}
+
+static int dump_trace(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("Failed to open file for trace dump");
+        return -1;
+    }
+
+    // Oldest event first; once the ring wrapped around, it's the one about to be overwritten
+    size_t count = trace_recorded < TRACE_RING_SIZE ? trace_recorded : TRACE_RING_SIZE;
+    size_t first = trace_recorded < TRACE_RING_SIZE ? 0 : trace_next;
+    int pid = (int)getpid();
+
+    // Chrome trace-event format, timestamps in microseconds
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (size_t i = 0; i < count; i++) {
+        const struct TraceEvent *event = &trace_ring[(first + i) % TRACE_RING_SIZE];
+        fprintf(file, "%s\n  {\"name\": \"%s\", \"cat\": \"gogishell\", \"ph\": \"X\", \"ts\": %lld.%03lld, \"dur\": %lld.%03lld, \"pid\": %d, \"tid\": %d}",
+                i == 0 ? "" : ",", event->name,
+                event->start_ns / 1000, event->start_ns % 1000,
+                event->duration_ns / 1000, event->duration_ns % 1000, pid, pid);
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+
+    printf("%zu events written to %s", count, path);
+    if (trace_recorded > count) {
+        printf(" (%zu older events were overwritten)", trace_recorded - count);
+    }
+    printf("\n");
+    return 0;
+}
+
+void trace(char *args[]) {
+    last_status = 1;
+
+    if (args[1] == NULL) {
+        printf("Tracing is %s, %zu events recorded.\n", tracing ? "on" : "off", trace_recorded);
+        last_status = 0;
+    } else if (strcmp(args[1], "on") == 0 && args[2] == NULL) {
+        if (trace_ring == NULL) {
+            trace_ring = malloc(TRACE_RING_SIZE * sizeof(struct TraceEvent));
+            if (trace_ring == NULL) {
+                perror("Failed to allocate trace buffer");
+                return;
+            }
+        }
+        tracing = 1;
+        last_status = 0;
+    } else if (strcmp(args[1], "off") == 0 && args[2] == NULL) {
+        tracing = 0;
+        last_status = 0;
+    } else if (strcmp(args[1], "dump") == 0 && args[2] != NULL && args[3] == NULL) {
+        if (trace_ring == NULL) {
+            printf("Nothing was traced yet, use 'trace on' first.\n");
+            return;
+        }
+        if (dump_trace(args[2]) == 0) {
+            // Every dump starts a fresh recording
+            trace_next = 0;
+            trace_recorded = 0;
+            last_status = 0;
+        }
+    } else {
+        print_trace_usage();
+    }
+}
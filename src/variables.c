@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "headers.h"
+
+extern char **environ;
+
+// One slot of the open-addressing table. The "NAME=value" pair is kept as a single string,
+// so exported variables can be handed to exec as they are, without copying.
+struct Variable {
+    char *pair;     // "NAME=value", NULL if the slot is empty
+    size_t name_length;
+    int exported;
+    int deleted;    // Tombstone left by unset, keeps probe chains intact
+};
+
+int last_status = 0;
+
+static struct Variable *variables = NULL;
+static size_t variables_capacity = 0;
+static size_t variables_used = 0; // Occupied slots including tombstones
+
+static char **environment = NULL; // Cached envp, rebuilt only after an exported variable changes
+static int environment_dirty = 1;
+
+
+unsigned long hash_bytes(const char *data, size_t length) {
+    // FNV-1a
+    unsigned long hash = 2166136261UL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+// Returns the slot holding the name, or the first free slot where it can be inserted
+static struct Variable *find_slot(const char *name, size_t length) {
+    size_t mask = variables_capacity - 1;
+    size_t index = hash_bytes(name, length) & mask;
+    struct Variable *free_slot = NULL;
+
+    while (1) {
+        struct Variable *slot = &variables[index];
+        if (slot->pair == NULL) {
+            if (!slot->deleted) {
+                return free_slot != NULL ? free_slot : slot;
+            }
+            if (free_slot == NULL) {
+                free_slot = slot;
+            }
+        } else if (slot->name_length == length && strncmp(slot->pair, name, length) == 0) {
+            return slot;
+        }
+        index = (index + 1) & mask;
+    }
+}
+
+static void grow_variables() {
+    struct Variable *old = variables;
+    size_t old_capacity = variables_capacity;
+
+    variables_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    variables = calloc(variables_capacity, sizeof(struct Variable));
+    if (variables == NULL) {
+        perror("Failed to allocate variable table");
+        exit(EXIT_FAILURE);
+    }
+    variables_used = 0;
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].pair != NULL) {
+            struct Variable *slot = find_slot(old[i].pair, old[i].name_length);
+            *slot = old[i];
+            variables_used++;
+        }
+    }
+    free(old);
+}
+
+int is_valid_variable_name(const char *name, size_t length) {
+    if (length == 0 || !(isalpha((unsigned char)name[0]) || name[0] == '_')) {
+        return 0;
+    }
+    for (size_t i = 1; i < length; i++) {
+        if (!(isalnum((unsigned char)name[i]) || name[i] == '_')) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void initialize_variables() {
+    grow_variables();
+
+    for (char **entry = environ; entry != NULL && *entry != NULL; entry++) {
+        char *equal_sign = strchr(*entry, '=');
+        if (equal_sign == NULL) {
+            continue;
+        }
+
+        char name[MAX_INPUT_LENGTH];
+        size_t length = equal_sign - *entry;
+        if (length >= sizeof(name)) {
+            continue;
+        }
+        memcpy(name, *entry, length);
+        name[length] = '\0';
+
+        set_variable(name, equal_sign + 1);
+        export_variable(name);
+    }
+}
+
+const char *get_variable_n(const char *name, size_t length) {
+    if (variables_capacity == 0) {
+        return NULL;
+    }
+    struct Variable *slot = find_slot(name, length);
+    if (slot->pair == NULL) {
+        return NULL;
+    }
+    return slot->pair + slot->name_length + 1;
+}
+
+const char *get_variable(const char *name) {
+    return get_variable_n(name, strlen(name));
+}
+
+int set_variable(const char *name, const char *value) {
+    size_t length = strlen(name);
+    if (!is_valid_variable_name(name, length)) {
+        return -1;
+    }
+
+    if ((variables_used + 1) * 10 >= variables_capacity * 7) {
+        grow_variables();
+    }
+
+    size_t value_length = strlen(value);
+    char *pair = malloc(length + value_length + 2);
+    if (pair == NULL) {
+        perror("Failed to allocate variable");
+        return -1;
+    }
+    memcpy(pair, name, length);
+    pair[length] = '=';
+    memcpy(pair + length + 1, value, value_length + 1);
+
+    struct Variable *slot = find_slot(name, length);
+    if (slot->pair != NULL) {
+        free(slot->pair);
+    } else {
+        if (!slot->deleted) {
+            variables_used++;
+        }
+        slot->exported = 0;
+        slot->deleted = 0;
+        slot->name_length = length;
+    }
+    slot->pair = pair;
+
+    if (slot->exported) {
+        environment_dirty = 1;
+    }
+    return 0;
+}
+
+int export_variable(const char *name) {
+    size_t length = strlen(name);
+    if (!is_valid_variable_name(name, length)) {
+        return -1;
+    }
+
+    struct Variable *slot = variables_capacity != 0 ? find_slot(name, length) : NULL;
+    if (slot == NULL || slot->pair == NULL) {
+        // Exporting an undefined name defines it as empty, like other shells do
+        if (set_variable(name, "") == -1) {
+            return -1;
+        }
+        slot = find_slot(name, length);
+    }
+
+    if (!slot->exported) {
+        slot->exported = 1;
+        environment_dirty = 1;
+    }
+    return 0;
+}
+
+void unset_variable(const char *name) {
+    size_t length = strlen(name);
+    if (variables_capacity == 0 || !is_valid_variable_name(name, length)) {
+        return;
+    }
+
+    struct Variable *slot = find_slot(name, length);
+    if (slot->pair == NULL) {
+        return;
+    }
+    if (slot->exported) {
+        environment_dirty = 1;
+    }
+    free(slot->pair);
+    slot->pair = NULL;
+    slot->exported = 0;
+    slot->deleted = 1;
+}
+
+char **get_environment() {
+    if (!environment_dirty) {
+        return environment;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < variables_capacity; i++) {
+        if (variables[i].pair != NULL && variables[i].exported) {
+            count++;
+        }
+    }
+
+    char **rebuilt = realloc(environment, (count + 1) * sizeof(char *));
+    if (rebuilt == NULL) {
+        perror("Failed to build environment");
+        return environ;
+    }
+    environment = rebuilt;
+
+    // Only pointers are collected; the pair strings are shared with the table
+    count = 0;
+    for (size_t i = 0; i < variables_capacity; i++) {
+        if (variables[i].pair != NULL && variables[i].exported) {
+            environment[count++] = variables[i].pair;
+        }
+    }
+    environment[count] = NULL;
+    environment_dirty = 0;
+
+    return environment;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+void print_variables(int exported_only) {
+    size_t count = 0;
+    char **pairs = malloc((variables_capacity + 1) * sizeof(char *));
+    if (pairs == NULL) {
+        perror("Failed to allocate memory");
+        return;
+    }
+
+    for (size_t i = 0; i < variables_capacity; i++) {
+        if (variables[i].pair != NULL && (!exported_only || variables[i].exported)) {
+            pairs[count++] = variables[i].pair;
+        }
+    }
+    qsort(pairs, count, sizeof(char *), compare_pairs);
+
+    for (size_t i = 0; i < count; i++) {
+        printf("%s%s\n", exported_only ? "export " : "", pairs[i]);
+    }
+    free(pairs);
+}
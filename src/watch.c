@@ -0,0 +1,268 @@
+#define _GNU_SOURCE // For nftw() flags and pipe2()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+
+#include "headers.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB)
+#define MAX_WATCH_PATTERNS 16
+
+// Names never watched or reacting, e.g. ".*" keeps .git and editor swap files out
+static const char *excluded_patterns[MAX_WATCH_PATTERNS];
+static int total_excluded_patterns = 0;
+static int watch_fd = -1;
+static int watches = 0;
+static volatile sig_atomic_t watch_interrupted = 0;
+static int interrupt_pipe[2] = {-1, -1}; // Wakes up poll() even if Ctrl-C comes just before it
+
+
+static void interrupt_watch(int signal_number) {
+    (void)signal_number;
+    watch_interrupted = 1;
+    if (write(interrupt_pipe[1], "", 1) == -1) {
+        // The pipe is full, so poll() wakes up anyway
+    }
+}
+
+static int is_excluded(const char *name) {
+    for (int i = 0; i < total_excluded_patterns; i++) {
+        if (fnmatch(excluded_patterns[i], name, 0) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int add_watch(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    // The paths given are watched whatever their names are, excluded directories below them are skipped
+    if (ftw->level > 0 && is_excluded(path + ftw->base)) {
+        return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;
+    }
+    if (type == FTW_D || ftw->level == 0) {
+        if (inotify_add_watch(watch_fd, path, WATCH_EVENTS) == -1) {
+            fprintf(stderr, "watch-run: %s: %s\n", path, strerror(errno));
+        } else {
+            watches++;
+        }
+    }
+    return FTW_CONTINUE;
+}
+
+// Watches path and every directory below it, inotify itself is not recursive
+static void watch_tree(const char *path) {
+    if (nftw(path, add_watch, 16, FTW_PHYS | FTW_ACTIONRETVAL) == -1) {
+        fprintf(stderr, "watch-run: %s: %s\n", path, strerror(errno));
+    }
+}
+
+// Reads all pending events, returns the number of them that should trigger a run
+static int read_watch_events(const char **paths, int total_paths) {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changes = 0;
+    ssize_t length;
+    while ((length = read(watch_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->len > 0 && is_excluded(event->name)) {
+                continue;
+            }
+            // New directories are watched too; their path is found again by walking the tree
+            if ((event->mask & IN_CREATE) && (event->mask & IN_ISDIR)) {
+                for (int i = 0; i < total_paths; i++) {
+                    watch_tree(paths[i]);
+                }
+            }
+            if (!(event->mask & IN_IGNORED)) {
+                changes++;
+            }
+        }
+    }
+    return changes;
+}
+
+// Terminates the whole process group of the run and reaps its leader
+static void cancel_run(struct Job *job) {
+    kill(-job->pid, SIGTERM);
+    for (int i = 0; i < 100; i++) {
+        int status;
+        if (waitpid(job->pid, &status, WNOHANG) == job->pid) {
+            job->running = 0;
+            break;
+        }
+        usleep(10000);
+    }
+    if (job->running) {
+        kill(-job->pid, SIGKILL);
+        int status;
+        wait_for_child(job->pid, &status);
+        job->running = 0;
+    }
+    if (job->pidfd != -1) {
+        close(job->pidfd);
+        job->pidfd = -1;
+    }
+    printf("watch-run: cancelled after %.3fs\n", (monotonic_ns() - job->start_ns) / 1e9);
+}
+
+static void print_watch_usage() {
+    printf("Usage: watch-run [-p <path>] ... [-x <pattern>] ... -- <command> [<argument> ...]\n");
+}
+
+void watch_run(char *args[]) {
+    const char *paths[MAX_WATCH_PATTERNS];
+    int total_paths = 0;
+    char **command = NULL;
+    total_excluded_patterns = 0;
+    last_status = 1;
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (strcmp(args[i], "-p") == 0 && args[i + 1] != NULL && total_paths < MAX_WATCH_PATTERNS) {
+            paths[total_paths++] = args[++i];
+        } else if (strcmp(args[i], "-x") == 0 && args[i + 1] != NULL && total_excluded_patterns < MAX_WATCH_PATTERNS - 1) {
+            excluded_patterns[total_excluded_patterns++] = args[++i];
+        } else if (strcmp(args[i], "--") == 0 && args[i + 1] != NULL) {
+            command = &args[i + 1];
+            break;
+        } else {
+            print_watch_usage();
+            return;
+        }
+    }
+    if (command == NULL) {
+        print_watch_usage();
+        return;
+    }
+    if (total_paths == 0) {
+        paths[total_paths++] = ".";
+    }
+    excluded_patterns[total_excluded_patterns++] = ".*";
+
+    watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch_fd == -1) {
+        perror("Internal function inotify_init1 failed");
+        return;
+    }
+    watches = 0;
+    for (int i = 0; i < total_paths; i++) {
+        watch_tree(paths[i]);
+    }
+    if (watches == 0) {
+        close(watch_fd);
+        return;
+    }
+
+    // Ctrl-C ends watching instead of the shell, the runs are in their own process groups
+    if (pipe2(interrupt_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+        perror("Internal function pipe failed");
+        close(watch_fd);
+        return;
+    }
+    struct sigaction action, previous_action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = interrupt_watch;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, &previous_action);
+    watch_interrupted = 0;
+
+    printf("watch-run: watching %d director%s, Enter runs again, q or Ctrl-C stops\n", watches, watches == 1 ? "y" : "ies");
+    struct Job job = {0};
+    int pending = 1, changes = 0;
+    long long quiet_since = 0;
+    while (!watch_interrupted) {
+        // A run starts once no change came for WATCH_DEBOUNCE_MS, an outdated one is cancelled first
+        long long now = monotonic_ns();
+        int timeout = -1;
+        if (pending) {
+            long long remaining = quiet_since + WATCH_DEBOUNCE_MS * 1000000LL - now;
+            if (remaining <= 0) {
+                if (job.running) {
+                    cancel_run(&job);
+                }
+                if (changes > 0) {
+                    printf("watch-run: %d change%s\n", changes, changes == 1 ? "" : "s");
+                }
+                fflush(stdout);
+                if (start_job(&job, NULL, command, JOB_PROCESS_GROUP) == -1) {
+                    break;
+                }
+                pending = 0;
+                changes = 0;
+            } else {
+                timeout = (int)(remaining / 1000000) + 1;
+            }
+        }
+        if (job.running && job.pidfd == -1 && (timeout == -1 || timeout > 10)) {
+            timeout = 10; // Exits are noticed by waitpid() without a pidfd
+        }
+
+        struct pollfd pollfds[4] = {
+            {watch_fd, POLLIN, 0},
+            {STDIN_FILENO, POLLIN, 0},
+            {job.running ? job.pidfd : -1, POLLIN, 0},
+            {interrupt_pipe[0], POLLIN, 0},
+        };
+        if (poll(pollfds, 4, timeout) == -1) {
+            if (errno != EINTR) {
+                perror("Internal function poll failed");
+                break;
+            }
+            continue;
+        }
+
+        if (pollfds[0].revents & POLLIN) {
+            int new_changes = read_watch_events(paths, total_paths);
+            if (new_changes > 0) {
+                changes += new_changes;
+                pending = 1;
+                quiet_since = monotonic_ns();
+            }
+        }
+        if (pollfds[1].revents & POLLIN) {
+            char key;
+            if (read(STDIN_FILENO, &key, 1) == 1) {
+                if (key == 'q' || key == 4) {
+                    break;
+                }
+                if (key == '\n') {
+                    pending = 1;
+                    quiet_since = 0;
+                }
+            }
+        }
+        int status;
+        if (job.running && ((pollfds[2].revents & POLLIN) || (job.pidfd == -1 && waitpid(job.pid, &status, WNOHANG) == job.pid))) {
+            if (pollfds[2].revents & POLLIN) {
+                wait_for_child(job.pid, &status);
+                close(job.pidfd);
+                job.pidfd = -1;
+            }
+            job.running = 0;
+            last_status = status_to_exit_code(status);
+            printf("watch-run: exit %d after %.3fs, waiting for changes\n", last_status, (monotonic_ns() - job.start_ns) / 1e9);
+            fflush(stdout);
+        }
+    }
+
+    if (job.running) {
+        cancel_run(&job);
+    }
+    sigaction(SIGINT, &previous_action, NULL);
+    close(interrupt_pipe[0]);
+    close(interrupt_pipe[1]);
+    interrupt_pipe[0] = interrupt_pipe[1] = -1;
+    close(watch_fd);
+    watch_fd = -1;
+}
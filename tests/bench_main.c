@@ -0,0 +1,434 @@
+#define _GNU_SOURCE // For memmem()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define SHELL_PATH "./build/GoGiShell"
+#define SANDBOX_DIR "./build/bench/sandbox"
+#define MAX_SAMPLES 1024
+#define OUTPUT_WINDOW 65536
+#define TIMEOUT_MS 60000
+
+// Distinct commands in the synthetic history, .sorted_history keeps at most 1024 of them
+#define DISTINCT_COMMANDS 1000
+#define SYNTHETIC_ABBREVIATIONS 2000
+#define SYNTHETIC_LABELED_DIRECTORIES 2000
+#define PIPELINE_BYTES (64 * 1024 * 1024)
+
+// Peak resident set of a session whatever the size of the cache, as documented in README.md
+#define MEMORY_BUDGET_KIB (6 * 1024)
+
+// A GoGiShell process running on a pseudo-terminal
+struct Session {
+    pid_t pid;
+    int master_fd;
+    char output[OUTPUT_WINDOW]; // Output received since the last send, the oldest bytes are dropped
+    size_t length;
+};
+
+struct Samples {
+    double values[MAX_SAMPLES];
+    int count;
+};
+
+static int runs = 20;
+static char shell_path[PATH_MAX]; // Absolute, the shell is started inside its sandboxed home
+static int rarest_command = 0;     // Last line of the generated .sorted_history
+
+
+static long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void add_sample(struct Samples *samples, double value) {
+    if (samples->count < MAX_SAMPLES) {
+        samples->values[samples->count++] = value;
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double value_a = *(const double *)a;
+    double value_b = *(const double *)b;
+    return (value_a > value_b) - (value_a < value_b);
+}
+
+static double percentile(const double *sorted, int count, int p) {
+    // Nearest-rank percentile
+    int rank = (p * count + 99) / 100;
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[rank - 1];
+}
+
+// One JSON object per line on stdout, so results of two commits can be diffed line by line
+static void report(const char *scenario, const char *metric, const char *unit, struct Samples *samples) {
+    if (samples->count == 0) {
+        fprintf(stderr, "%-16s %-24s no samples\n", scenario, metric);
+        return;
+    }
+
+    qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+    double total = 0;
+    for (int i = 0; i < samples->count; i++) {
+        total += samples->values[i];
+    }
+    double mean = total / samples->count;
+    double p50 = percentile(samples->values, samples->count, 50);
+    double p95 = percentile(samples->values, samples->count, 95);
+    double p99 = percentile(samples->values, samples->count, 99);
+
+    printf("{\"scenario\": \"%s\", \"metric\": \"%s\", \"unit\": \"%s\", \"runs\": %d, \"min\": %.3f, \"mean\": %.3f, "
+           "\"p50\": %.3f, \"p95\": %.3f, \"p99\": %.3f, \"max\": %.3f}\n",
+           scenario, metric, unit, samples->count, samples->values[0], mean, p50, p95, p99,
+           samples->values[samples->count - 1]);
+    fflush(stdout);
+    fprintf(stderr, "%-16s %-24s p50 %12.3f %-4s p99 %12.3f %s\n", scenario, metric, p50, unit, p99, unit);
+}
+
+static void write_file(const char *path, const char *text) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        exit(1);
+    }
+    fputs(text, file);
+    fclose(file);
+}
+
+// Creates HOME/.gogicache as a long-time user would have it
+static void generate_cache(const char *home, int history_entries) {
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/.gogicache", home);
+    mkdir(home, 0755);
+    mkdir(path, 0755);
+
+    snprintf(path, sizeof(path), "%s/.gogicache/.home_path", home);
+    char home_line[PATH_MAX + 1];
+    snprintf(home_line, sizeof(home_line), "%s\n", home);
+    write_file(path, home_line);
+
+    // History cycles through the distinct commands, lower numbers being more frequent
+    snprintf(path, sizeof(path), "%s/.gogicache/.history", home);
+    FILE *file = fopen(path, "w");
+    int counts[DISTINCT_COMMANDS] = {0};
+    for (int i = 0; i < history_entries; i++) {
+        int command = (i * 7919) % DISTINCT_COMMANDS;
+        command = command * command / DISTINCT_COMMANDS;
+        counts[command]++;
+        fprintf(file, "echo synthetic-%04d-end\n", command);
+    }
+    fclose(file);
+
+    // Already sorted by usage, as the shell keeps it
+    snprintf(path, sizeof(path), "%s/.gogicache/.sorted_history", home);
+    file = fopen(path, "w");
+    int written[DISTINCT_COMMANDS] = {0};
+    for (int i = 0; i < DISTINCT_COMMANDS; i++) {
+        int best = -1;
+        for (int j = 0; j < DISTINCT_COMMANDS; j++) {
+            if (!written[j] && counts[j] > 0 && (best == -1 || counts[j] > counts[best])) {
+                best = j;
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        written[best] = 1;
+        rarest_command = best;
+        fprintf(file, "%d echo synthetic-%04d-end\n", counts[best], best);
+    }
+    fclose(file);
+
+    snprintf(path, sizeof(path), "%s/.gogicache/.abbreviation", home);
+    file = fopen(path, "w");
+    fprintf(file, "~:%s\n", home);
+    for (int i = 0; i < SYNTHETIC_ABBREVIATIONS; i++) {
+        fprintf(file, "zq%04d:abbreviation-%d\n", i, i);
+    }
+    fclose(file);
+
+    snprintf(path, sizeof(path), "%s/.gogicache/.labeled_directories", home);
+    file = fopen(path, "w");
+    for (int i = 0; i < SYNTHETIC_LABELED_DIRECTORIES; i++) {
+        fprintf(file, "/nonexistent/labeled-%d:synthetic directory %d:green\n", i, i);
+    }
+    fprintf(file, "%s:benchmark home:blue\n", home);
+    fclose(file);
+}
+
+static void start_session(struct Session *session, const char *home) {
+    int slave_fd;
+
+    if (openpty(&session->master_fd, &slave_fd, NULL, NULL, NULL) == -1) {
+        perror("Internal function openpty failed");
+        exit(1);
+    }
+    session->length = 0;
+
+    session->pid = fork();
+    if (session->pid == -1) {
+        perror("Internal function fork failed");
+        exit(1);
+    }
+    if (session->pid == 0) {
+        close(session->master_fd);
+        // Leading its own session on the PTY, as in a terminal emulator, the shell may attach to a server
+        setsid();
+        ioctl(slave_fd, TIOCSCTTY, 0);
+        dup2(slave_fd, STDIN_FILENO);
+        dup2(slave_fd, STDOUT_FILENO);
+        dup2(slave_fd, STDERR_FILENO);
+        close(slave_fd);
+
+        if (chdir(home) == -1) {
+            perror("Internal function chdir failed");
+            exit(1);
+        }
+        setenv("HOME", home, 1);
+        execl(shell_path, "GoGiShell", NULL);
+        perror("Internal function execl failed");
+        exit(1);
+    }
+    close(slave_fd);
+}
+
+static void send_text(struct Session *session, const char *text) {
+    session->length = 0;
+    if (write(session->master_fd, text, strlen(text)) == -1) {
+        perror("Internal function write failed");
+        exit(1);
+    }
+}
+
+// Reads output until pattern shows up and returns the time it arrived
+static long long wait_for(struct Session *session, const char *pattern) {
+    struct pollfd poll_fd = {session->master_fd, POLLIN, 0};
+
+    while (1) {
+        session->output[session->length] = '\0';
+        if (memmem(session->output, session->length, pattern, strlen(pattern)) != NULL) {
+            return now_ns();
+        }
+
+        if (poll(&poll_fd, 1, TIMEOUT_MS) <= 0) {
+            fprintf(stderr, "Timed out waiting for '%s'\n", pattern);
+            exit(1);
+        }
+        if (session->length > OUTPUT_WINDOW / 2) {
+            size_t keep = OUTPUT_WINDOW / 4;
+            memmove(session->output, session->output + session->length - keep, keep);
+            session->length = keep;
+        }
+        ssize_t bytes_read = read(session->master_fd, session->output + session->length, OUTPUT_WINDOW - 1 - session->length);
+        if (bytes_read <= 0) {
+            fprintf(stderr, "GoGiShell exited while waiting for '%s'\n", pattern);
+            exit(1);
+        }
+        session->length += bytes_read;
+    }
+}
+
+static long long wait_for_prompt(struct Session *session) {
+    // The prompt ends with "$ " after the colored directory
+    return wait_for(session, "$ ");
+}
+
+// Returns the peak resident set of the session in KiB
+static long stop_session(struct Session *session) {
+    send_text(session, "exit\n");
+    wait_for(session, "Thank you for using GoGiShell!");
+    close(session->master_fd);
+    struct rusage usage;
+    if (wait4(session->pid, NULL, 0, &usage) == -1) {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
+
+// Time from enter to the next prompt
+static double time_command(struct Session *session, const char *command) {
+    size_t length = strlen(command);
+    char line[256];
+
+    // Typed first and waited for, so only the execution is measured
+    snprintf(line, sizeof(line), "%.*s", (int)length - 1, command);
+    send_text(session, line);
+    wait_for(session, line);
+
+    long long start = now_ns();
+    send_text(session, "\n");
+    return (wait_for_prompt(session) - start) / 1e3;
+}
+
+static void bench_startup(const char *scenario, const char *metric, const char *home) {
+    struct Samples samples = {{0}, 0};
+    for (int i = 0; i < runs; i++) {
+        struct Session session;
+        long long start = now_ns();
+        start_session(&session, home);
+        add_sample(&samples, (wait_for_prompt(&session) - start) / 1e3);
+        stop_session(&session);
+    }
+    report(scenario, metric, "us", &samples);
+}
+
+// Runs GoGiShell with a single option, e.g. --server, and waits for it to exit
+static void run_shell_option(const char *home, const char *option) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        setenv("HOME", home, 1);
+        execl(shell_path, "GoGiShell", option, NULL);
+        perror("Internal function execl failed");
+        exit(1);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+// Returns 0 if the session went over MEMORY_BUDGET_KIB
+static int bench_session(const char *scenario, const char *home) {
+    struct Session session;
+    struct Samples samples;
+
+    start_session(&session, home);
+    wait_for_prompt(&session);
+
+    samples.count = 0;
+    for (int i = 0; i < runs; i++) {
+        add_sample(&samples, time_command(&session, "true\n"));
+    }
+    report(scenario, "command_overhead", "us", &samples);
+
+    // Keys of abbreviations are looked for in the input, the file is read for every command
+    samples.count = 0;
+    for (int i = 0; i < runs; i++) {
+        add_sample(&samples, time_command(&session, "true zq0001 zq1000 zq1999\n"));
+    }
+    report(scenario, "abbreviation_expansion", "us", &samples);
+
+    // The rarest command is the last line of .sorted_history, the slowest one to find
+    char prefix[64];
+    snprintf(prefix, sizeof(prefix), "echo synthetic-%04d", rarest_command);
+    samples.count = 0;
+    for (int i = 0; i < runs; i++) {
+        send_text(&session, prefix);
+        wait_for(&session, prefix);
+
+        long long start = now_ns();
+        send_text(&session, "\t");
+        add_sample(&samples, (wait_for(&session, "-end") - start) / 1e3);
+
+        send_text(&session, "\n");
+        wait_for_prompt(&session);
+    }
+    report(scenario, "tab_completion", "us", &samples);
+
+    // UP recalls the newest entry, at the end of .history
+    time_command(&session, "echo up-marker\n");
+    samples.count = 0;
+    for (int i = 0; i < runs; i++) {
+        long long start = now_ns();
+        send_text(&session, "\033[A");
+        add_sample(&samples, (wait_for(&session, "echo up-marker") - start) / 1e3);
+
+        send_text(&session, "\n");
+        wait_for_prompt(&session);
+    }
+    report(scenario, "up_arrow", "us", &samples);
+
+    char command[256];
+    snprintf(command, sizeof(command), "head -c %d /dev/zero | cat | cat > /dev/null\n", PIPELINE_BYTES);
+    samples.count = 0;
+    for (int i = 0; i < runs / 4 + 1; i++) {
+        double elapsed_us = time_command(&session, command);
+        add_sample(&samples, PIPELINE_BYTES / elapsed_us); // Bytes per microsecond are MB/s
+    }
+    report(scenario, "pipeline_throughput", "MB/s", &samples);
+
+    // Every cache file is read and rewritten at least once before the peak is taken
+    time_command(&session, "history 10 > /dev/null\n");
+    time_command(&session, "history > /dev/null\n");
+    time_command(&session, "setabbr bench-value zq9999\n");
+    time_command(&session, "ldir . -d relabeled -c blue\n");
+    time_command(&session, "hstat > /dev/null\n");
+
+    samples.count = 0;
+    add_sample(&samples, stop_session(&session));
+    report(scenario, "peak_rss", "KiB", &samples);
+    return samples.values[0] <= MEMORY_BUDGET_KIB;
+}
+
+int main(int argc, char *argv[]) {
+    int sizes[8] = {10000, 100000, 1000000};
+    int num_sizes = 3;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            // Comma separated history sizes, e.g. -s 10000,100000
+            num_sizes = 0;
+            for (char *size = strtok(argv[++i], ","); size != NULL && num_sizes < 8; size = strtok(NULL, ",")) {
+                sizes[num_sizes++] = atoi(size);
+            }
+        } else {
+            fprintf(stderr, "Usage: bench_main [-r <runs>] [-s <history sizes>]\n");
+            return 1;
+        }
+    }
+    if (runs <= 0 || runs > MAX_SAMPLES) {
+        fprintf(stderr, "Runs must be between 1 and %d\n", MAX_SAMPLES);
+        return 1;
+    }
+
+    if (realpath(SHELL_PATH, shell_path) == NULL) {
+        perror(SHELL_PATH);
+        return 1;
+    }
+    mkdir("./build/bench", 0755);
+    mkdir(SANDBOX_DIR, 0755);
+    char sandbox[PATH_MAX];
+    if (realpath(SANDBOX_DIR, sandbox) == NULL) {
+        perror("Internal function realpath failed");
+        return 1;
+    }
+
+    fprintf(stderr, "Starting GoGiShell benchmarks...\n");
+    int within_budget = 1;
+    for (int i = 0; i < num_sizes; i++) {
+        char home[PATH_MAX + 32];
+        char scenario[32];
+        snprintf(home, sizeof(home), "%s/history-%d", sandbox, sizes[i]);
+        snprintf(scenario, sizeof(scenario), "history-%d", sizes[i]);
+
+        generate_cache(home, sizes[i]);
+        bench_startup(scenario, "startup", home);
+
+        // The same shells forked by a server that has read the cache already
+        run_shell_option(home, "--server");
+        bench_startup(scenario, "startup_server", home);
+        run_shell_option(home, "--stop-server");
+
+        if (!bench_session(scenario, home)) {
+            fprintf(stderr, "%s: peak RSS is over the memory budget of %d KiB\n", scenario, MEMORY_BUDGET_KIB);
+            within_budget = 0;
+        }
+    }
+    return within_budget ? 0 : 1;
+}
@@ -3,25 +3,30 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <pty.h>
+#include <sys/ioctl.h>
 #include <ctype.h>
+#include <poll.h>
+#include <time.h>
 
 #define MAX_INPUT 4096
-#define OUTPUT_FILE "./build/test_output.txt"
+#define SHELL_PATH "./build/GoGiShell"
+#define SANDBOX_DIR "./build/tests/sandbox"
+#define REPLAY_CACHE "./build/replay_cache"
+#define OUTPUT_TIMEOUT_MS 10000
+#define MAX_LATENCIES 65536
+#define HISTOGRAM_BUCKETS 18
 
 void trim_whitespace(char *str) {
-    char *end;
-
-    // Trim leading spaces
-    while (isspace((unsigned char)*str)) str++;
-
-    // Trim trailing spaces
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
+    // Trim trailing spaces, leading ones are compared as the expected lines keep them,
+    // a line of spaces only, e.g. "\r\n" of an empty line on the terminal, becomes empty
+    char *end = str + strlen(str);
+    while (end > str && isspace((unsigned char)end[-1])) end--;
 
     // Write new null terminator
-    *(end + 1) = '\0';
+    *end = '\0';
 }
 
 // Function to remove ANSI escape codes from a string
@@ -52,51 +57,545 @@ void strip_ansi_codes(char *str) {
     strncpy(str, clean, MAX_INPUT); // Copy cleaned string back
 }
 
-void compare_output(FILE *file) {
+// History, abbreviations, arrows and redirections
+const char *history_commands[] = {
+    "\n",
+    "echo Hello, GoGiShell!\n",
+    "abbr\n",
+    "history\n",
+    "h\t\n",
+    "history 3\n",
+    "history clear\n",
+    "setabbr Hello Hi\n",
+    "echo Hi, GoGiShell!\n",
+    "abbr\n",
+    "abbr 3\n", // Error
+    "h\t\n",
+    "ec\t One more time!\n",
+    "\033[A\n",
+    "\033[A\033[A\033[A\033[A\033[A\033[A\033[B\n",
+    "abc\n", // Internal error
+    "cd build\n",
+    "home 2\n", // Error
+    "cd ..\n",
+    "echo Hi\b \bello\n",
+    "\033[A\033[A\033[A\033[C\n",
+    "echo Hello GoGiShell > out.txt\n",
+    "cat out.txt\n",
+    "echo Hello, GoGiShell >> out.txt\n",
+    "cat out.txt\n",
+    "grep , < out.txt\n",
+    "echo 11 > out.txt\n",
+    "echo 12 >> out.txt\n",
+    "echo 23 >> out.txt\n",
+    "grep 2 < out.txt | wc -l\n",
+    "rm out.txt\n",
+    "exit\n",
+    NULL
+};
+
+const char *history_expected_outputs[] = {
+    "Hello, GoGiShell!",
+    "1 echo Hello, GoGiShell!",
+    "2 abbr",
+    "3 history",
+    "1 echo Hello, GoGiShell!",
+    "2 abbr",
+    "3 history",
+    "4 history",
+    "3 history",
+    "4 history",
+    "5 history 3",
+    "History was successfully cleared.",
+    "Abbreviation 'Hello' as 'Hi' added.",
+    "Abbreviation file updated successfully.",
+    "Hello, GoGiShell!",
+    "Hi:Hello",
+    "Usage: abbr",
+    "1 setabbr Hello Hi",
+    "2 echo Hi, GoGiShell!",
+    "3 abbr",
+    "4 abbr 3",
+    "5 history",
+    "Hello, GoGiShell! One more time!",
+    "Hello, GoGiShell! One more time!",
+    "Hi:Hello",
+    "No such internal or GoGiShell command: No such file or directory",
+    "Usage: home",
+    "Hello",
+    "Usage: home",
+    "Hello GoGiShell",
+    "Hello GoGiShell",
+    "Hello, GoGiShell",
+    "Hello, GoGiShell",
+    "2",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Variables, command and process substitution
+const char *variables_commands[] = {
+    "export GREETING=Hello\n",
+    "echo $GREETING, '$GREETING' \"${GREETING}!\"\n",
+    "false\n",
+    "echo $?\n",
+    "echo [$(echo one   two)] \"$(printf 'a  b\\n\\n')\"\n",
+    "echo `home` | wc -w\n",
+    "seq 1 100000 | cat | wc -l\n",
+    "paste -d- <(echo pro) <(echo cess)\n",
+    "echo substitution > >(tr a-z A-Z)\n",
+    "'QUOTED=b'\n", // Error, a quoted word is never an assignment
+    "echo [$QUOTED]\n",
+    "PREFIX=1 sh -c 'echo [$PREFIX]'\n",
+    "exit\n",
+    NULL
+};
+
+const char *variables_expected_outputs[] = {
+    "Hello, $GREETING Hello!",
+    "1",
+    "[one two] a  b",
+    "5",
+    "100000",
+    "pro-cess",
+    "SUBSTITUTION",
+    "No such internal or GoGiShell command: No such file or directory",
+    "[]",
+    "[1]",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// A line of 1000 characters, five of them make a here-document longer than a command line may be
+#define TEN_CHARACTERS "xxxxxxxxxx"
+#define HUNDRED_CHARACTERS TEN_CHARACTERS TEN_CHARACTERS TEN_CHARACTERS TEN_CHARACTERS TEN_CHARACTERS \
+    TEN_CHARACTERS TEN_CHARACTERS TEN_CHARACTERS TEN_CHARACTERS TEN_CHARACTERS
+#define LONG_LINE HUNDRED_CHARACTERS HUNDRED_CHARACTERS HUNDRED_CHARACTERS HUNDRED_CHARACTERS HUNDRED_CHARACTERS \
+    HUNDRED_CHARACTERS HUNDRED_CHARACTERS HUNDRED_CHARACTERS HUNDRED_CHARACTERS HUNDRED_CHARACTERS
+
+// Here-documents, fd redirections and fanout
+const char *here_documents_commands[] = {
+    "export GREETING=Hello\n",
+    "cat <<END\n",
+    "$GREETING from here-document\n",
+    "END\n",
+    "tr a-z A-Z <<< $GREETING\n",
+    "cat <<A <<B <<C <<D <<E <<F <<G <<H <<I <<J <<K <<L <<M <<N <<O <<P <<Q\n", // Error
+    "echo $?\n",
+    "sh -c 'stat -L -c %F /dev/stdin; wc -c' <<END\n",
+    LONG_LINE "\n",
+    LONG_LINE "\n",
+    LONG_LINE "\n",
+    LONG_LINE "\n",
+    LONG_LINE "\n",
+    "END\n",
+    "sh -c 'echo out; echo err >&2' 2>&1 >/dev/null\n",
+    "seq 1 5 | fanout fan.txt > /dev/null\n",
+    "wc -l < fan.txt\n",
+    "rm fan.txt\n",
+    "exit\n",
+    NULL
+};
+
+const char *here_documents_expected_outputs[] = {
+    "> $GREETING from here-document",
+    "> END",
+    "Hello from here-document",
+    "HELLO",
+    "Too many here-documents, at most 16 in one command",
+    "2",
+    "> " LONG_LINE,
+    "> " LONG_LINE,
+    "> " LONG_LINE,
+    "> " LONG_LINE,
+    "> " LONG_LINE,
+    "> END",
+    "regular file",
+    "5005",
+    "err",
+    "5",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Timing, benchmarking, tracing and counters
+const char *statistics_commands[] = {
+    "true stats\n",
+    "hstat \"true stats\" | head -1\n",
+    "hstat no-such-command\n",
+    "bench -n 3 -- true | head -2\n",
+    "pipestat seq 1 1000 | grep 7 | wc -l\n",
+    "trace\n",
+    "greet() { echo hello; }\n",
+    "trace on\n",
+    "greet\n",
+    "greet() { echo bye; }\n", // The dump still names the phase of the replaced function
+    "trace dump trace.json > /dev/null\n",
+    "trace off\n",
+    "python3 -c 'import json, sys; names = {e[\"name\"] for e in json.load(open(sys.argv[1]))[\"traceEvents\"] if e[\"ph\"] == \"X\"}; "
+    "print(*[name for name in sys.argv[2:] if name in names], sep=\", \")' trace.json greet 'function parse' parse execute 'exec and wait'\n",
+    "gogistat -r\n",
+    "exit\n",
+    NULL
+};
+
+const char *statistics_expected_outputs[] = {
+    "runs\t1 (0 failed)",
+    "No matching commands.",
+    "Benchmark 1: true",
+    "  runs\t3 (0 failed), 0 warmups",
+    "271",
+    "pipestat: 3 stages in ...",
+    "  stage                                bytes in    bytes out       MB/s        starved  backpressured",
+    "  1 seq 1 1000                                -         3893...",
+    "  2 grep 7                                 3893         1064...",
+    "  3 wc -l                                  1064            -...",
+    "Tracing is off, 0 events recorded.",
+    "hello",
+    "greet, function parse, parse, execute, exec and wait",
+    "Counters were reset.",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Control flow and command lists
+const char *scripting_commands[] = {
+    "for i in 1 2 3; do echo item $i; done\n",
+    "if false; then echo no; elif true; then echo yes; fi\n",
+    "case abc in a|b) echo A;; a*) echo prefix;; esac\n",
+    "for w in a b c\n",
+    "do\n",
+    "if [ $w = c ]; then break; fi\n",
+    "echo $w\n",
+    "done\n",
+    "\033[A\n", // The loop comes back as one line and runs as a whole
+    "history 2\n",
+    "n=0; for i in $(seq 1 1000); do n=$i; done; echo $n\n",
+    "fi\n", // Error
+    "exit\n",
+    NULL
+};
+
+const char *scripting_expected_outputs[] = {
+    "item 1",
+    "item 2",
+    "item 3",
+    "yes",
+    "prefix",
+    "> do",
+    "> if [ $w = c ]; then break; fi",
+    "> echo $w",
+    "> done",
+    "a",
+    "b",
+    "a",
+    "b",
+    "5 for w in a b c; do if [ $w = c ]; then break; fi; echo $w; done",
+    "6 history 2",
+    "1000",
+    "Syntax error: unexpected 'fi'",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Functions with arguments and return codes
+const char *functions_commands[] = {
+    "function greet { echo Hello, $1 with $# args; }\n",
+    "greet World x\n",
+    "sum() { total=0; for n in \"$@\"; do total=$total+$n; done; echo $total; }\n",
+    "sum 1 \"2 3\"\n",
+    "function check { if [ \"$1\" = yes ]; then return 0; fi; return 3; }\n",
+    "check no; echo $?\n",
+    "functions | wc -l\n",
+    "unset -f check\n",
+    "functions | wc -l\n",
+    "exit\n",
+    NULL
+};
+
+const char *functions_expected_outputs[] = {
+    "Hello, World with 2 args",
+    "0+1+2 3",
+    "3",
+    "3",
+    "2",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Jumping to frecent directories by path fragments and ldir descriptions, running commands across labeled ones
+const char *directories_commands[] = {
+    "mkdir -p projects/alpha projects/beta/docs\n",
+    "cd projects/alpha\n",
+    "cd ../beta/docs\n",
+    "cd ../../alpha\n",
+    "z bet doc\n",
+    "basename $(pwd)\n",
+    "z ALPHA\n",
+    "z alp\n",
+    "basename $(pwd)\n",
+    "ldir ../beta -d Release notes > /dev/null\n",
+    "z release\n",
+    "basename $(pwd)\n",
+    "each --label 'Rel*' -- ls | head -n 1\n",
+    "each -P 2 -- false > /dev/null; echo $?\n",
+    "exit\n",
+    NULL
+};
+
+const char *directories_expected_outputs[] = {
+    "docs",
+    "z: no directory matches",
+    "alpha",
+    "You are entering 'Release notes'",
+    "beta",
+    "[Release notes] docs",
+    "1",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Running a command over many items at once, or again on changes
+const char *parallel_commands[] = {
+    "parallel -k -j 3 echo item ::: a b c\n",
+    "seq 4 | parallel -k -j 2 sh -c 'echo $(({} * 10))'\n",
+    "seq 3 | parallel -j 2 sh -c 'exit {}' > /dev/null; echo $?\n",
+    "parallel echo {}\n",
+    "watch-run -p nosuch -- true\n",
+    "watch-run -p .\n",
+    "exit\n",
+    NULL
+};
+
+const char *parallel_expected_outputs[] = {
+    "item a",
+    "item b",
+    "item c",
+    "10",
+    "20",
+    "30",
+    "40",
+    "1",
+    "parallel: items are read from the input, pipe them in or pass them after :::",
+    "watch-run: nosuch: No such file or directory",
+    "Usage: watch-run [-p <path>] ... [-x <pattern>] ... -- <command> [<argument> ...]",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Rerunning a command on changes; the run prints a "> " prompt, so the next key is typed while it runs
+const char *watch_commands[] = {
+    "mkdir watched\n",
+    "watch-run -p watched -- sh -c 'if [ -e watched/done ]; then kill -INT $PPID; sleep 5; else echo run; exec touch watched/done; fi'\n",
+    "watch-run -p watched -- sh -c 'trap \"echo quit; exit\" TERM; printf \"running\\n> \"; sleep 5 & wait'\n",
+    "q",
+    "ls watched\n",
+    "exit\n",
+    NULL
+};
+
+const char *watch_expected_outputs[] = {
+    "watch-run: watching 1 directory, Enter runs again, q or Ctrl-C stops",
+    "run",
+    "watch-run: exit 0 after ...",
+    "watch-run: ...", // Changes seen by the second run
+    "watch-run: cancelled after ...",
+    "watch-run: watching 1 directory, Enter runs again, q or Ctrl-C stops",
+    "running",
+    "> quit", // The shell waits with "wait", which the trap interrupts at once
+    "watch-run: cancelled after ...",
+    "done",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Output of the last commands kept in memory and read again without running them
+const char *outputs_commands[] = {
+    "last\n",
+    "GOGI_CAPTURE=2\n",
+    "sh -c 'test -t 1 && echo tty || echo notty'\n",
+    "seq 3\n",
+    "last | tail -n 1\n",
+    "echo $LAST_OUT\n",
+    "last\n",
+    "last 999\n",
+    "exit\n",
+    NULL
+};
+
+const char *outputs_expected_outputs[] = {
+    "last: capturing is off, set GOGI_CAPTURE=<count> to keep outputs",
+    "tty",
+    "1",
+    "2",
+    "3",
+    "3",
+    "1 2 3",
+    "1",
+    "2",
+    "3",
+    "last: no output captured",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Results of read-only commands stored in the cache directory and printed again without running them
+const char *cached_commands[] = {
+    "cached -- echo stored once\n",
+    "cached -- echo stored once\n",
+    "cached -- sh -c 'echo failed >&2; exit 3'\n",
+    "echo $?\n",
+    "cached -- sh -c 'echo failed >&2; exit 3'\n",
+    "echo $?\n",
+    "cached --clear\n",
+    "exit\n",
+    NULL
+};
+
+const char *cached_expected_outputs[] = {
+    "stored once",
+    "stored once",
+    "failed",
+    "3",
+    "failed",
+    "3",
+    "cached: 2 results removed",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// History moved into compressed segments, numbers and arrows still reach the old entries
+const char *segments_commands[] = {
+    "GOGI_HISTORY_HOT=2\n",
+    "echo one\n",
+    "echo two\n",
+    "echo one\n",
+    "history compact\n",
+    "history 2\n",
+    "\033[A\033[A\033[A\033[A\n",
+    "history clear\n",
+    "history\n",
+    "exit\n",
+    NULL
+};
+
+const char *segments_expected_outputs[] = {
+    "one",
+    "two",
+    "one",
+    "     first       last    entries   distinct        bytes  part",
+    "         1          5          5          4          122  0000000001.seg",
+    "122 bytes on disk for 5 entries",
+    "5 history compact",
+    "6 history 2",
+    "two",
+    "History was successfully cleared.",
+    "1 history",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// Git branch in the prompt, computed in the background and repainted once known or changed
+const char *prompt_commands[] = {
+    "git init -q -b feature repo\n",
+    "cd repo\n",
+    "sleep 0.5\n",
+    "git symbolic-ref HEAD refs/heads/other\n",
+    "sleep 0.5\n",
+    "exit\n",
+    NULL
+};
+
+const char *prompt_expected_outputs[] = {
+    "GoGiShell: (feature)$",
+    "GoGiShell: (other)$",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+// A server started in the sandbox forks shells that lead their own session, e.g. in a terminal of
+// script, and hands their terminal over. Any other shell starts on its own and keeps the terminal
+#define LEADER_CHECK "sh -c '[ $(cut -d\" \" -f6 /proc/$PPID/stat) = $PPID ] && echo forked by the server || echo not forked'\n"
+#define TERMINAL_CHECK "sh -c 'echo terminal > /dev/tty'\n"
+
+const char *server_commands[] = {
+    "../../../GoGiShell --cache-dir served --server\n",
+    "ls -l served/.server | cut -c1-10\n",
+    "script -qc '../../../GoGiShell --cache-dir served' /dev/null\n",
+    LEADER_CHECK,
+    TERMINAL_CHECK,
+    "exit\n",
+    "../../../GoGiShell --cache-dir served\n",
+    LEADER_CHECK,
+    TERMINAL_CHECK,
+    "exit\n",
+    "../../../GoGiShell --cache-dir served --stop-server\n",
+    "../../../GoGiShell --cache-dir served --stop-server\n",
+    "exit\n",
+    NULL
+};
+
+const char *server_expected_outputs[] = {
+    "Home directory is recorded and set as: ...",
+    "Abbreviation '...",
+    "GoGiShell server started with pid ...",
+    "srwx------",
+    "Welcome to GoGiShell!",
+    "Please read the GoGiShell manual by printing 'help'",
+    "forked by the server",
+    "terminal",
+    "Thank you for using GoGiShell!",
+    "Welcome to GoGiShell!",
+    "Please read the GoGiShell manual by printing 'help'",
+    "Home directory is recorded and set as: ...",
+    "Abbreviation for '~' updated to '...",
+    "Abbreviation file updated successfully.",
+    "not forked",
+    "terminal",
+    "Thank you for using GoGiShell!",
+    "GoGiShell server stopped",
+    "GoGiShell server is not running",
+    "Thank you for using GoGiShell!",
+    NULL
+};
+
+struct TestSession {
+    const char *name;
+    const char **commands;
+    const char **expected_outputs;
+};
+
+struct TestSession sessions[] = {
+    {"history", history_commands, history_expected_outputs},
+    {"variables", variables_commands, variables_expected_outputs},
+    {"here_documents", here_documents_commands, here_documents_expected_outputs},
+    {"statistics", statistics_commands, statistics_expected_outputs},
+    {"scripting", scripting_commands, scripting_expected_outputs},
+    {"functions", functions_commands, functions_expected_outputs},
+    {"directories", directories_commands, directories_expected_outputs},
+    {"parallel", parallel_commands, parallel_expected_outputs},
+    {"watch", watch_commands, watch_expected_outputs},
+    {"outputs", outputs_commands, outputs_expected_outputs},
+    {"cached", cached_commands, cached_expected_outputs},
+    {"segments", segments_commands, segments_expected_outputs},
+    {"prompt", prompt_commands, prompt_expected_outputs},
+    {"server", server_commands, server_expected_outputs}
+};
+
+#define NUM_SESSIONS (int)(sizeof(sessions) / sizeof(sessions[0]))
+
+// Returns 1 if the output matches the expected lines of a session
+int compare_output(FILE *file, const char **expected_outputs) {
     char line[MAX_INPUT];
     int skipped_welcome = 0;
     int expected_index = 0;
+    int total_expected = 0;
+    int extra_output = 0;
+
+    while (expected_outputs[total_expected] != NULL) {
+        total_expected++;
+    }
 
-    // Define expected outputs excluding prompts and user inputs
-    const char *expected_outputs[] = {
-        "Hello, GoGiShell!",
-        "1 echo Hello, GoGiShell!",
-        "2 abbr",
-        "3 history",
-        "1 echo Hello, GoGiShell!",
-        "2 abbr",
-        "3 history",
-        "4 history",
-        "3 history",
-        "4 history",
-        "5 history 3",
-        "History was successfully cleared.",
-        "Abbreviation 'Hello' as 'Hi' added.",
-        "Abbreviation file updated successfully.",
-        "Hello, GoGiShell!",
-        "Hi:Hello",
-        "Usage: abbr",
-        "1 setabbr Hello Hi",
-        "2 echo Hi, GoGiShell!",
-        "3 abbr",
-        "4 abbr 3",
-        "5 history",
-        "Hello, GoGiShell! One more time!",
-        "Hello, GoGiShell! One more time!",
-        "Hi:Hello",
-        "No such internal or GoGiShell command: No such file or directory",
-        "Usage: home",
-        "Hello",
-        "Usage: home",
-        "Hello GoGiShell",
-        "Hello GoGiShell",
-        "Hello, GoGiShell",
-        "Hello, GoGiShell",
-        "2",
-        "Thank you for using GoGiShell!"
-    };
-
-    int total_expected = sizeof(expected_outputs) / sizeof(expected_outputs[0]);
 
     // Read output line-by-line
     while (fgets(line, sizeof(line), file)) {
@@ -110,6 +609,16 @@ void compare_output(FILE *file) {
         strip_ansi_codes(line);
         trim_whitespace(line);
 
+        // An expected line starting with "GoGiShell:" waits for a prompt showing the rest of it,
+        // prompts not showing it are skipped as it may only appear once the prompt is repainted
+        const char *expected_prompt = expected_index < total_expected && strstr(expected_outputs[expected_index], "GoGiShell:") == expected_outputs[expected_index]
+                                          ? expected_outputs[expected_index] + strlen("GoGiShell:")
+                                          : NULL;
+        if (strstr(line, "GoGiShell:") == line && expected_prompt != NULL && strstr(line, expected_prompt) != NULL) {
+            expected_index++;
+            continue;
+        }
+
         // Skip prompts, home reliable abbreviations and inputs (lines starting with "GoGiShell:" or empty lines)
         if (strstr(line, "GoGiShell:") == line || strstr(line, "~:") == line || line[0] == '\0') {
             continue;
@@ -122,8 +631,14 @@ void compare_output(FILE *file) {
             strncpy(expected_trimmed, expected_outputs[expected_index], sizeof(expected_trimmed));
             trim_whitespace(expected_trimmed);
 
+            // An expected line ending with "..." only gives the start of the line, e.g. before timings
+            size_t expected_length = strlen(expected_trimmed);
+            int matches = expected_length >= 3 && strcmp(expected_trimmed + expected_length - 3, "...") == 0
+                              ? strncmp(line, expected_trimmed, expected_length - 3) == 0
+                              : strcmp(line, expected_trimmed) == 0;
+
             // Debug output (only print if there is a mismatch)
-            if (strcmp(line, expected_trimmed) != 0) {
+            if (!matches) {
                 printf("Mismatch at line %d: Expected \"%s\", but got \"%s\"\n",
                        expected_index + 1, expected_trimmed, line);
                 break;
@@ -131,50 +646,208 @@ void compare_output(FILE *file) {
             expected_index++;
         } else {
             printf("Unexpected extra output: \"%s\"\n", line);
+            extra_output = 1;
             break;
         }
     }
 
-    // Check for missing expected lines
-    if (expected_index < total_expected) {
-        printf("Failure: some of tests were failed\n");
-    } else {
-        printf("Success: all tests were passed\n");
+    // Missing expected lines fail the session too
+    return expected_index == total_expected && !extra_output;
+}
+
+// Output seen since the last keystroke was sent, searched for its echo or for the next prompt
+char pending[MAX_INPUT * 4 + 1];
+size_t pending_length = 0;
+FILE *output_file;
+
+struct Latencies {
+    double values[MAX_LATENCIES]; // Microseconds
+    int count;
+};
+
+struct Latencies echo_latencies;
+struct Latencies prompt_latencies;
+
+long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void add_latency(struct Latencies *latencies, long long start_ns) {
+    if (latencies->count < MAX_LATENCIES) {
+        latencies->values[latencies->count++] = (now_ns() - start_ns) / 1e3;
+    }
+}
+
+// Reads the next chunk of output into the output file and the pending window
+// Returns 1 if something was read, 0 on timeout and -1 once GoGiShell has exited
+int read_output(int fd, int timeout_ms) {
+    struct pollfd poll_fd = {fd, POLLIN, 0};
+    char buffer[MAX_INPUT];
+
+    if (poll(&poll_fd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+    ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
+    if (bytes_read <= 0) {
+        return -1;
+    }
+    fwrite(buffer, 1, bytes_read, output_file);
+
+    if (pending_length + bytes_read > MAX_INPUT * 4) {
+        // Only the end matters for prompts, the oldest half is dropped
+        memmove(pending, pending + pending_length / 2, pending_length - pending_length / 2);
+        pending_length -= pending_length / 2;
     }
+    memcpy(pending + pending_length, buffer, bytes_read);
+    pending_length += bytes_read;
+    pending[pending_length] = '\0';
+    return 1;
 }
 
-// Function to simulate typing
+int prompt_shown() {
+    // Either the prompt of GoGiShell ending with "$ ", or the "> " asking for a here-document line.
+    // The prompt has to follow the echoed Enter, a repaint of the old one may still arrive before it
+    const char *line_end = strchr(pending, '\n');
+    if (pending_length >= 2 && strcmp(pending + pending_length - 2, "$ ") == 0 && line_end != NULL && strstr(line_end, "GoGiShell:") != NULL) {
+        return 1;
+    }
+    return pending_length >= 3 && strcmp(pending + pending_length - 3, "\n> ") == 0;
+}
+
+int wait_for_output(int fd, int (*shown)(char), char key) {
+    // Returns 0 as soon as shown() is satisfied, -1 on timeout or exit
+    while (!shown(key)) {
+        int result = read_output(fd, OUTPUT_TIMEOUT_MS);
+        if (result == 0) {
+            printf("Timed out waiting for output after key %d\n", key);
+        }
+        if (result != 1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int echo_shown(char key) {
+    return memchr(pending, key, pending_length) != NULL;
+}
+
+int prompt_shown_after(char key) {
+    (void)key;
+    return prompt_shown();
+}
+
+// Sends keystrokes one by one, each one only after GoGiShell has answered the previous one
 void simulate_typing(int fd, const char *text) {
-    for (size_t i = 0; i < strlen(text); i++) {
-        char c = text[i];
-        write(fd, &c, 1);
-        usleep(20000);  // Simulate typing delay (20ms per character)
+    size_t i = 0;
+
+    while (text[i] != '\0') {
+        // Arrow keys arrive as one escape sequence, like from a real terminal
+        size_t key_length = 1;
+        if (text[i] == '\033' && text[i + 1] == '[' && text[i + 2] != '\0') {
+            key_length = 3;
+        }
+        char key = text[i];
+
+        pending_length = 0;
+        pending[0] = '\0';
+        long long start = now_ns();
+        if (write(fd, &text[i], key_length) == -1) {
+            perror("Internal function write failed");
+            exit(1);
+        }
+
+        if (key_length == 1 && (key == '\n' || key == '\r')) {
+            if (wait_for_output(fd, prompt_shown_after, key) == 0) {
+                add_latency(&prompt_latencies, start);
+            }
+        } else if (key_length == 1 && isprint((unsigned char)key)) {
+            if (wait_for_output(fd, echo_shown, key) == 0) {
+                add_latency(&echo_latencies, start);
+            }
+        }
+        // TAB, backspace and arrows may print nothing, the next keystroke waits for them anyway
+        i += key_length;
     }
 }
 
-int main() {
-    int master_fd, slave_fd;
-    pid_t pid;
-    char buffer[MAX_INPUT];
-    ssize_t bytes_read;
+int compare_latencies(const void *a, const void *b) {
+    double latency_a = *(const double *)a;
+    double latency_b = *(const double *)b;
+    return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+// Prints percentiles, and with buckets_shown the whole histogram below them
+void print_histogram(const char *title, struct Latencies *latencies, int buckets_shown) {
+    if (latencies->count == 0) {
+        return;
+    }
+    qsort(latencies->values, latencies->count, sizeof(double), compare_latencies);
+    double p50 = latencies->values[(latencies->count - 1) * 50 / 100];
+    double p99 = latencies->values[(latencies->count - 1) * 99 / 100];
+    printf("%s: %d samples, p50 %.0f us, p99 %.0f us, max %.0f us\n", title, latencies->count, p50, p99,
+           latencies->values[latencies->count - 1]);
+    if (!buckets_shown) {
+        return;
+    }
 
-    printf("Starting GoGiShell testing...\n");
+    // Buckets double from 16 us on, the last one takes everything slower
+    int buckets[HISTOGRAM_BUCKETS] = {0};
+    int largest = 0;
+    for (int i = 0; i < latencies->count; i++) {
+        int bucket = 0;
+        double limit = 16;
+        while (bucket < HISTOGRAM_BUCKETS - 1 && latencies->values[i] >= limit) {
+            bucket++;
+            limit *= 2;
+        }
+        buckets[bucket]++;
+        if (buckets[bucket] > largest) {
+            largest = buckets[bucket];
+        }
+    }
+
+    double limit = 16;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++, limit *= 2) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+        int width = buckets[i] * 40 / largest;
+        if (i == HISTOGRAM_BUCKETS - 1) {
+            printf("  >= %7.0f us | ", limit / 2);
+        } else {
+            printf("  <  %7.0f us | ", limit);
+        }
+        for (int j = 0; j < width; j++) {
+            putchar('#');
+        }
+        printf(" %d\n", buckets[i]);
+    }
+}
+
+pid_t start_shell(int *master_fd, const char *shell, const char *cache_dir) {
+    int slave_fd;
 
-    FILE *file;
     // Open PTY
-    if (openpty(&master_fd, &slave_fd, NULL, NULL, NULL) == -1) {
+    if (openpty(master_fd, &slave_fd, NULL, NULL, NULL) == -1) {
         perror("Internal function openpty failed");
         exit(1);
     }
 
-    pid = fork();
+    pid_t pid = fork();
     if (pid == -1) {
         perror("Internal function fork failed");
         exit(1);
     }
 
     if (pid == 0) {  // Child process (GoGiShell)
-        close(master_fd);
+        close(*master_fd);
+
+        // The PTY becomes the controlling terminal of a new session, as in a terminal emulator
+        setsid();
+        ioctl(slave_fd, TIOCSCTTY, 0);
 
         // Redirect stdin, stdout, and stderr to slave end of the PTY
         dup2(slave_fd, STDIN_FILENO);
@@ -183,93 +856,263 @@ int main() {
 
         close(slave_fd);
 
-        // Execute GoGiShell
-        execlp("./build/GoGiShell", "GoGiShell", NULL);
-        perror("Internal function execlp failed");
+        // Execute GoGiShell with its own cache, so sessions never see each other's history
+        execl(shell, "GoGiShell", "--cache-dir", cache_dir, NULL);
+        perror("Internal function execl failed");
         exit(1);
-    } else {  // Parent process
-        close(slave_fd);
+    }
+    close(slave_fd);
+    return pid;
+}
 
-        // Commands to send to GoGiShell
-        const char *commands[] = {
-            "\n",
-            "echo Hello, GoGiShell!\n",
-            "abbr\n",
-            "history\n",
-            "h\t\n",
-            "history 3\n",
-            "history clear\n",
-            "setabbr Hello Hi\n",
-            "echo Hi, GoGiShell!\n",
-            "abbr\n",
-            "abbr 3\n", // Error
-            "h\t\n",
-            "ec\t One more time!\n",
-            "\033[A\n",
-            "\033[A\033[A\033[A\033[A\033[A\033[A\033[B\n",
-            "abc\n",  // Internal error
-            "cd build\n",
-            "home 2\n",  // Error
-            "cd ..\n",
-            "echo Hi\b \bello\n",
-            "\033[A\033[A\033[A\033[C\n",
-            "echo Hello GoGiShell > out.txt\n",
-            "cat out.txt\n",
-            "echo Hello, GoGiShell >> out.txt\n",
-            "cat out.txt\n",
-            "grep , < out.txt\n",
-            "echo 11 > out.txt\n",
-            "echo 12 >> out.txt\n",
-            "echo 23 >> out.txt\n",
-            "grep 2 < out.txt | wc -l\n",
-            "rm out.txt\n",
-            "exit\n"
-        };
-
-        // Simulate typing commands
-        for (size_t i = 0; i < sizeof(commands) / sizeof(commands[0]); i++) {
-            simulate_typing(master_fd, commands[i]);
-        }
+// Types the whole session and collects everything GoGiShell printed until it exits
+void run_session(const char *shell, const char *cache_dir, const char *output_path, const char *keystrokes, size_t length) {
+    int master_fd;
+    pid_t pid = start_shell(&master_fd, shell, cache_dir);
 
-        // Open file for output
-        file = fopen(OUTPUT_FILE, "w");
-        if (!file) {
-            perror("Failed opening test_output.txt");
-            exit(1);
+    output_file = fopen(output_path, "w");
+    if (!output_file) {
+        perror("Failed opening output file");
+        exit(1);
+    }
+
+    // Nothing is typed before the first prompt, GoGiShell flushes input while switching the terminal mode
+    pending_length = 0;
+    wait_for_output(master_fd, prompt_shown_after, '\n');
+
+    // Keystrokes are typed in lines, so every line is one session step
+    size_t start = 0;
+    char line[MAX_INPUT];
+    while (start < length) {
+        size_t end = start;
+        while (end < length && keystrokes[end] != '\n' && keystrokes[end] != '\r' && end - start < MAX_INPUT - 2) {
+            end++;
+        }
+        if (end < length) {
+            end++;
         }
+        memcpy(line, keystrokes + start, end - start);
+        line[end - start] = '\0';
+        simulate_typing(master_fd, line);
+        start = end;
+    }
+
+    // Read until GoGiShell exits
+    while (read_output(master_fd, OUTPUT_TIMEOUT_MS) == 1) {
+    }
+
+    // Close writing end
+    close(master_fd);
+
+    // Wait for child process to finish
+    if (waitpid(pid, NULL, 0) == -1) {
+        perror("Internal function wait failed");
+        exit(1);
+    }
+
+    fclose(output_file);
+}
 
-        // Read from master_fd and write to file
-        while ((bytes_read = read(master_fd, buffer, sizeof(buffer) - 1)) > 0) {
-            buffer[bytes_read] = '\0';  // Null-terminate
+// Replays keystrokes recorded from a real session, e.g. with "script --log-in", and reports latencies
+int replay(const char *shell, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Failed opening session file");
+        return 1;
+    }
 
-            fprintf(file, "%s", buffer);
-            fflush(file);
+    char *keystrokes = NULL;
+    size_t length = 0, capacity = 0;
+    char chunk[MAX_INPUT];
+    size_t bytes_read;
+    while ((bytes_read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        if (length + bytes_read + sizeof("exit\n") > capacity) {
+            capacity = (length + bytes_read + sizeof("exit\n")) * 2;
+            keystrokes = realloc(keystrokes, capacity);
+            if (keystrokes == NULL) {
+                perror("Failed to allocate memory");
+                return 1;
+            }
         }
+        memcpy(keystrokes + length, chunk, bytes_read);
+        length += bytes_read;
+    }
+    fclose(file);
 
-        // Close writing end
-        close(master_fd);
+    // The session ends in any case, even if the recording doesn't
+    if (keystrokes == NULL) {
+        keystrokes = malloc(sizeof("exit\n"));
+    }
+    memcpy(keystrokes + length, "exit\n", sizeof("exit\n") - 1);
+    length += sizeof("exit\n") - 1;
 
-        // Wait for child process to finish
-        if (wait(NULL) == -1) {
-            perror("Internal function wait failed");
-            exit(1);
+    // Replayed commands go to a sandboxed cache, never to the real one
+    printf("Replaying %s...\n", path);
+    run_session(shell, REPLAY_CACHE, "./build/replay_output.txt", keystrokes, length);
+    free(keystrokes);
+
+    print_histogram("Keystroke to echo", &echo_latencies, 1);
+    print_histogram("Enter to prompt", &prompt_latencies, 1);
+    return 0;
+}
+
+// Runs one session in its own sandbox directory and prints its result, returns 1 if it passed
+int run_test_session(const char *shell, const struct TestSession *session, const char *sandbox) {
+    // The sandbox has a build directory too, sessions cd into it like into the one of the repository
+    char path[MAX_INPUT];
+    snprintf(path, sizeof(path), "%s/build", sandbox);
+    if (mkdir(sandbox, 0755) == -1 || mkdir(path, 0755) == -1 || chdir(sandbox) == -1) {
+        perror("Failed to create sandbox");
+        return 0;
+    }
+
+    size_t length = 0;
+    for (int i = 0; session->commands[i] != NULL; i++) {
+        length += strlen(session->commands[i]);
+    }
+    char *keystrokes = malloc(length + 1);
+    if (keystrokes == NULL) {
+        perror("Failed to allocate memory");
+        return 0;
+    }
+    keystrokes[0] = '\0';
+    for (int i = 0; session->commands[i] != NULL; i++) {
+        strcat(keystrokes, session->commands[i]);
+    }
+
+    snprintf(path, sizeof(path), "%s/cache", sandbox);
+    run_session(shell, path, "output.txt", keystrokes, length);
+    free(keystrokes);
+
+    FILE *file = fopen("output.txt", "r");
+    if (!file) {
+        perror("Failed opening output.txt");
+        return 0;
+    }
+    int passed = compare_output(file, session->expected_outputs);
+    fclose(file);
+
+    printf("Session %s: %s\n", session->name, passed ? "passed" : "failed");
+    print_histogram("  Keystroke to echo", &echo_latencies, 0);
+    print_histogram("  Enter to prompt", &prompt_latencies, 0);
+    return passed;
+}
+
+// Every worker prints into its own log, the logs are shown in order once all of them finished
+void print_log(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return;
+    }
+    char chunk[MAX_INPUT];
+    size_t bytes_read;
+    while ((bytes_read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        fwrite(chunk, 1, bytes_read, stdout);
+    }
+    fclose(file);
+}
+
+void print_usage() {
+    printf("Usage: test_main [-j jobs] [-r repeats] | --replay <keystrokes file>\n");
+}
+
+int main(int argc, char *argv[]) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int repeats = 1;
+
+    char shell[MAX_INPUT];
+    if (realpath(SHELL_PATH, shell) == NULL) {
+        perror("Failed to find " SHELL_PATH);
+        return 1;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "--replay") == 0) {
+        return replay(shell, argv[2]);
+    }
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            jobs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            repeats = atoi(argv[++i]);
+        } else {
+            print_usage();
+            return 1;
         }
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
 
-        fclose(file);
-        printf("GoGiShell results were written.\n");
+    // Every run of a session gets a fresh sandbox with its own cache directory
+    char sandbox_dir[MAX_INPUT];
+    mkdir(SANDBOX_DIR, 0755);
+    if (realpath(SANDBOX_DIR, sandbox_dir) == NULL) {
+        perror("Failed to create " SANDBOX_DIR);
+        return 1;
+    }
 
-        // Reopen output file for comparison
-        file = fopen(OUTPUT_FILE, "r");
-        if (!file) {
-            perror("Failed opening test_output.txt");
-            exit(1);
+    int total_runs = NUM_SESSIONS * repeats;
+    printf("Starting GoGiShell testing: %d sessions, %ld jobs...\n", total_runs, jobs);
+    fflush(stdout);
+
+    pid_t *workers = calloc(total_runs, sizeof(pid_t));
+    int *passed = calloc(total_runs, sizeof(int));
+    if (workers == NULL || passed == NULL) {
+        perror("Failed to allocate memory");
+        return 1;
+    }
+
+    int started = 0, running = 0;
+    while (started < total_runs || running > 0) {
+        if (started < total_runs && running < jobs) {
+            const struct TestSession *session = &sessions[started % NUM_SESSIONS];
+            char sandbox[MAX_INPUT * 2], log_path[MAX_INPUT * 2 + 8];
+            snprintf(sandbox, sizeof(sandbox), "%s/%s-%d", sandbox_dir, session->name, started / NUM_SESSIONS + 1);
+            snprintf(log_path, sizeof(log_path), "%s.log", sandbox);
+
+            pid_t pid = fork();
+            if (pid == 0) {
+                if (freopen(log_path, "w", stdout) == NULL) {
+                    exit(1);
+                }
+                exit(run_test_session(shell, session, sandbox) ? 0 : 1);
+            } else if (pid < 0) {
+                perror("Internal function fork failed");
+                return 1;
+            }
+            workers[started++] = pid;
+            running++;
+            continue;
         }
 
-        printf("Starting comparison...\n");
-        compare_output(file);
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            perror("Internal function wait failed");
+            return 1;
+        }
+        for (int i = 0; i < started; i++) {
+            if (workers[i] == pid) {
+                passed[i] = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            }
+        }
+        running--;
+    }
 
-        fclose(file);
+    int all_passed = 1;
+    for (int i = 0; i < total_runs; i++) {
+        char log_path[MAX_INPUT * 2];
+        snprintf(log_path, sizeof(log_path), "%s/%s-%d.log", sandbox_dir, sessions[i % NUM_SESSIONS].name, i / NUM_SESSIONS + 1);
+        print_log(log_path);
+        all_passed &= passed[i];
+    }
+    free(workers);
+    free(passed);
 
-        return 0;
+    if (all_passed) {
+        printf("Success: all tests were passed\n");
+    } else {
+        printf("Failure: some of tests were failed\n");
     }
+    return 0;
 }